@@ -3,8 +3,11 @@ grammar Bytecode;
 code: instr* EOF;
 instr
     : label* op
+    | directive
     ;
 
+directive: d=('global' | 'extern') name;
+
 label: name ':';
 op
     : opcode intliteral
@@ -62,7 +65,16 @@ opcode
     | 'eqf'
     | 'neqi'
     | 'neqf'
-    | 'end')
+    | 'end'
+    | 'select'
+    | 'tailcall'
+    | 'loadp'
+    | 'storep'
+    | 'loadl'
+    | 'storel'
+    | 'pushl'
+    | 'loadfield'
+    | 'storefield')
     ;
 
 ID
@@ -94,9 +94,10 @@ INT
     : [0-9]+
     ;
 
+// A digit after the point, so 1..10 is a range
 FLOAT
-    : [0-9]+ '.' [0-9]* 
-    | '.' [0-9]+ 
+    : [0-9]+ '.' [0-9]+
+    | '.' [0-9]+
     ;
 
 HEX
@@ -0,0 +1,99 @@
+#include "AST.h"
+
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+struct TypesHash {
+    size_t operator()(const vector<typep> &v) const {
+        size_t h = v.size();
+        for (auto t : v) h = h * 31 + hash<typep>()(t);
+        return h;
+    }
+};
+
+// Composite types are never freed, there are only as many as distinct
+// types written or inferred in the programs compiled by this process.
+// Functions are keyed by their arguments followed by the return type.
+struct TypeTable {
+    mutex lock;
+    Arena arena;
+    unordered_map<vector<typep>, TypeTuple*, TypesHash> tuples;
+    unordered_map<vector<typep>, TypeFunction*, TypesHash> functions;
+    unordered_map<typep, TypeList*> lists;
+    unordered_map<string, TypeObj*> objs;
+};
+
+TypeTable &table() {
+    static TypeTable t;
+    return t;
+}
+
+}
+
+TypeInt *TypeInt::get() {
+    static TypeInt t;
+    return &t;
+}
+
+TypeFloat *TypeFloat::get() {
+    static TypeFloat t;
+    return &t;
+}
+
+TypeBool *TypeBool::get() {
+    static TypeBool t;
+    return &t;
+}
+
+TypeString *TypeString::get() {
+    static TypeString t;
+    return &t;
+}
+
+TypeNil *TypeNil::get() {
+    static TypeNil t;
+    return &t;
+}
+
+TypeVariable *TypeVariable::get() {
+    static TypeVariable t;
+    return &t;
+}
+
+TypeTuple *TypeTuple::get(const vector<typep> &t) {
+    auto &tt = table();
+    lock_guard<mutex> l(tt.lock);
+    auto &p = tt.tuples[t];
+    if (!p) p = tt.arena.make<TypeTuple>(t);
+    return p;
+}
+
+TypeFunction *TypeFunction::get(const vector<typep> &args, typep ret) {
+    auto key = args;
+    key.push_back(ret);
+    auto &tt = table();
+    lock_guard<mutex> l(tt.lock);
+    auto &p = tt.functions[key];
+    if (!p) p = tt.arena.make<TypeFunction>(args, ret);
+    return p;
+}
+
+TypeList *TypeList::get(typep t) {
+    auto &tt = table();
+    lock_guard<mutex> l(tt.lock);
+    auto &p = tt.lists[t];
+    if (!p) p = tt.arena.make<TypeList>(t);
+    return p;
+}
+
+TypeObj *TypeObj::get(const string &name) {
+    auto &tt = table();
+    lock_guard<mutex> l(tt.lock);
+    auto &p = tt.objs[name];
+    if (!p) p = tt.arena.make<TypeObj>(name);
+    return p;
+}
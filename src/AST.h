@@ -1,5 +1,9 @@
 #pragma once
 
+#include "Arena.h"
+#include "Names.h"
+
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <ostream>
@@ -11,56 +15,146 @@ class Lexp;
 class Type;
 class Def;
 
-using expp = std::shared_ptr<Exp>;
+// Nodes live in the Arena of their File, these are plain non-owning pointers
+using expp = Exp*;
 using expl = std::vector<expp>;
-using statp = std::shared_ptr<Stat>;
+using statp = Stat*;
 using block = std::vector<statp>;
 
-using lexpp = std::shared_ptr<Lexp>;
-using typep = std::shared_ptr<Type>;
-using defp = std::shared_ptr<Def>;
+using lexpp = Lexp*;
+using typep = Type*;
+using defp = Def*;
 
 using id = std::string;
 using arglist = std::vector<id>;
 
+// Every node stores the kind of its concrete class, passes switch on it
+// and static_cast instead of going through RTTI. Node classes aren't
+// polymorphic, the arena destroys them through their concrete type.
+enum class TypeKind : uint8_t {
+    Int, Float, Bool, String, Nil, Tuple, Obj, Function, List, Variable
+};
+
+enum class StatKind : uint8_t {
+    Assign, FuncCall, While, If, Block, Break, Return
+};
+
+enum class ExpKind : uint8_t {
+    Nil, Bool, Int, Float, String, Id, List, Tuple, Index, TupleAccess,
+    Call, Ternary, Cast, BinOp, UnaryOp, Logical, Select
+};
+
+// Operators are resolved when type checking, both operands of a binary
+// operator have the same type, which picks between the int and float
+// instructions: Add on ints is Addi, on floats Addf.
+enum class BinOp : uint8_t {
+    Mul, Div, Mod, Add, Sub, Lteq, Lt, Gt, Gteq, Eq, Neq
+};
+
+enum class UnaryOp : uint8_t {
+    Neg, Not
+};
+
+enum class LogicalOp : uint8_t {
+    And, Or
+};
+
+enum class SuffixKind : uint8_t {
+    ListIndex, TupleAccess
+};
+
+// Checked downcast, null if p isn't a T
+template<class T, class B>
+T *as(B *p) {
+    return p && p->kind == T::Kind ? static_cast<T*>(p) : nullptr;
+}
+
+// Types are interned for the whole process: primitives are singletons and
+// composite types are hash-consed by get(), so two types are equal exactly
+// when their pointers are. Never construct or modify one directly.
 class Type {
 public:
-    virtual ~Type() {}
+    const TypeKind kind;
+protected:
+    Type(TypeKind kind) : kind(kind) {}
+};
+
+class TypeInt : public Type {
+public: static const TypeKind Kind = TypeKind::Int;
+    static TypeInt *get();
+private: friend class Arena;
+    TypeInt() : Type(Kind) {}
+};
+class TypeFloat : public Type {
+public: static const TypeKind Kind = TypeKind::Float;
+    static TypeFloat *get();
+private: friend class Arena;
+    TypeFloat() : Type(Kind) {}
+};
+class TypeBool : public Type {
+public: static const TypeKind Kind = TypeKind::Bool;
+    static TypeBool *get();
+private: friend class Arena;
+    TypeBool() : Type(Kind) {}
+};
+class TypeString : public Type {
+public: static const TypeKind Kind = TypeKind::String;
+    static TypeString *get();
+private: friend class Arena;
+    TypeString() : Type(Kind) {}
+};
+class TypeNil : public Type {
+public: static const TypeKind Kind = TypeKind::Nil;
+    static TypeNil *get();
+private: friend class Arena;
+    TypeNil() : Type(Kind) {}
 };
-
-class TypeInt : public Type {};
-class TypeFloat : public Type {};
-class TypeBool : public Type {};
-class TypeString : public Type {};
-class TypeNil : public Type {};
 class TypeTuple : public Type {
-public: std::vector<typep> t;
-    TypeTuple(std::vector<typep> t) : t(t) {}
+public: static const TypeKind Kind = TypeKind::Tuple;
+    static TypeTuple *get(const std::vector<typep> &t);
+    std::vector<typep> t;
+private: friend class Arena;
+    TypeTuple(const std::vector<typep> &t) : Type(Kind), t(t) {}
 };
 class TypeObj : public Type {
-public: std::string name;
-    TypeObj(std::string name) : name(name) {}
+public: static const TypeKind Kind = TypeKind::Obj;
+    static TypeObj *get(const std::string &name);
+    std::string name;
+private: friend class Arena;
+    TypeObj(const std::string &name) : Type(Kind), name(name) {}
 };
 class TypeFunction: public Type {
-public: std::vector<typep> args; typep ret;
-    TypeFunction(std::vector<typep> args, typep ret) : args(args), ret(ret) {}
+public: static const TypeKind Kind = TypeKind::Function;
+    static TypeFunction *get(const std::vector<typep> &args, typep ret);
+    std::vector<typep> args; typep ret;
+private: friend class Arena;
+    TypeFunction(const std::vector<typep> &args, typep ret) : Type(Kind), args(args), ret(ret) {}
 };
 class TypeList: public Type {
-public :typep t;
-    TypeList(typep t) : t(t) {}
+public: static const TypeKind Kind = TypeKind::List;
+    static TypeList *get(typep t);
+    typep t;
+private: friend class Arena;
+    TypeList(typep t) : Type(Kind), t(t) {}
+};
+class TypeVariable : public Type {
+public: static const TypeKind Kind = TypeKind::Variable;
+    static TypeVariable *get();
+private: friend class Arena;
+    TypeVariable() : Type(Kind) {}
 };
-class TypeVariable : public Type {};
 
 
 class ObjDef {
 public:
     std::map<std::string, int> fields;
-    std::shared_ptr<TypeTuple> type;
+    TypeTuple *type;
 };
 
 struct Arg {
     std::string name;
     typep type;
+    symid sym;
 };
 
 class FunctionDef {
@@ -75,47 +169,58 @@ public:
 
 class File {
 public:
+    std::shared_ptr<Arena> arena;
+    // Arenas of earlier compilations holding function bodies reused here
+    std::vector<std::shared_ptr<Arena>> retained;
+    std::shared_ptr<Names> names;
     std::map<std::string, ObjDef> objectDefinitions;
     std::map<std::string, FunctionDef> functions;
 };
 
 class Lexpsuffix {
 public:
-    virtual ~Lexpsuffix() {}
+    const SuffixKind kind;
+protected:
+    Lexpsuffix(SuffixKind kind) : kind(kind) {}
 };
 
 class ListIndexSuffix : public Lexpsuffix {
 public:
-    ListIndexSuffix(expp i) : i(i) {}
+    static const SuffixKind Kind = SuffixKind::ListIndex;
+    ListIndexSuffix(expp i) : Lexpsuffix(Kind), i(i) {}
     expp i;
 };
 
 class TupleAccessSuffix : public Lexpsuffix {
 public:
-    TupleAccessSuffix(int i) : i(i) {}
+    static const SuffixKind Kind = SuffixKind::TupleAccess;
+    TupleAccessSuffix(int i) : Lexpsuffix(Kind), i(i) {}
     int i;
 };
 
 class Lexp {
 public:
-    Lexp(std::string name, std::vector<std::shared_ptr<Lexpsuffix>> suffixes,
-        std::shared_ptr<Type> type) : name(name), suffixes(suffixes), type(type) {}
+    Lexp(std::string name, symid sym, std::vector<Lexpsuffix*> suffixes,
+        typep type) : name(name), sym(sym), suffixes(suffixes), type(type) {}
     std::string name;
-    std::vector<std::shared_ptr<Lexpsuffix>> suffixes;
-    std::shared_ptr<Type> type;
+    symid sym;
+    std::vector<Lexpsuffix*> suffixes;
+    typep type;
 };
 
 
 class Stat {
 public:
-    virtual ~Stat() {}
+    const StatKind kind;
+protected:
+    Stat(StatKind kind) : kind(kind) {}
 };
 
 
 class AssignStat : public Stat {
 public:
-    
-    AssignStat(lexpp left, expp right) {
+    static const StatKind Kind = StatKind::Assign;
+    AssignStat(lexpp left, expp right) : Stat(Kind) {
         this->left = left;
         this->right = right;
     }
@@ -126,8 +231,8 @@ public:
 
 class FuncCallStat : public Stat {
 public:
-    
-    FuncCallStat(lexpp func, expl args) {
+    static const StatKind Kind = StatKind::FuncCall;
+    FuncCallStat(lexpp func, expl args) : Stat(Kind) {
         this->func = func;
         this->args = args;
     }
@@ -138,8 +243,8 @@ public:
 
 class WhileStat : public Stat {
 public:
-    
-    WhileStat(expp cond, statp body) {
+    static const StatKind Kind = StatKind::While;
+    WhileStat(expp cond, statp body) : Stat(Kind) {
         this->cond = cond;
         this->body = body;
     }
@@ -151,8 +256,8 @@ public:
 
 class IfStat : public Stat {
 public:
-    
-    IfStat(expp cond, statp thenbody, statp elsebody) {
+    static const StatKind Kind = StatKind::If;
+    IfStat(expp cond, statp thenbody, statp elsebody) : Stat(Kind) {
         this->cond = cond;
         this->thenbody = thenbody;
         this->elsebody = elsebody;
@@ -165,8 +270,8 @@ public:
 
 class BlockStat : public Stat {
 public:
-    
-    BlockStat(block stats) {
+    static const StatKind Kind = StatKind::Block;
+    BlockStat(block stats) : Stat(Kind) {
         this->stats = stats;
     }
     block stats;
@@ -175,13 +280,14 @@ public:
 
 class BreakStat : public Stat {
 public:
-    
+    static const StatKind Kind = StatKind::Break;
+    BreakStat() : Stat(Kind) {}
 };
 
 class ReturnStat : public Stat {
 public:
-    
-    ReturnStat(expp ret) {
+    static const StatKind Kind = StatKind::Return;
+    ReturnStat(expp ret) : Stat(Kind) {
         this->ret = ret;
     }
     expp ret;
@@ -190,21 +296,24 @@ public:
 
 class Exp {
 public:
-    virtual ~Exp() {}
+    const ExpKind kind;
     typep type = nullptr;
+protected:
+    Exp(ExpKind kind) : kind(kind) {}
 };
 
 class NilExp : public Exp {
 public:
-    NilExp() {type = typep(new TypeNil()); }
+    static const ExpKind Kind = ExpKind::Nil;
+    NilExp() : Exp(Kind) { type = TypeNil::get(); }
 };
 
 
 class BoolExp : public Exp {
 public:
-    
-    BoolExp(bool val) {
-        type = typep(new TypeBool());
+    static const ExpKind Kind = ExpKind::Bool;
+    BoolExp(bool val) : Exp(Kind) {
+        type = TypeBool::get();
         this->val = val;
     }
     bool val;
@@ -213,9 +322,9 @@ public:
 
 class IntExp : public Exp {
 public:
-    
-    IntExp(long val) {
-        type = typep(new TypeInt());
+    static const ExpKind Kind = ExpKind::Int;
+    IntExp(long val) : Exp(Kind) {
+        type = TypeInt::get();
         this->val = val;        
     }
     long val;
@@ -224,9 +333,9 @@ public:
 
 class FloatExp : public Exp {
 public:
-    
-    FloatExp(double val) {
-        type = typep(new TypeFloat());
+    static const ExpKind Kind = ExpKind::Float;
+    FloatExp(double val) : Exp(Kind) {
+        type = TypeFloat::get();
         this->val = val;
     }
     double val;
@@ -235,9 +344,9 @@ public:
 
 class StringExp : public Exp {
 public:
-    
-    StringExp(std::string val) {
-        type = typep(new TypeString());
+    static const ExpKind Kind = ExpKind::String;
+    StringExp(std::string val) : Exp(Kind) {
+        type = TypeString::get();
         this->val = val;
     }
     std::string val;
@@ -246,16 +355,14 @@ public:
 
 class IdExp : public Exp {
 public:
-    
-    IdExp(typep t, id name) {
+    static const ExpKind Kind = ExpKind::Id;
+    IdExp(typep t, id name, symid sym) : Exp(Kind) {
         this->type = t;
         this->name = name;
-    }
-    IdExp(id name) {
-        this->type = nullptr;
-        this->name = name;
+        this->sym = sym;
     }
     id name;
+    symid sym;
 
 };
 
@@ -272,11 +379,11 @@ public:
 
 class ListExp : public Exp {
 public:
-    
-    ListExp(expl elements) {
+    static const ExpKind Kind = ExpKind::List;
+    ListExp(expl elements) : Exp(Kind) {
         // TODO more checking
-        if (elements.size() == 0) type = typep(new TypeList(nullptr));
-        else type = typep(new TypeList(elements[0]->type));
+        if (elements.size() == 0) type = TypeList::get(nullptr);
+        else type = TypeList::get(elements[0]->type);
         this->elements = elements;
     }
     expl elements;
@@ -285,18 +392,18 @@ public:
 
 class TupleExp : public Exp {
 public:
-    
-    TupleExp(expl elements) {
+    static const ExpKind Kind = ExpKind::Tuple;
+    TupleExp(expl elements) : Exp(Kind) {
         std::vector<typep> types;
         for (auto e : elements) {
             types.push_back(e->type);
         }
         this->elements = elements;
-        this->type = typep(new TypeTuple(types));
+        this->type = TypeTuple::get(types);
     }
-    TupleExp(expl elements, std::string obj) {
+    TupleExp(expl elements, std::string obj) : Exp(Kind) {
         this->elements = elements;
-        this->type = typep(new TypeObj(obj));
+        this->type = TypeObj::get(obj);
     }
     expl elements;
 
@@ -304,10 +411,10 @@ public:
 
 class IndexExp : public Exp {
 public:
-    
-    IndexExp(expp left, expp index) {
-        if (!std::dynamic_pointer_cast<TypeInt>(index->type)) throw "index should be an int";
-        if (auto li = std::dynamic_pointer_cast<TypeList>(left->type)) {
+    static const ExpKind Kind = ExpKind::Index;
+    IndexExp(expp left, expp index) : Exp(Kind) {
+        if (!as<TypeInt>(index->type)) throw "index should be an int";
+        if (auto li = as<TypeList>(left->type)) {
             this->type = li->t;
         } else throw std::runtime_error("left isn't a list");
         this->left = left;
@@ -318,14 +425,15 @@ public:
 
 class TupleAccessExp : public Exp {
 public:
-    TupleAccessExp(expp left,int index) {
-        if (auto li = std::dynamic_pointer_cast<TypeTuple>(left->type)) {
+    static const ExpKind Kind = ExpKind::TupleAccess;
+    TupleAccessExp(expp left,int index) : Exp(Kind) {
+        if (auto li = as<TypeTuple>(left->type)) {
             this->type = li->t[index];
         } else throw std::runtime_error("left isn't a list");
         this->left = left;
         this->index = index;
     }
-    TupleAccessExp(expp left,int index, typep t) {
+    TupleAccessExp(expp left,int index, typep t) : Exp(Kind) {
         this->type = t;
         this->left = left;
         this->index = index;
@@ -336,7 +444,8 @@ public:
 
 class CallExp : public Exp {
 public:
-    CallExp(lexpp func, expl args) {
+    static const ExpKind Kind = ExpKind::Call;
+    CallExp(lexpp func, expl args) : Exp(Kind) {
         this->func = func;
         this->args = args;
         this->type = func->type;
@@ -348,9 +457,9 @@ public:
 
 class TernaryExp : public Exp {
 public:
-    
-    TernaryExp(expp then, expp cond, expp els) {
-        if (!std::dynamic_pointer_cast<TypeBool>(cond->type))
+    static const ExpKind Kind = ExpKind::Ternary;
+    TernaryExp(expp then, expp cond, expp els) : Exp(Kind) {
+        if (!as<TypeBool>(cond->type))
             throw std::runtime_error("can't evaluate a non-bool");
         this->then = then;
         this->cond = cond;
@@ -363,8 +472,52 @@ public:
 
 class CastExp : public Exp {
 public:
-    CastExp(expp e, typep t) : e(e) {
+    static const ExpKind Kind = ExpKind::Cast;
+    CastExp(expp e, typep t) : Exp(Kind), e(e) {
+        this->type = t;
+    }
+    expp e;
+};
+
+class BinOpExp : public Exp {
+public:
+    static const ExpKind Kind = ExpKind::BinOp;
+    BinOpExp(BinOp op, expp left, expp right, typep t) : Exp(Kind), op(op), left(left), right(right) {
         this->type = t;
     }
+    BinOp op;
+    expp left, right;
+};
+
+// and/or evaluate their right operand only when the left one doesn't
+// decide the result, code generation lowers them to conditional jumps
+class LogicalExp : public Exp {
+public:
+    static const ExpKind Kind = ExpKind::Logical;
+    LogicalExp(LogicalOp op, expp left, expp right) : Exp(Kind), op(op), left(left), right(right) {
+        this->type = TypeBool::get();
+    }
+    LogicalOp op;
+    expp left, right;
+};
+
+class UnaryOpExp : public Exp {
+public:
+    static const ExpKind Kind = ExpKind::UnaryOp;
+    UnaryOpExp(UnaryOp op, expp e) : Exp(Kind), op(op), e(e) {
+        this->type = e->type;
+    }
+    UnaryOp op;
     expp e;
-};
\ No newline at end of file
+};
+// Ternary whose arms are both evaluated, then one is picked without a
+// branch. Only made by if-conversion, for arms that are cheap and can't
+// fail or have side effects.
+class SelectExp : public Exp {
+public:
+    static const ExpKind Kind = ExpKind::Select;
+    SelectExp(expp cond, expp then, expp els) : Exp(Kind), cond(cond), then(then), els(els) {
+        this->type = then->type;
+    }
+    expp cond, then, els;
+};
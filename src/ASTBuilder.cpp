@@ -0,0 +1,527 @@
+#include "ASTBuilder.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+// Names are shared with earlier compilations whose nodes are reused
+void ASTBuilder::begin(shared_ptr<Names> names) {
+    scope.reset();
+    ast = File();
+    ast.arena = make_shared<Arena>();
+    scope.reset(new ArenaScope(*ast.arena));
+    ast.names = names ? names : make_shared<Names>();
+    symbols = ScopedTable<typep>();
+    newSymbolFrame();
+    loadStd();
+}
+
+File ASTBuilder::end() {
+    popSymbolFrame();
+    scope.reset();
+    return ast;
+}
+
+void ASTBuilder::loadStd() {
+    newSymbol(intern("printf"), TypeFunction::get({TypeString::get(), TypeInt::get()}, TypeNil::get()));
+}
+
+void ASTBuilder::newSymbolFrame() {
+    symbols.push();
+}
+void ASTBuilder::popSymbolFrame() {
+    symbols.pop();
+}
+
+typep ASTBuilder::getSymbol(symid name) {
+    return symbols.get(name);
+}
+
+void ASTBuilder::newSymbol(symid name, typep t) {
+    symbols.set(name, t);
+}
+
+void ASTBuilder::fork(const ASTBuilder &global) {
+    ast = File();
+    ast.arena = make_shared<Arena>();
+    ast.names = global.ast.names;
+    ast.objectDefinitions = global.ast.objectDefinitions;
+    symbols = global.symbols;
+    forked = true;
+}
+
+void ASTBuilder::join(ASTBuilder &worker) {
+    ast.arena->adopt(*worker.ast.arena);
+    ast.functions.insert(worker.ast.functions.begin(), worker.ast.functions.end());
+}
+
+void ASTBuilder::reserveTmps(int n) {
+    for (int i=0;i<n;i++) intern("$" + to_string(i));
+}
+
+symid ASTBuilder::intern(const string &name) {
+    if (!forked) return ast.names->intern(name);
+    symid id;
+    if (!ast.names->find(name, id)) throw runtime_error("Name not interned before checking: " + name);
+    return id;
+}
+
+void ASTBuilder::declareFunction(symid name, vector<Arg> args, typep ret) {
+    if (getSymbol(name)) throw runtime_error("Already used name");
+
+    vector<typep> argst;
+    for (auto a : args) {
+        argst.push_back(a.type);
+    }
+    newSymbol(name, TypeFunction::get(argst, ret));
+}
+
+// Temporaries are numbered per function, so names don't depend on the
+// order bodies are built in
+void ASTBuilder::beginFunction(vector<Arg> args, typep ret) {
+    newSymbolFrame();
+    for (auto a : args) {
+        newSymbol(a.sym, a.type);
+    }
+
+    toReturn = ret;
+    tmpid = 0;
+}
+
+void ASTBuilder::endFunction(symid name, vector<Arg> args, typep ret, block body) {
+    ast.functions.insert({ast.names->name(name), {args, ret, body}});
+    popSymbolFrame();
+}
+
+void ASTBuilder::objDef(string name, vector<Arg> args) {
+    vector<typep> types;
+    map<string, int> fields;
+    for (int i=0;i<args.size();i++) {
+        types.push_back(args[i].type);
+        fields[args[i].name] = i;
+    }
+
+    auto it = ast.objectDefinitions.find(name);
+    if (it == ast.objectDefinitions.end())
+        ast.objectDefinitions.insert({name, {fields, TypeTuple::get(types)}});
+    else throw runtime_error("can't have objects with the same name");
+}
+
+block ASTBuilder::flatten(vector<statp> stats) {
+    block b;
+    for (auto s1 : stats) {
+        if(auto b1 = as<BlockStat>(s1))
+            b.insert(b.end(), b1->stats.begin(), b1->stats.end());
+        else
+            b.push_back(s1);
+    }
+    return b;
+}
+
+statp ASTBuilder::breakStat() {
+    return make<BreakStat>();
+}
+
+statp ASTBuilder::blockStat(vector<statp> stats) {
+    return make<BlockStat>(flatten(stats));
+}
+
+statp ASTBuilder::returnStat(expp ret) {
+    if (!ret) ret = nilExp();
+    if (ret->type != toReturn) throw runtime_error("Can't return this type");
+    return make<ReturnStat>(ret);
+}
+
+statp ASTBuilder::stdAssign(vector<lexpp> lefts, expp e) {
+    if (lefts.size() == 1) {
+        lexpp lexp = lefts[0];
+        if (!getSymbol(lexp->sym)) {
+            if (!lexp->type) lexp->type = e->type;
+            else if (lexp->type != e->type)
+                throw runtime_error("Can't assign with different types");
+            newSymbol(lexp->sym, lexp->type);
+        } else {
+            if (lexp->type != e->type)
+                throw runtime_error("Can't assign with different types");
+        }
+        return make<AssignStat>(lexp, e);
+    } else {
+        if (auto tu = as<TypeTuple>(e->type)) {
+            if (lefts.size() != tu->t.size()) throw runtime_error("Not the same number of values");
+            block out;
+            auto tmp = newtmp();
+            auto tmpsym = intern(tmp);
+            out.push_back(make<AssignStat>(make<Lexp>(tmp, tmpsym, vector<Lexpsuffix*>(), e->type), e));
+            for (int i=0;i<lefts.size();i++) {
+                lexpp lexp = lefts[i];
+                lexp->type = tu->t[i];
+                if (getSymbol(lexp->sym)) throw runtime_error("Multiple assignment should happen on new variables");
+                newSymbol(lexp->sym, lexp->type);
+                out.push_back(make<AssignStat>(
+                    lexp,
+                    make<TupleAccessExp>(
+                            make<IdExp>(e->type, tmp, tmpsym),
+                            i
+                        )
+                ));
+            }
+            return make<BlockStat>(out);
+        } else throw runtime_error("Can't do multiple assignment on non-tuples");
+    }
+}
+
+expp ASTBuilder::toRvalue(lexpp l) {
+    typep t = getSymbol(l->sym);
+    if (!t) throw runtime_error("Can't find variable");
+    expp b = make<IdExp>(t, l->name, l->sym);
+    for (auto s : l->suffixes) {
+        if (auto ind = as<ListIndexSuffix>(s)) {
+            b = make<IndexExp>(b, ind->i);
+        } else if (auto mem = as<TupleAccessSuffix>(s)) {
+            b = make<TupleAccessExp>(b, mem->i);
+        } else throw;
+    }
+    return b;
+
+}
+
+statp ASTBuilder::compoundAssign(string op, lexpp left, expp right) {
+    if (left->type == nullptr) throw runtime_error("Can't compound assign on new variables");
+    return make<AssignStat>(left, binOp(op.substr(0, 1), toRvalue(left), right));
+}
+
+statp ASTBuilder::funcCall(lexpp f, expl args) {
+    validateFuncCall(f, args);
+    return make<FuncCallStat>(f, args);
+}
+
+typep ASTBuilder::validateFuncCall(lexpp f, expl args) {
+    if (auto f0 = as<TypeFunction>(f->type)) {
+        if (args.size() != f0->args.size())
+            throw runtime_error("Not the same number of arguments");
+        for (int i=0;i<args.size();i++) {
+            if (args[i]->type != f0->args[i])
+                throw runtime_error("Argument types don't match");
+        }
+        return f0->ret;
+    } else throw runtime_error("Can't call non-function");
+}
+
+statp ASTBuilder::whileStat(expp cond, statp body) {
+    if (!as<TypeBool>(cond->type))
+        throw runtime_error("Can't evaluate non-bool in while statement");
+
+    return make<WhileStat>(cond, body);
+}
+
+statp ASTBuilder::ifStat(expl conds, vector<statp> bodies, statp els) {
+    for (auto e : conds) {
+        if (!as<TypeBool>(e->type))
+            throw runtime_error("Can't evaluate non-bool in if statement");
+    }
+
+    statp s = els ? els : make<BlockStat>(block());
+    for (int i=conds.size()-1;i>=0;i--) {
+        s = make<IfStat>(conds[i], bodies[i], s);
+    }
+    return s;
+}
+
+void ASTBuilder::forVariable(symid name, const expl &range) {
+    if (range.size() != 2) throw runtime_error("for only iterates over ranges [a..b]");
+    for (auto e : range) {
+        if (!as<TypeInt>(e->type)) throw runtime_error("Range bounds must be ints");
+    }
+    typep t = getSymbol(name);
+    if (t && !as<TypeInt>(t)) throw runtime_error("Loop variable must be an int");
+    loopHides.push_back(t != nullptr);
+    newSymbolFrame();
+    newSymbol(name, TypeInt::get());
+}
+
+// i takes each value from a to b excluded, b is evaluated once before the
+// loop. A hidden counter drives it, so assigning i in the body doesn't
+// change the iterations:
+// { $k = a; $n = b; while $k < $n { i = $k; $k = $k + 1; body } }
+// Locals share a cell by name in the backends, an i from outside the loop
+// is saved in $o around it.
+statp ASTBuilder::forStat(symid name, expl range, statp body) {
+    popSymbolFrame();
+    bool hides = loopHides.back();
+    loopHides.pop_back();
+    auto &var = ast.names->name(name);
+    auto local = [&](const string &n, symid s) {
+        return make<Lexp>(n, s, vector<Lexpsuffix*>(), TypeInt::get());
+    };
+    auto read = [&](const string &n, symid s) {
+        return make<IdExp>(TypeInt::get(), n, s);
+    };
+    auto k = newtmp(), n = newtmp(), o = newtmp();
+    auto ksym = intern(k), nsym = intern(n), osym = intern(o);
+    block loop = {
+        make<AssignStat>(local(var, name), read(k, ksym)),
+        make<AssignStat>(local(k, ksym), binOp("+", read(k, ksym), intExp("1"))),
+        body
+    };
+    block out;
+    if (hides) out.push_back(make<AssignStat>(local(o, osym), read(var, name)));
+    out.push_back(make<AssignStat>(local(k, ksym), range[0]));
+    out.push_back(make<AssignStat>(local(n, nsym), range[1]));
+    out.push_back(whileStat(binOp("<", read(k, ksym), read(n, nsym)), make<BlockStat>(flatten(loop))));
+    if (hides) out.push_back(make<AssignStat>(local(var, name), read(o, osym)));
+    return make<BlockStat>(out);
+}
+
+expp ASTBuilder::nilExp() {
+    return make<NilExp>();
+}
+
+expp ASTBuilder::boolExp(bool val) {
+    return make<BoolExp>(val);
+}
+
+expp ASTBuilder::intExp(string text) {
+    if (text.size() > 1 && (text[1] == 'x' || text[1] == 'X'))
+        return make<IntExp>(stol(text, nullptr, 16));
+    return make<IntExp>(stol(text));
+}
+
+expp ASTBuilder::floatExp(string text) {
+    return make<FloatExp>(stod(text));
+}
+
+// The lexer has no escapes, \n \t and \\ are decoded here
+expp ASTBuilder::stringExp(string text) {
+    string val;
+    for (size_t i=1;i+1<text.length();i++) {
+        char c = text[i];
+        if (c == '\\' && i+2 < text.length()) {
+            char c1 = text[i+1];
+            if (c1 == 'n' || c1 == 't' || c1 == '\\') {
+                c = c1 == 'n' ? '\n' : c1 == 't' ? '\t' : '\\';
+                i++;
+            }
+        }
+        val += c;
+    }
+    return make<StringExp>(val);
+}
+
+expp ASTBuilder::idExp(symid name) {
+    typep t = getSymbol(name);
+    if (!t) throw runtime_error("Use of inexistent variable");
+
+    return make<IdExp>(t, ast.names->name(name), name);
+}
+
+expp ASTBuilder::memberExp(expp l, string fieldname) {
+    if (auto obj = as<TypeObj>(l->type)) {
+        auto name = obj->name;
+        int index = getFieldIndex(name, fieldname);
+        auto t = ast.objectDefinitions[name].type->t[index];
+        return make<TupleAccessExp>(l, index, t);
+    } else throw runtime_error("can't access member from non-object");
+
+}
+
+expp ASTBuilder::indexExp(expp l, expp r) {
+    return make<IndexExp>(l, r);
+}
+
+static BinOp binOpOf(const string &op) {
+    static const map<string, BinOp> ops = {
+        {"*", BinOp::Mul}, {"/", BinOp::Div}, {"%", BinOp::Mod}, {"+", BinOp::Add},
+        {"-", BinOp::Sub}, {"<=", BinOp::Lteq}, {"<", BinOp::Lt}, {">", BinOp::Gt},
+        {">=", BinOp::Gteq}, {"==", BinOp::Eq}, {"!=", BinOp::Neq},
+    };
+    auto it = ops.find(op);
+    if (it == ops.end()) throw runtime_error("Unknown binary operation");
+    return it->second;
+}
+
+// Overloads: arithmetic and comparisons on ints or floats, % on ints,
+// equality also on bools, and/or on bools. There are no implicit
+// conversions, operands must have the same type.
+expp ASTBuilder::binOp(string op, expp l, expp r) {
+    if (op == "and" || op == "or") {
+        if (l->type != TypeBool::get() || r->type != TypeBool::get())
+            throw runtime_error("Can't apply " + op + " to non-bools");
+        return make<LogicalExp>(op == "and" ? LogicalOp::And : LogicalOp::Or, l, r);
+    }
+    auto o = binOpOf(op);
+    typep t = l->type;
+    if (t != r->type) throw runtime_error("Can't apply " + op + " to different types");
+    bool number = t == TypeInt::get() || t == TypeFloat::get();
+    typep ret;
+    switch (o) {
+        case BinOp::Mul:
+        case BinOp::Div:
+        case BinOp::Add:
+        case BinOp::Sub:
+            if (!number) throw runtime_error("Can't apply " + op + " to non-numbers");
+            ret = t;
+            break;
+        case BinOp::Mod:
+            if (t != TypeInt::get()) throw runtime_error("Can't apply % to non-ints");
+            ret = t;
+            break;
+        case BinOp::Lteq:
+        case BinOp::Lt:
+        case BinOp::Gt:
+        case BinOp::Gteq:
+            if (!number) throw runtime_error("Can't compare non-numbers");
+            ret = TypeBool::get();
+            break;
+        case BinOp::Eq:
+        case BinOp::Neq:
+            if (!number && t != TypeBool::get()) throw runtime_error("Can't compare these types");
+            ret = TypeBool::get();
+            break;
+    }
+    return make<BinOpExp>(o, l, r, ret);
+}
+
+expp ASTBuilder::unaryOp(string op, expp e) {
+    if (op == "-") {
+        if (e->type != TypeInt::get() && e->type != TypeFloat::get())
+            throw runtime_error("Can't negate a non-number");
+        return make<UnaryOpExp>(UnaryOp::Neg, e);
+    } else if (op == "not") {
+        if (e->type != TypeBool::get()) throw runtime_error("Can't apply not to a non-bool");
+        return make<UnaryOpExp>(UnaryOp::Not, e);
+    }
+    throw runtime_error("Unknown unary operation");
+}
+
+expp ASTBuilder::ternaryExp(expp then, expp cond, expp els) {
+    return make<TernaryExp>(then, cond, els);
+}
+
+expp ASTBuilder::callExp(lexpp f, expl args) {
+    typep ret = validateFuncCall(f, args);
+    Exp *e = make<CallExp>(f, args);
+    e->type = ret;
+    return expp(e);
+}
+
+expp ASTBuilder::objExp(string name, vector<FieldDef> fields) {
+    auto it = ast.objectDefinitions.find(name);
+    if (it == ast.objectDefinitions.end()) throw runtime_error("Not an object");
+
+    auto indmap = it->second.fields;
+    auto t = it->second.type;
+
+    expl values(t->t.size(), nullptr);
+
+    for (auto value : fields) {
+        auto it2 = indmap.find(value.name);
+        if (it2 == indmap.end()) throw runtime_error("can't find field");
+        auto i = it2->second;
+        auto e = value.e;
+        if (e->type != t->t[i]) {
+            throw runtime_error("field types don't match");
+        }
+        values[i] = e;
+    }
+    return make<TupleExp>(values, name);
+}
+
+expp ASTBuilder::listExp(expl elements) {
+    return make<ListExp>(elements);
+}
+
+expp ASTBuilder::tupleExp(expl elements) {
+    return make<TupleExp>(elements);
+}
+
+expp ASTBuilder::castExp(expp e, typep t) {
+    return make<CastExp>(e, t);
+}
+
+lexpp ASTBuilder::lexp(symid name, vector<SuffixArg> suffixes) {
+    auto t = getSymbol(name);
+
+    // New symbol
+    if (!t) {
+        if (suffixes.size() > 0)
+            throw runtime_error("Can't index into newly created variable");
+        return idToLexp(name);
+    }
+    // Existing symbol
+    vector<Lexpsuffix*> l;
+    for (auto suf : suffixes) {
+        // Index
+        if (suf.index) {
+            expp s0 = suf.index;
+            // TODO separate tuple and list access
+            if (auto li = as<TypeList>(t)) {
+                if (!as<TypeInt>(s0->type)) throw runtime_error("Can't index into list with non-int");
+                l.push_back(make<ListIndexSuffix>(s0));
+                t = li->t;
+            } else if (auto tu = as<TypeTuple>(t)) {
+                if (auto i = as<IntExp>(s0)) {
+                    l.push_back(make<TupleAccessSuffix>(i->val));
+                    t = tu->t[i->val];
+                } else throw runtime_error("can't index into tuple with non-const, non-int");
+            } else throw runtime_error("Can't index into non-list");
+        }
+        // Member
+        else {
+            if (auto o = as<TypeObj>(t)) {
+                int index = getFieldIndex(o->name, suf.member);
+                l.push_back(make<TupleAccessSuffix>(index));
+                t = ast.objectDefinitions[o->name].type->t[index];
+            } else throw runtime_error("Can't access member from non-object");
+
+        }
+    }
+    return make<Lexp>(ast.names->name(name), name, l, t);
+}
+
+lexpp ASTBuilder::lexpOptType(lexpp l, typep t) {
+    if (t) {
+        if (!l->type) l->type = t;
+        else if (t != l->type)
+            throw runtime_error("Unmatched types");
+    }
+    return l;
+}
+
+typep ASTBuilder::primitiveType(string name) {
+    if (name == "int") return TypeInt::get();
+    else if (name == "float") return TypeFloat::get();
+    else if (name == "bool") return TypeBool::get();
+    else if (name == "string") return TypeString::get();
+    else if (name == "nil") return TypeNil::get();
+    throw runtime_error("incorrect primitive type");
+}
+
+typep ASTBuilder::tupleType(vector<typep> t) {
+    return TypeTuple::get(t);
+}
+
+typep ASTBuilder::objType(string name) {
+    return TypeObj::get(name);
+}
+
+typep ASTBuilder::funcType(vector<typep> args, typep ret) {
+    return TypeFunction::get(args, ret);
+}
+
+typep ASTBuilder::listType(typep t) {
+    return TypeList::get(t);
+}
+
+lexpp ASTBuilder::idToLexp(symid name) {
+    return make<Lexp>(ast.names->name(name), name, vector<Lexpsuffix*>(), nullptr);
+}
+
+int ASTBuilder::getFieldIndex(string obj, string name) {
+    auto it = ast.objectDefinitions.find(obj);
+    if (it == ast.objectDefinitions.end()) throw runtime_error("Object definition does not exist");
+    auto od = it->second;
+    auto it2 = od.fields.find(name);
+    if (it2 == od.fields.end()) throw runtime_error("Can't find field");
+    return it2->second;
+}
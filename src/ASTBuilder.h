@@ -0,0 +1,104 @@
+#pragma once
+
+#include "AST.h"
+
+#include <string>
+
+// Either an index expression or a member name, as written after a lexp
+struct SuffixArg {
+    expp index;
+    std::string member;
+};
+
+// Type checking and lowering shared by the front-ends. Parsers first
+// declare every object type and function signature, then build function
+// bodies, which only see those globals and so can be built in any order.
+class ASTBuilder {
+public:
+    void begin(std::shared_ptr<Names> names = nullptr);
+    File end();
+
+    void declareFunction(symid name, std::vector<Arg> args, typep ret);
+    void beginFunction(std::vector<Arg> args, typep ret);
+    void endFunction(symid name, std::vector<Arg> args, typep ret, block body);
+    void objDef(std::string name, std::vector<Arg> args);
+
+    block flatten(std::vector<statp> stats);
+    statp breakStat();
+    statp blockStat(std::vector<statp> stats);
+    statp returnStat(expp ret);
+    statp stdAssign(std::vector<lexpp> lefts, expp e);
+    statp compoundAssign(std::string op, lexpp left, expp right);
+    statp funcCall(lexpp f, expl args);
+    statp whileStat(expp cond, statp body);
+    statp ifStat(expl conds, std::vector<statp> bodies, statp els);
+    // Declares the loop variable in a scope of its own, before the body is
+    // built. forStat closes it.
+    void forVariable(symid name, const expl &range);
+    statp forStat(symid name, expl range, statp body);
+
+    expp nilExp();
+    expp boolExp(bool val);
+    expp intExp(std::string text);
+    expp floatExp(std::string text);
+    expp stringExp(std::string text);
+    expp idExp(symid name);
+    expp memberExp(expp l, std::string fieldname);
+    expp indexExp(expp l, expp r);
+    expp binOp(std::string op, expp l, expp r);
+    expp unaryOp(std::string op, expp e);
+    expp ternaryExp(expp then, expp cond, expp els);
+    expp callExp(lexpp f, expl args);
+    expp objExp(std::string name, std::vector<FieldDef> fields);
+    expp listExp(expl elements);
+    expp tupleExp(expl elements);
+    expp castExp(expp e, typep t);
+
+    lexpp lexp(symid name, std::vector<SuffixArg> suffixes);
+    lexpp lexpOptType(lexpp l, typep t);
+
+    typep primitiveType(std::string name);
+    typep tupleType(std::vector<typep> t);
+    typep objType(std::string name);
+    typep funcType(std::vector<typep> args, typep ret);
+    typep listType(typep t);
+
+protected:
+    void loadStd();
+
+    // A worker builds bodies against the globals of another builder, in its
+    // own arena and symbol scope. join() takes back what it built.
+    void fork(const ASTBuilder &global);
+    void join(ASTBuilder &worker);
+    // Workers can't intern, temporaries they may need are interned first
+    void reserveTmps(int n);
+    bool forked = false;
+
+    ScopedTable<typep> symbols;
+    void newSymbolFrame();
+    void popSymbolFrame();
+    typep getSymbol(symid name);
+    void newSymbol(symid name, typep t);
+    symid intern(const std::string &name);
+
+    typep toReturn = nullptr;
+
+    int getFieldIndex(std::string obj, std::string name);
+    typep validateFuncCall(lexpp f, expl args);
+
+    lexpp idToLexp(symid name);
+
+    std::unique_ptr<ArenaScope> scope;
+
+    // Of each for loop being built, whether its variable hides one
+    std::vector<bool> loopHides;
+
+    int tmpid = 0;
+    std::string newtmp() {
+        return "$" + std::to_string(tmpid++);
+    }
+
+    expp toRvalue(lexpp l);
+
+    File ast;
+};
@@ -1,16 +1,15 @@
 #pragma once
 
 #include "AST.h"
+#include "ASTBuilder.h"
 
 #include "parser/PhilippeBaseVisitor.h"
 
-class ASTGen : public PhilippeBaseVisitor {
+class ASTGen : public PhilippeBaseVisitor, public ASTBuilder {
 public:
 
-    expp exp_option(PhilippeParser::ExpContext *e);
-    statp stat_option(PhilippeParser::StatContext *s);
-    statp visitIfAux(PhilippeParser::IfstatContext *ctx, int index);
     expp visitBinOp(std::string op, PhilippeParser::ExpContext *left, PhilippeParser::ExpContext *right);
+    std::vector<statp> visitStats(std::vector<PhilippeParser::StatContext*> stats);
 
     File gen(PhilippeParser::FileContext *ctx);
 
@@ -62,34 +61,13 @@ public:
     virtual antlrcpp::Any visitFunctype(PhilippeParser::FunctypeContext *ctx)  override;
     virtual antlrcpp::Any visitListtype(PhilippeParser::ListtypeContext *ctx)  override;
 
-
 private:
-    void loadStd();
-
-    void inferTypes();
-    void inferTypes(statp s);
-    typep inferTypes(expp e);
-    typep inferTypes(lexpp l);
-
-    std::vector<std::map<std::string, typep>> symbols;
-    void newSymbolFrame();
-    void popSymbolFrame();
-    typep getSymbol(std::string name);
-    void newSymbol(std::string name, typep t);
-
-    typep toReturn = nullptr;
-
-    int getFieldIndex(std::string obj, std::string name);
-    typep validateFuncCall(lexpp f, expl args);
-
-    lexpp idToLexp(std::string name);
-
-    int tmpid = 0;
-    std::string newtmp() {
-        return "$" + tmpid++;
-    }
-
-    expp toRvalue(lexpp l);
+    struct Body {
+        symid name;
+        std::vector<Arg> args;
+        typep ret;
+        PhilippeParser::FunctiondefContext *ctx;
+    };
+    std::vector<Body> bodies;
 
-    File ast;
 };
\ No newline at end of file
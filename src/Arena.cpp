@@ -0,0 +1,62 @@
+#include "Arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std;
+
+static thread_local Arena *currentArena = nullptr;
+
+Arena *Arena::current() {
+    if (!currentArena) throw runtime_error("No arena to allocate nodes in");
+    return currentArena;
+}
+
+void *Arena::allocate(size_t size, size_t align) {
+    auto p = (char*)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+    if (!ptr || p + size > end) {
+        auto s = max(blockSize, size + align);
+        blocks.emplace_back(new char[s]);
+        ptr = blocks.back().get();
+        end = ptr + s;
+        if (blockSize < (4 << 20)) blockSize *= 2;
+        p = (char*)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    ptr = p + size;
+    total += size;
+    return p;
+}
+
+void Arena::reset() {
+    for (auto it = dtors.rbegin(); it != dtors.rend(); it++) {
+        it->destroy(it->obj);
+    }
+    dtors.clear();
+    blocks.clear();
+    ptr = end = nullptr;
+    blockSize = 64 << 10;
+    total = 0;
+    count = 0;
+}
+
+void Arena::adopt(Arena &other) {
+    for (auto &b : other.blocks) blocks.push_back(move(b));
+    dtors.insert(dtors.end(), other.dtors.begin(), other.dtors.end());
+    total += other.total;
+    count += other.count;
+    other.blocks.clear();
+    other.dtors.clear();
+    other.ptr = other.end = nullptr;
+    other.blockSize = 64 << 10;
+    other.total = 0;
+    other.count = 0;
+}
+
+ArenaScope::ArenaScope(Arena &a) : prev(currentArena) {
+    currentArena = &a;
+}
+
+ArenaScope::~ArenaScope() {
+    currentArena = prev;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator holding every node of one compilation. Nodes are never
+// freed one by one, reset() or destroying the arena releases them all.
+// Destructors still run, in reverse order, for nodes that own vectors
+// or strings.
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    ~Arena() { reset(); }
+
+    template<class T, class... Args>
+    T *make(Args&&... args) {
+        void *p = allocate(sizeof(T), alignof(T));
+        T *t = new (p) T(std::forward<Args>(args)...);
+        count++;
+        if (!std::is_trivially_destructible<T>::value)
+            dtors.push_back({t, [](void *o) { static_cast<T*>(o)->~T(); }});
+        return t;
+    }
+
+    void *allocate(size_t size, size_t align);
+    void reset();
+    size_t used() const { return total; }
+    size_t nodes() const { return count; }
+
+    // Takes over every block and destructor of other, which is left empty.
+    // Nodes keep their addresses, so pointers into other stay valid.
+    void adopt(Arena &other);
+
+    // Arena new nodes go to, set for the duration of an ArenaScope
+    static Arena *current();
+
+private:
+    friend class ArenaScope;
+
+    struct Dtor {
+        void *obj;
+        void (*destroy)(void *);
+    };
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<Dtor> dtors;
+    char *ptr = nullptr;
+    char *end = nullptr;
+    size_t blockSize = 64 << 10;
+    size_t total = 0;
+    size_t count = 0;
+};
+
+class ArenaScope {
+public:
+    ArenaScope(Arena &a);
+    ~ArenaScope();
+private:
+    Arena *prev;
+};
+
+template<class T, class... Args>
+T *make(Args&&... args) {
+    return Arena::current()->make<T>(std::forward<Args>(args)...);
+}
@@ -4,17 +4,28 @@
 #include "parser/BytecodeLexer.h"
 #include "parser/BytecodeBaseVisitor.h"
 
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace std;
 using namespace antlr4;
 
 using addressmap = std::map<std::string, uint64_t>;
 
 addressmap stdlib = {
-    {"printf", Printf}
+    {"printf", Printf},
+    {"strlen", Strlen},
+    {"strcat", Strcat},
+    {"strcmp", Strcmp},
+    {"substr", Substr},
 };
 
-vector<int64_t> stringArrayToCode(std::string str) {
-    vector<int64_t> s;
+// Bytes of a quoted string literal, escapes resolved
+string unquote(const std::string &str) {
+    string s;
     for (int i=1;i<str.size()-1;i++) {
         char c = str[i];
         if (c == '\\') {
@@ -29,8 +40,6 @@ vector<int64_t> stringArrayToCode(std::string str) {
             s.push_back(c);
         }
     }
-    s.push_back('\0');
-    if (s.size()%2 == 1) s.push_back('\0');
     return s;
 }
 
@@ -39,16 +48,33 @@ public:
     virtual antlrcpp::Any visitCode(BytecodeParser::CodeContext *ctx) override {
         a = 0;
         labels.clear();
+        pool.clear();
         visitChildren(ctx);
         return labels;
     }
 
+    // A string literal already placed in the object isn't placed again,
+    // the labels on the repeat point at the first one. Strings are never
+    // written to, sharing them can't be told apart.
     virtual antlrcpp::Any visitInstr(BytecodeParser::InstrContext *ctx) override {
+        if (ctx->op() && ctx->op()->stringarray()) {
+            auto s = unquote(ctx->op()->stringarray()->STRING()->getText());
+            auto it = pool.find(s);
+            if (it != pool.end()) {
+                for (auto l : ctx->label()) define(l->name()->getText(), it->second);
+                return nullptr;
+            }
+            pool[s] = a;
+        }
         return visitChildren(ctx);
     }
 
+    virtual antlrcpp::Any visitDirective(BytecodeParser::DirectiveContext *ctx) override {
+        return nullptr;
+    }
+
     virtual antlrcpp::Any visitLabel(BytecodeParser::LabelContext *ctx) override {
-        labels[ctx->name()->getText()] = a;
+        define(ctx->name()->getText(), a);
         return nullptr;
     }
 
@@ -68,38 +94,48 @@ public:
             || op == "free"
             || op == "call"
             || op == "ifjump"
-            || op == "jump") a+=2;
+            || op == "jump"
+            || op == "tailcall"
+            || op == "loadfield"
+            || op == "storefield") a+=2;
             else a+=1;
         }
         return nullptr;
     }
 
     virtual antlrcpp::Any visitStringarray(BytecodeParser::StringarrayContext *ctx) override {
-        auto str = ctx->STRING()->getText();
-        a += stringArrayToCode(str).size();
+        a += packString(unquote(ctx->STRING()->getText())).size();
         return nullptr;
     }
 private:
     uint64_t a;
     addressmap labels;
+    map<string, uint64_t> pool;
+
+    void define(const string &name, uint64_t address) {
+        if (labels.count(name)) throw runtime_error("Label defined twice : " + name);
+        labels[name] = address;
+    }
 };
 
 class Assembler : BytecodeBaseVisitor {
 public:
-    vmcode run(std::string assembly) {
+    ObjectFile run(std::string assembly) {
         ANTLRInputStream input(assembly);
         BytecodeLexer lexer(&input);
         CommonTokenStream tokens(&lexer);
         BytecodeParser parser(&tokens);    
         BytecodeParser::CodeContext* tree = parser.code();
 
-        auto labels = LabelResolve().visitCode(tree).as<addressmap>();
-        this->addresses.insert(labels.begin(), labels.end());
-        this->addresses.insert(stdlib.begin(), stdlib.end());
-        code.clear();
+        obj = ObjectFile();
+        placed.clear();
+        obj.symbols = LabelResolve().visitCode(tree).as<addressmap>();
         visitCode(tree);
 
-        return code;
+        for (auto e : obj.exports) {
+            if (!obj.symbols.count(e)) throw runtime_error("Exported label isn't defined : " + e);
+        }
+        return obj;
     }
 
     virtual antlrcpp::Any visitCode(BytecodeParser::CodeContext *ctx) override {
@@ -110,6 +146,14 @@ public:
         return visitChildren(ctx);
     }
 
+    virtual antlrcpp::Any visitDirective(BytecodeParser::DirectiveContext *ctx) override {
+        string d = ctx->d->getText();
+        string name = visit(ctx->name());
+        if (d == "global") obj.exports.insert(name);
+        else if (d == "extern") obj.imports.insert(name);
+        return nullptr;
+    }
+
     virtual antlrcpp::Any visitLabel(BytecodeParser::LabelContext *ctx) override {
         return visitChildren(ctx);
     }
@@ -159,29 +203,52 @@ public:
             else if (op == "neqi") i0 = Neqi;
             else if (op == "neqf") i0 = Neqf;
             else if (op == "end") i0 = End;
-            code.push_back(i0);
+            else if (op == "select") i0 = Select;
+            else if (op == "tailcall") i0 = TailCall;
+            else if (op == "loadp") i0 = LoadP;
+            else if (op == "storep") i0 = StoreP;
+            else if (op == "loadl") i0 = LoadL;
+            else if (op == "storel") i0 = StoreL;
+            else if (op == "pushl") i0 = PushL;
+            else if (op == "loadfield") i0 = LoadField;
+            else if (op == "storefield") i0 = StoreField;
+            obj.code.push_back(i0);
 
             if (i0 == LoadS || i0 == LoadM || i0 == Store || i0 == Alloc || i0 == Free || i0 == Call ||
-                i0 == IfJump || i0 == Jump) {
+                i0 == IfJump || i0 == Jump || i0 == TailCall || i0 == LoadField || i0 == StoreField) {
                 int64_t i1 = Noop;
                 if (ctx->intliteral()) i1 = visit(ctx->intliteral());
                 else if (ctx->floatliteral()) i1 = visit(ctx->floatliteral());
-                else if (ctx->name()) i1 = addresses[visit(ctx->name())];
+                else if (ctx->name()) i1 = resolve(visit(ctx->name()));
                 else throw;
-                code.push_back(i1);
+                obj.code.push_back(i1);
             }
 
         } else if (ctx->stringarray()) {
-            vector<int64_t> s = visit(ctx->stringarray());
-            code.insert(code.end(), s.begin(), s.end());
+            auto s = unquote(ctx->stringarray()->STRING()->getText());
+            if (placed.insert(s).second) {
+                auto packed = packString(s);
+                obj.code.insert(obj.code.end(), packed.begin(), packed.end());
+            }
         } else if (ctx->intl) {
-            code.push_back(visit(ctx->intl).as<int64_t>());
+            obj.code.push_back(visit(ctx->intl).as<int64_t>());
         } else if (ctx->floatl) {
-            code.push_back(visit(ctx->floatl).as<int64_t>());
+            obj.code.push_back(visit(ctx->floatl).as<int64_t>());
         }
         return nullptr;
     }
 
+    // Labels are left to the linker, only library functions have a fixed address
+    int64_t resolve(string name) {
+        if (!obj.symbols.count(name) && !obj.imports.count(name)) {
+            auto it = stdlib.find(name);
+            if (it != stdlib.end()) return it->second;
+            throw runtime_error("Undefined label : " + name);
+        }
+        obj.relocations.push_back({obj.code.size(), name});
+        return 0;
+    }
+
     virtual antlrcpp::Any visitIntliteral(BytecodeParser::IntliteralContext *ctx) override {
         stringstream ss;
         ss << ctx->INT()->getText();
@@ -206,16 +273,157 @@ public:
         return ctx->o->getText();
     }
 
-    virtual antlrcpp::Any visitStringarray(BytecodeParser::StringarrayContext *ctx) override {
-        auto str = ctx->STRING()->getText();
-        return stringArrayToCode(str);
-    }
-
-    addressmap addresses;
-    vmcode code;
+    ObjectFile obj;
+    set<string> placed;
 
 };
 
 vmcode assemble(string assembly) {
+    return link({assembleObject(assembly)});
+}
+
+ObjectFile assembleObject(string assembly) {
     return Assembler().run(assembly);
+}
+
+vector<ObjectFile> assembleObjects(vector<string> assemblies) {
+    vector<future<ObjectFile>> jobs;
+    for (auto &a : assemblies) {
+        jobs.push_back(async(launch::async, assembleObject, a));
+    }
+    vector<ObjectFile> objects;
+    for (auto &j : jobs) {
+        objects.push_back(j.get());
+    }
+    return objects;
+}
+
+ObjectFile assembleFile(string srcpath, string objpath, bool *reused) {
+    struct stat src, obj;
+    if (reused) *reused = false;
+    if (stat(srcpath.c_str(), &src) != 0) throw runtime_error("Can't open " + srcpath);
+    // Strictly newer to the nanosecond, an object written in the same tick
+    // as an edit is assembled again
+    if (stat(objpath.c_str(), &obj) == 0 && (obj.st_mtim.tv_sec > src.st_mtim.tv_sec
+        || (obj.st_mtim.tv_sec == src.st_mtim.tv_sec && obj.st_mtim.tv_nsec > src.st_mtim.tv_nsec))) {
+        ifstream in(objpath, ios::binary);
+        if (reused) *reused = true;
+        return readObject(in);
+    }
+
+    ifstream in(srcpath);
+    stringstream ss;
+    ss << in.rdbuf();
+    auto o = assembleObject(ss.str());
+    // Written to a private file then renamed, like CompileCache: an
+    // interrupted run leaves no truncated object newer than its source
+    auto tmp = objpath + "." + to_string(getpid()) + ".tmp";
+    {
+        ofstream out(tmp, ios::binary);
+        writeObject(out, o);
+        out.close();
+        if (!out) {
+            unlink(tmp.c_str());
+            return o;
+        }
+    }
+    if (rename(tmp.c_str(), objpath.c_str()) != 0) unlink(tmp.c_str());
+    return o;
+}
+
+vmcode link(vector<ObjectFile> objects) {
+    addressmap globals;
+    vector<uint64_t> bases;
+    uint64_t size = 0;
+    for (auto &o : objects) {
+        bases.push_back(size);
+        for (auto e : o.exports) {
+            if (globals.count(e)) throw runtime_error("Label exported twice : " + e);
+            globals[e] = size + o.symbols.at(e);
+        }
+        size += o.code.size();
+    }
+
+    vmcode code;
+    code.reserve(size);
+    for (int i=0;i<objects.size();i++) {
+        auto &o = objects[i];
+        code.insert(code.end(), o.code.begin(), o.code.end());
+        for (auto &r : o.relocations) {
+            uint64_t addr;
+            auto local = o.symbols.find(r.symbol);
+            if (local != o.symbols.end()) addr = bases[i] + local->second;
+            else {
+                auto global = globals.find(r.symbol);
+                if (global == globals.end()) throw runtime_error("Unresolved label : " + r.symbol);
+                addr = global->second;
+            }
+            code[bases[i] + r.offset] = addr;
+        }
+    }
+    return code;
+}
+
+static const char objectMagic[4] = {'P', 'H', 'O', '2'};
+
+static void writeu64(ostream &out, uint64_t v) {
+    out.write((const char*)&v, sizeof(v));
+}
+
+static void writestr(ostream &out, const string &s) {
+    writeu64(out, s.size());
+    out.write(s.data(), s.size());
+}
+
+static uint64_t readu64(istream &in) {
+    uint64_t v;
+    if (!in.read((char*)&v, sizeof(v))) throw runtime_error("Truncated object file");
+    return v;
+}
+
+static string readstr(istream &in) {
+    string s(readu64(in), '\0');
+    if (!in.read(&s[0], s.size())) throw runtime_error("Truncated object file");
+    return s;
+}
+
+void writeObject(ostream &out, const ObjectFile &obj) {
+    out.write(objectMagic, sizeof(objectMagic));
+    writeu64(out, obj.code.size());
+    out.write((const char*)obj.code.data(), obj.code.size()*sizeof(int64_t));
+    writeu64(out, obj.symbols.size());
+    for (auto &s : obj.symbols) {
+        writestr(out, s.first);
+        writeu64(out, s.second);
+    }
+    writeu64(out, obj.exports.size());
+    for (auto &e : obj.exports) writestr(out, e);
+    writeu64(out, obj.imports.size());
+    for (auto &i : obj.imports) writestr(out, i);
+    writeu64(out, obj.relocations.size());
+    for (auto &r : obj.relocations) {
+        writeu64(out, r.offset);
+        writestr(out, r.symbol);
+    }
+}
+
+ObjectFile readObject(istream &in) {
+    char magic[4];
+    if (!in.read(magic, sizeof(magic)) || !equal(magic, magic+4, objectMagic))
+        throw runtime_error("Not an object file");
+    ObjectFile obj;
+    obj.code.resize(readu64(in));
+    if (!in.read((char*)obj.code.data(), obj.code.size()*sizeof(int64_t)))
+        throw runtime_error("Truncated object file");
+    for (auto n = readu64(in); n > 0; n--) {
+        auto name = readstr(in);
+        obj.symbols[name] = readu64(in);
+    }
+    for (auto n = readu64(in); n > 0; n--) obj.exports.insert(readstr(in));
+    for (auto n = readu64(in); n > 0; n--) obj.imports.insert(readstr(in));
+    for (auto n = readu64(in); n > 0; n--) {
+        auto offset = readu64(in);
+        obj.relocations.push_back({offset, readstr(in)});
+    }
+    return obj;
 }
\ No newline at end of file
@@ -2,4 +2,33 @@
 
 #include "VirtualMachine.h"
 
-vmcode assemble(std::string assembly);
\ No newline at end of file
+#include <set>
+#include <string>
+
+// Operand cell that must be patched with the final address of symbol
+struct Relocation {
+    uint64_t offset;
+    std::string symbol;
+};
+
+// Separately assembled module, with label addresses relative to its start
+struct ObjectFile {
+    vmcode code;
+    std::map<std::string, uint64_t> symbols;
+    std::set<std::string> exports;
+    std::set<std::string> imports;
+    std::vector<Relocation> relocations;
+};
+
+vmcode assemble(std::string assembly);
+
+ObjectFile assembleObject(std::string assembly);
+std::vector<ObjectFile> assembleObjects(std::vector<std::string> assemblies);
+// Reuses objpath if it is newer than srcpath, otherwise assembles and writes it.
+// reused tells which happened.
+ObjectFile assembleFile(std::string srcpath, std::string objpath, bool *reused = nullptr);
+
+vmcode link(std::vector<ObjectFile> objects);
+
+void writeObject(std::ostream &out, const ObjectFile &obj);
+ObjectFile readObject(std::istream &in);
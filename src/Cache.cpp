@@ -0,0 +1,635 @@
+#include "Cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char cacheMagic[4] = {'P', 'H', 'C', '1'};
+static const string cacheSuffix = ".phc";
+
+CompileCache::CompileCache(string dir, uint64_t maxSize) : dir(dir), maxSize(maxSize) {
+    mkdir(dir.c_str(), 0755);
+}
+
+string CompileCache::key(const string &source, const string &options) {
+    // FNV-1a over the compiler version, the options and the source text
+    uint64_t h = 0xcbf29ce484222325;
+    auto mix = [&h](const string &s) {
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 0x100000001b3;
+        }
+    };
+    mix(PHILIPPE_VERSION);
+    mix(string(1, '\0'));
+    mix(options);
+    mix(string(1, '\0'));
+    mix(source);
+
+    stringstream ss;
+    ss << hex << setw(16) << setfill('0') << h;
+    return ss.str();
+}
+
+string CompileCache::path(const string &key) {
+    return dir + "/" + key + cacheSuffix;
+}
+
+static bool readu64(istream &in, uint64_t &v) {
+    return (bool)in.read((char*)&v, sizeof(v));
+}
+
+static void writeu64(ostream &out, uint64_t v) {
+    out.write((const char*)&v, sizeof(v));
+}
+
+bool CompileCache::lookup(const string &key, CacheEntry &entry) {
+    auto p = path(key);
+    ifstream in(p, ios::binary);
+    if (!in) return false;
+
+    char magic[4];
+    if (!in.read(magic, sizeof(magic)) || !equal(magic, magic+4, cacheMagic)) return false;
+
+    string k(key.size(), '\0');
+    if (!in.read(&k[0], k.size()) || k != key) return false;
+
+    uint64_t n;
+    if (!readu64(in, n)) return false;
+    entry.code.resize(n);
+    if (!in.read((char*)entry.code.data(), n*sizeof(int64_t))) return false;
+
+    if (!readu64(in, n)) return false;
+    entry.ast.resize(n);
+    if (!in.read(&entry.ast[0], n)) return false;
+
+    // Touch the entry so eviction sees it as recently used
+    utimes(p.c_str(), nullptr);
+    return true;
+}
+
+void CompileCache::store(const string &key, const CacheEntry &entry) {
+    if (write(key, entry)) evict();
+}
+
+bool CompileCache::write(const string &key, const CacheEntry &entry) {
+    // Write to a private file then rename, readers never see a partial entry
+    auto p = path(key);
+    auto tmp = p + "." + to_string(getpid()) + ".tmp";
+    {
+        ofstream out(tmp, ios::binary);
+        if (!out) return false;
+        out.write(cacheMagic, sizeof(cacheMagic));
+        out.write(key.data(), key.size());
+        writeu64(out, entry.code.size());
+        out.write((const char*)entry.code.data(), entry.code.size()*sizeof(int64_t));
+        writeu64(out, entry.ast.size());
+        out.write(entry.ast.data(), entry.ast.size());
+        if (!out) {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), p.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void CompileCache::evict() {
+    auto lockpath = dir + "/lock";
+    int fd = open(lockpath.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) return;
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return;
+    }
+
+    struct File {
+        string path;
+        uint64_t size;
+        time_t used;
+    };
+    vector<File> files;
+    uint64_t total = 0;
+
+    if (DIR *d = opendir(dir.c_str())) {
+        while (auto e = readdir(d)) {
+            string name = e->d_name;
+            if (name.size() <= cacheSuffix.size()
+                || name.compare(name.size()-cacheSuffix.size(), cacheSuffix.size(), cacheSuffix) != 0)
+                continue;
+            auto p = dir + "/" + name;
+            struct stat st;
+            if (stat(p.c_str(), &st) != 0) continue;
+            files.push_back({p, (uint64_t)st.st_size, st.st_mtime});
+            total += st.st_size;
+        }
+        closedir(d);
+    }
+
+    if (total > maxSize) {
+        sort(files.begin(), files.end(), [](const File &a, const File &b) {
+            return a.used < b.used;
+        });
+        for (auto &f : files) {
+            if (total <= maxSize) break;
+            if (unlink(f.path.c_str()) == 0) total -= f.size;
+        }
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+namespace {
+
+// Checked nodes, written depth first with integers as varints. Names are
+// written out and interned again when read, types are rebuilt through their
+// get() factories. A composite type seen before in the same function is
+// written as a back reference.
+const uint8_t none = 0xff;
+const uint8_t seenType = 0xfe;
+
+struct Writer {
+    string out;
+    unordered_map<typep, uint64_t> types;
+
+    void u8(uint8_t v) { out.push_back(v); }
+    void u64(uint64_t v) {
+        for (; v >= 0x80; v >>= 7) out.push_back((char)(v | 0x80));
+        out.push_back((char)v);
+    }
+    void str(const string &s) {
+        u64(s.size());
+        out += s;
+    }
+
+    void type(typep t) {
+        if (!t) return u8(none);
+        auto it = types.find(t);
+        if (it != types.end()) {
+            u8(seenType);
+            return u64(it->second);
+        }
+        u8((uint8_t)t->kind);
+        switch (t->kind) {
+            case TypeKind::Tuple: {
+                auto tu = static_cast<TypeTuple*>(t);
+                u64(tu->t.size());
+                for (auto e : tu->t) type(e);
+                break;
+            }
+            case TypeKind::Obj: str(static_cast<TypeObj*>(t)->name); break;
+            case TypeKind::Function: {
+                auto f = static_cast<TypeFunction*>(t);
+                u64(f->args.size());
+                for (auto a : f->args) type(a);
+                type(f->ret);
+                break;
+            }
+            case TypeKind::List: type(static_cast<TypeList*>(t)->t); break;
+            default: return;
+        }
+        auto n = types.size();
+        types[t] = n;
+    }
+
+    void exps(const expl &l) {
+        u64(l.size());
+        for (auto e : l) exp(e);
+    }
+
+    void lexp(lexpp l) {
+        str(l->name);
+        type(l->type);
+        u64(l->suffixes.size());
+        for (auto s : l->suffixes) {
+            u8((uint8_t)s->kind);
+            if (s->kind == SuffixKind::ListIndex) exp(static_cast<ListIndexSuffix*>(s)->i);
+            else u64(static_cast<TupleAccessSuffix*>(s)->i);
+        }
+    }
+
+    void exp(expp e) {
+        if (!e) return u8(none);
+        u8((uint8_t)e->kind);
+        type(e->type);
+        switch (e->kind) {
+            case ExpKind::Nil: break;
+            case ExpKind::Bool: u8(static_cast<BoolExp*>(e)->val); break;
+            case ExpKind::Int: u64(static_cast<IntExp*>(e)->val); break;
+            case ExpKind::Float: {
+                uint64_t v;
+                memcpy(&v, &static_cast<FloatExp*>(e)->val, sizeof(v));
+                u64(v);
+                break;
+            }
+            case ExpKind::String: str(static_cast<StringExp*>(e)->val); break;
+            case ExpKind::Id: str(static_cast<IdExp*>(e)->name); break;
+            case ExpKind::List: exps(static_cast<ListExp*>(e)->elements); break;
+            case ExpKind::Tuple: exps(static_cast<TupleExp*>(e)->elements); break;
+            case ExpKind::Index: {
+                auto i = static_cast<IndexExp*>(e);
+                exp(i->left);
+                exp(i->index);
+                break;
+            }
+            case ExpKind::TupleAccess: {
+                auto t = static_cast<TupleAccessExp*>(e);
+                exp(t->left);
+                u64(t->index);
+                break;
+            }
+            case ExpKind::Call: {
+                auto c = static_cast<CallExp*>(e);
+                lexp(c->func);
+                exps(c->args);
+                break;
+            }
+            case ExpKind::Ternary: {
+                auto t = static_cast<TernaryExp*>(e);
+                exp(t->then);
+                exp(t->cond);
+                exp(t->els);
+                break;
+            }
+            case ExpKind::Cast: exp(static_cast<CastExp*>(e)->e); break;
+            case ExpKind::BinOp: {
+                auto b = static_cast<BinOpExp*>(e);
+                u8((uint8_t)b->op);
+                exp(b->left);
+                exp(b->right);
+                break;
+            }
+            case ExpKind::UnaryOp: {
+                auto u = static_cast<UnaryOpExp*>(e);
+                u8((uint8_t)u->op);
+                exp(u->e);
+                break;
+            }
+            case ExpKind::Logical: {
+                auto b = static_cast<LogicalExp*>(e);
+                u8((uint8_t)b->op);
+                exp(b->left);
+                exp(b->right);
+                break;
+            }
+            case ExpKind::Select: {
+                auto s = static_cast<SelectExp*>(e);
+                exp(s->cond);
+                exp(s->then);
+                exp(s->els);
+                break;
+            }
+        }
+    }
+
+    void stat(statp s) {
+        if (!s) return u8(none);
+        u8((uint8_t)s->kind);
+        switch (s->kind) {
+            case StatKind::Assign: {
+                auto a = static_cast<AssignStat*>(s);
+                lexp(a->left);
+                exp(a->right);
+                break;
+            }
+            case StatKind::FuncCall: {
+                auto c = static_cast<FuncCallStat*>(s);
+                lexp(c->func);
+                exps(c->args);
+                break;
+            }
+            case StatKind::While: {
+                auto w = static_cast<WhileStat*>(s);
+                exp(w->cond);
+                stat(w->body);
+                break;
+            }
+            case StatKind::If: {
+                auto i = static_cast<IfStat*>(s);
+                exp(i->cond);
+                stat(i->thenbody);
+                stat(i->elsebody);
+                break;
+            }
+            case StatKind::Block: stats(static_cast<BlockStat*>(s)->stats); break;
+            case StatKind::Break: break;
+            case StatKind::Return: exp(static_cast<ReturnStat*>(s)->ret); break;
+        }
+    }
+
+    void stats(const block &b) {
+        u64(b.size());
+        for (auto s : b) stat(s);
+    }
+
+    void function(const FunctionDef &f) {
+        u64(f.args.size());
+        for (auto &a : f.args) {
+            str(a.name);
+            type(a.type);
+        }
+        type(f.ret);
+        stats(f.body);
+    }
+};
+
+struct Reader {
+    const string &in;
+    size_t pos;
+    Names &names;
+    vector<typep> types;
+
+    void need(size_t n) {
+        if (in.size() - pos < n) throw runtime_error("Corrupt cache entry");
+    }
+    uint8_t u8() {
+        need(1);
+        return in[pos++];
+    }
+    uint64_t u64() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto b = u8();
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        throw runtime_error("Corrupt cache entry");
+    }
+    string str() {
+        auto n = u64();
+        need(n);
+        pos += n;
+        return in.substr(pos - n, n);
+    }
+
+    typep type() {
+        auto k = u8();
+        if (k == none) return nullptr;
+        if (k == seenType) {
+            auto i = u64();
+            if (i >= types.size()) throw runtime_error("Corrupt cache entry");
+            return types[i];
+        }
+        typep t;
+        switch ((TypeKind)k) {
+            case TypeKind::Int: return TypeInt::get();
+            case TypeKind::Float: return TypeFloat::get();
+            case TypeKind::Bool: return TypeBool::get();
+            case TypeKind::String: return TypeString::get();
+            case TypeKind::Nil: return TypeNil::get();
+            case TypeKind::Variable: return TypeVariable::get();
+            case TypeKind::Tuple: {
+                vector<typep> elems(u64());
+                for (auto &e : elems) e = type();
+                t = TypeTuple::get(elems);
+                break;
+            }
+            case TypeKind::Obj: t = TypeObj::get(str()); break;
+            case TypeKind::Function: {
+                vector<typep> args(u64());
+                for (auto &a : args) a = type();
+                t = TypeFunction::get(args, type());
+                break;
+            }
+            case TypeKind::List: t = TypeList::get(type()); break;
+            default: throw runtime_error("Corrupt cache entry");
+        }
+        types.push_back(t);
+        return t;
+    }
+
+    expl exps() {
+        expl l(u64());
+        for (auto &e : l) e = exp();
+        return l;
+    }
+
+    lexpp lexp() {
+        auto name = str();
+        auto t = type();
+        vector<Lexpsuffix*> suffixes(u64());
+        for (auto &s : suffixes) {
+            if ((SuffixKind)u8() == SuffixKind::ListIndex) s = make<ListIndexSuffix>(exp());
+            else s = make<TupleAccessSuffix>((int)u64());
+        }
+        return make<Lexp>(name, names.intern(name), suffixes, t);
+    }
+
+    expp exp() {
+        auto k = u8();
+        if (k == none) return nullptr;
+        auto t = type();
+        expp e;
+        switch ((ExpKind)k) {
+            case ExpKind::Nil: e = make<NilExp>(); break;
+            case ExpKind::Bool: e = make<BoolExp>(u8() != 0); break;
+            case ExpKind::Int: e = make<IntExp>((long)u64()); break;
+            case ExpKind::Float: {
+                auto v = u64();
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                e = make<FloatExp>(d);
+                break;
+            }
+            case ExpKind::String: e = make<StringExp>(str()); break;
+            case ExpKind::Id: {
+                auto name = str();
+                e = make<IdExp>(t, name, names.intern(name));
+                break;
+            }
+            case ExpKind::List: e = make<ListExp>(exps()); break;
+            case ExpKind::Tuple: e = make<TupleExp>(exps()); break;
+            case ExpKind::Index: {
+                auto l = exp();
+                e = make<IndexExp>(l, exp());
+                break;
+            }
+            case ExpKind::TupleAccess: {
+                auto l = exp();
+                e = make<TupleAccessExp>(l, (int)u64(), t);
+                break;
+            }
+            case ExpKind::Call: {
+                auto f = lexp();
+                e = make<CallExp>(f, exps());
+                break;
+            }
+            case ExpKind::Ternary: {
+                auto then = exp();
+                auto cond = exp();
+                e = make<TernaryExp>(then, cond, exp());
+                break;
+            }
+            case ExpKind::Cast: e = make<CastExp>(exp(), t); break;
+            case ExpKind::BinOp: {
+                auto op = (BinOp)u8();
+                auto l = exp();
+                e = make<BinOpExp>(op, l, exp(), t);
+                break;
+            }
+            case ExpKind::UnaryOp: {
+                auto op = (UnaryOp)u8();
+                e = make<UnaryOpExp>(op, exp());
+                break;
+            }
+            case ExpKind::Logical: {
+                auto op = (LogicalOp)u8();
+                auto l = exp();
+                e = make<LogicalExp>(op, l, exp());
+                break;
+            }
+            case ExpKind::Select: {
+                auto cond = exp();
+                auto then = exp();
+                e = make<SelectExp>(cond, then, exp());
+                break;
+            }
+            default: throw runtime_error("Corrupt cache entry");
+        }
+        e->type = t;
+        return e;
+    }
+
+    statp stat() {
+        auto k = u8();
+        if (k == none) return nullptr;
+        switch ((StatKind)k) {
+            case StatKind::Assign: {
+                auto l = lexp();
+                return make<AssignStat>(l, exp());
+            }
+            case StatKind::FuncCall: {
+                auto f = lexp();
+                return make<FuncCallStat>(f, exps());
+            }
+            case StatKind::While: {
+                auto cond = exp();
+                return make<WhileStat>(cond, stat());
+            }
+            case StatKind::If: {
+                auto cond = exp();
+                auto then = stat();
+                return make<IfStat>(cond, then, stat());
+            }
+            case StatKind::Block: return make<BlockStat>(stats());
+            case StatKind::Break: return make<BreakStat>();
+            case StatKind::Return: return make<ReturnStat>(exp());
+        }
+        throw runtime_error("Corrupt cache entry");
+    }
+
+    block stats() {
+        block b(u64());
+        for (auto &s : b) s = stat();
+        return b;
+    }
+
+    FunctionDef function() {
+        vector<Arg> args(u64());
+        for (auto &a : args) {
+            a.name = str();
+            a.type = type();
+            a.sym = names.intern(a.name);
+        }
+        auto ret = type();
+        return FunctionDef(args, ret, stats());
+    }
+};
+
+}
+
+// Every function of the file is kept under one entry, read once when the
+// cache is created and written back whole by commit()
+BodyCache::BodyCache(CompileCache *disk, string source)
+    : names(make_shared<Names>()), disk(disk) {
+    if (!disk) return;
+    // Checked bodies come before any option applies
+    key = disk->key(string("bodies", 7) + source, "");
+
+    CacheEntry entry;
+    if (!disk->lookup(key, entry)) return;
+    Reader r{entry.ast, 0, *names};
+    try {
+        auto n = r.u64();
+        for (uint64_t i=0;i<n;i++) {
+            auto name = r.str();
+            auto fingerprint = r.u64();
+            entries.insert({name, {fingerprint, r.str(), nullptr, FunctionDef({}, nullptr, {})}});
+        }
+    } catch (exception &) {
+        entries.clear();
+    }
+}
+
+bool BodyCache::reuse(const string &name, uint64_t fingerprint, File &f) {
+    auto it = entries.find(name);
+    if (it == entries.end() || it->second.fingerprint != fingerprint) return false;
+    auto &e = it->second;
+    if (!e.arena) {
+        Reader r{e.bytes, 0, *f.names};
+        try {
+            e.def = r.function();
+        } catch (exception &) {
+            return false;
+        }
+        e.arena = f.arena;
+    }
+    if (e.arena != f.arena && find(f.retained.begin(), f.retained.end(), e.arena) == f.retained.end())
+        f.retained.push_back(e.arena);
+    f.functions.insert({name, e.def});
+    reused++;
+    return true;
+}
+
+void BodyCache::store(const string &name, uint64_t fingerprint, File &f) {
+    auto &def = f.functions.at(name);
+    string bytes;
+    if (disk) {
+        Writer w;
+        w.function(def);
+        bytes = move(w.out);
+    }
+    entries.erase(name);
+    entries.insert({name, {fingerprint, move(bytes), f.arena, def}});
+    rebuilt++;
+    dirty = true;
+}
+
+void BodyCache::commit(const File &f) {
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (f.functions.count(it->first)) it++;
+        else {
+            it = entries.erase(it);
+            dirty = true;
+        }
+    }
+    if (!disk || !dirty) return;
+
+    Writer w;
+    w.u64(entries.size());
+    for (auto &e : entries) {
+        w.str(e.first);
+        w.u64(e.second.fingerprint);
+        w.str(e.second.bytes);
+    }
+    CacheEntry entry;
+    entry.ast = move(w.out);
+    disk->store(key, entry);
+    dirty = false;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "AST.h"
+#include "VirtualMachine.h"
+
+#include <map>
+#include <string>
+
+#define PHILIPPE_VERSION "philippe-0.13"
+
+// The printed AST of a whole file, or the checked bodies of its functions
+// for a BodyCache
+struct CacheEntry {
+    vmcode code;
+    std::string ast;
+};
+
+// On-disk compilation cache, keyed by a hash of the source text, the
+// options and the compiler version. Entries are written atomically so
+// several processes can share a directory, and the least recently used
+// ones are evicted above maxSize bytes.
+class CompileCache {
+public:
+    CompileCache(std::string dir, uint64_t maxSize);
+
+    // options: every compiler option changing what gets cached, as text
+    std::string key(const std::string &source, const std::string &options);
+    bool lookup(const std::string &key, CacheEntry &entry);
+    void store(const std::string &key, const CacheEntry &entry);
+
+private:
+    bool write(const std::string &key, const CacheEntry &entry);
+    void evict();
+    std::string path(const std::string &key);
+
+    std::string dir;
+    uint64_t maxSize;
+};
+
+// Checked function bodies of one source file, reused by the parser while a
+// body's fingerprint stays the same. The fingerprint covers the body's
+// tokens, the signatures of the functions it names and every object type,
+// so only edited functions and their dependents are rebuilt.
+// Entries live in memory for a long-lived compiler, and when given a
+// CompileCache, are loaded from and saved to it for the next process.
+class BodyCache {
+public:
+    BodyCache(CompileCache *disk = nullptr, std::string source = "");
+
+    bool reuse(const std::string &name, uint64_t fingerprint, File &f);
+    void store(const std::string &name, uint64_t fingerprint, File &f);
+    // Forget functions f no longer defines, and save if anything changed
+    void commit(const File &f);
+
+    // Every compilation with this cache interns into the same table, so
+    // symbols in cached nodes stay valid
+    std::shared_ptr<Names> names;
+    size_t reused = 0, rebuilt = 0;
+
+private:
+    // def is only built once the entry is reused, entries loaded from disk
+    // start with just their serialized form
+    struct Entry {
+        uint64_t fingerprint;
+        std::string bytes;
+        std::shared_ptr<Arena> arena;
+        FunctionDef def;
+    };
+    std::map<std::string, Entry> entries;
+    CompileCache *disk;
+    std::string key;
+    bool dirty = false;
+};
@@ -1,235 +1,678 @@
 #include "CodeGen.h"
-#include "Assembler.h"
+#include "Rewriter.h"
 
-#include <sstream>
+#include <map>
 #include <set>
+#include <stdexcept>
 
 using namespace std;
 
-enum Type {
-    INT,
-    FLOAT,
-};
+namespace {
 
-class CodeGenContext {
+// Functions a body calls and the locals it assigns
+class Scan : public Rewriter {
 public:
-    string code;
-    string constants;
-    set<string> vars;
-    Type lastType;
-    uint64_t lblid = 0;
+    using Rewriter::rewrite;
+    set<string> calls;
+    set<symid> locals;
 
-    std::string newlbl() {
-        return "l" + lblid++;
+    expp rewrite(expp e) override {
+        if (auto c = as<CallExp>(e)) calls.insert(c->func->name);
+        return children(e);
     }
 
-    void genCodeBlock(block b);
-    void genCode(statp sb);
-    void genCode(expp eb);
+    statp rewrite(statp s) override {
+        if (auto a = as<AssignStat>(s)) locals.insert(a->left->sym);
+        if (auto c = as<FuncCallStat>(s)) calls.insert(c->func->name);
+        return children(s);
+    }
+};
 
-    void genCodeBinOpExp(BinOpExp e);
+class Stable : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    bool stable = true;
+
+    expp rewrite(expp e) override {
+        switch (e->kind) {
+            case ExpKind::Call: case ExpKind::Index: case ExpKind::TupleAccess:
+                stable = false;
+                break;
+            case ExpKind::BinOp: {
+                auto b = static_cast<BinOpExp*>(e);
+                auto d = as<IntExp>(b->right);
+                if ((b->op == BinOp::Div || b->op == BinOp::Mod) && (!d || d->val == 0)) stable = false;
+                break;
+            }
+            default: break;
+        }
+        return children(e);
+    }
 };
 
-std::string genCode(block b) {
-    CodeGenContext c;
-    genCodeBlock(b, c);
-    return c.code + c.constants;
+// Fields of a tuple or object type, empty for any other type
+const vector<typep> &fields(const File &f, typep t) {
+    static const vector<typep> none;
+    if (auto tu = as<TypeTuple>(t)) return tu->t;
+    if (auto o = as<TypeObj>(t)) return f.objectDefinitions.at(o->name).type->t;
+    return none;
 }
 
-void CodeGenContext::genCodeBlock(block b) {
-    for (auto s : b) {
-        genCode(s);
+// Fields holding a tuple or object that can be laid out inside their
+// container: every container built has a new one built with it there, and
+// the field is never assigned. It is then only ever reached through its
+// container, its address can be an offset into it. Types of locals are
+// followed in source order, like the checker gave them.
+class Inlinable : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    Inlinable(const File &f) : f(f) {}
+    set<pair<typep, int>> shared;
+    // A container type went unknown, nothing is laid out inline
+    bool unknown = false;
+    map<symid, typep> types;
+
+    expp rewrite(expp e) override {
+        if (auto id = as<IdExp>(e)) types[id->sym] = id->type;
+        if (auto t = as<TupleExp>(e)) {
+            for (size_t i=0;i<t->elements.size();i++) {
+                if (!as<TupleExp>(t->elements[i])) shared.insert({t->type, i});
+            }
+        }
+        return children(e);
     }
-}
 
-void CodeGenContext::genCode(statp sb) {
+    statp rewrite(statp s) override {
+        auto a = as<AssignStat>(s);
+        if (!a) return children(s);
+        auto l = a->left;
+        if (l->suffixes.empty() && l->type) types[l->sym] = l->type;
+        auto it = types.find(l->sym);
+        typep t = it == types.end() ? nullptr : it->second;
+        for (auto suf : l->suffixes) {
+            if (!t) unknown = true;
+            if (auto ta = as<TupleAccessSuffix>(suf)) {
+                if (suf == l->suffixes.back()) shared.insert({t, ta->i});
+                else if (t) t = fields(f, t)[ta->i];
+            } else if (auto li = as<TypeList>(t)) t = li->t;
+        }
+        return children(s);
+    }
 
-}
+private:
+    const File &f;
+};
 
-void CodeGenContext::genCode(expp sb) {
-    
-}
+struct Layout {
+    vector<int64_t> offsets;
+    vector<bool> inlined;
+    int64_t size = 0;
+};
 
-void AssignStat::codegen(CodeGenContext &c) {
-    
+// Instruction computing the same with its operands the other way round
+Instruction mirrored(Instruction i) {
+    switch (i) {
+        case Addi: case Addf: case Muli: case Mulf:
+        case Eqi: case Eqf: case Neqi: case Neqf:
+            return i;
+        case Lti: return Gti;
+        case Ltf: return Gtf;
+        case Gti: return Lti;
+        case Gtf: return Ltf;
+        case Lteqi: return Gteqi;
+        case Lteqf: return Gteqf;
+        case Gteqi: return Lteqi;
+        case Gteqf: return Lteqf;
+        default: return Noop;
+    }
 }
 
-void FuncCallStat::codegen(CodeGenContext &c) {
-    
+// Comparison true exactly when i is false. Only equality for floats, any
+// order comparison with a NaN is false both ways.
+Instruction negated(Instruction i) {
+    switch (i) {
+        case Lti: return Gteqi;
+        case Lteqi: return Gti;
+        case Gti: return Lteqi;
+        case Gteqi: return Lti;
+        case Eqi: return Neqi;
+        case Neqi: return Eqi;
+        case Eqf: return Neqf;
+        case Neqf: return Eqf;
+        default: return Noop;
+    }
 }
 
-void WhileStat::codegen(CodeGenContext &c) {
-    auto startlbl = c.newlbl();
-    auto endlbl = c.newlbl();
-    c.code += startlbl + ":\n";
-    cond->codegen(c);
-    c.code += "ifjump " + endlbl + "\n";
-    body->codegen(c);
-    c.code += "jump " + startlbl + "\n";
-    c.code += endlbl + ":\n";
-}
+// Every local has a memory cell of its own, expressions are computed on
+// the operand stack. The VM has no frames: a call that can come back to
+// the function making it saves all the function's cells on the operand
+// stack around it. Jumps go to labels, patched once all code is emitted.
+// A tuple or object is a cell per field at offsets fixed by its type, the
+// fields Inlinable allows laid out in place, so a.l.a is one LoadField.
+class Generator {
+public:
+    Generator(const File &file) : file(file), inlinable(file) {}
+
+    vmcode run() {
+        if (!file.functions.count("main")) throw runtime_error("No main function");
+        for (auto &d : file.functions) {
+            auto &s = scans[d.first];
+            s.rewrite(d.second.body);
+            for (auto &c : s.calls) callers[c].insert(d.first);
+            inlinable.types.clear();
+            inlinable.rewrite(d.second.body);
+        }
+        // Image: call main and stop, functions, strings, then the cells
+        functionRefs.push_back({code.size() + 1, "main"});
+        op(Call, 0);
+        op(End);
+        for (auto &d : file.functions) function(d.first, d.second);
+        vector<int64_t> addresses;
+        for (auto &s : strings) {
+            addresses.push_back(code.size());
+            auto packed = packString(s);
+            code.insert(code.end(), packed.begin(), packed.end());
+        }
+        auto cells = code.size();
+        code.resize(cells + slots, 0);
+
+        for (auto &r : functionRefs) code[r.first] = functions.at(r.second);
+        for (auto &r : labelRefs) code[r.first] = labels[r.second];
+        for (auto &r : stringRefs) code[r.first] = addresses[r.second];
+        for (auto &r : slotRefs) code[r.first] = cells + r.second;
+        return code;
+    }
 
-void IfStat::codegen(CodeGenContext &c) {
-    cond->codegen(c);
-    auto thenlbl = c.newlbl();
-    auto afterlbl = c.newlbl();
-    c.code += "ifjump " + thenlbl + "\n";
-    elsebody->codegen(c);
-    c.code += "jump " + afterlbl + "\n";
-    c.code += thenlbl + ":";
-    thenbody->codegen(c);
-    c.code += afterlbl + ":\n";
-}
+private:
+    const File &file;
+    vmcode code;
+    // Cell 0 takes results nothing uses, and values held for a few
+    // instructions with no call in between
+    int slots = 1;
+    map<string, int64_t> functions;
+    vector<int64_t> labels;
+    vector<pair<size_t, string>> functionRefs;
+    vector<pair<size_t, int>> labelRefs, stringRefs, slotRefs;
+    vector<string> strings;
+    map<string, int> stringIds;
+    map<string, Scan> scans;
+    map<string, set<string>> callers;
+    Inlinable inlinable;
+    // By tuple or object type, settled the first time one is needed
+    map<typep, Layout> layouts;
+    set<typep> laying;
+
+    // Of the function being generated
+    map<symid, int> locals;
+    map<symid, typep> types;
+    vector<int> temps;
+    size_t tempsUsed = 0;
+    set<string> reentrant;
+    vector<int> breaks;
+
+    void op(Instruction i) {
+        code.push_back(i);
+    }
 
-void ForStat::codegen(CodeGenContext &c) {
-    
-}
+    void op(Instruction i, int64_t v) {
+        code.push_back(i);
+        code.push_back(v);
+    }
 
-void BlockStat::codegen(CodeGenContext &c) {
-    genCodeBlock(stats, c);
-}
+    void cell(Instruction i, int s) {
+        slotRefs.push_back({code.size() + 1, s});
+        op(i, 0);
+    }
 
-void BreakStat::codegen(CodeGenContext &c) {
-    
-}
+    int label() {
+        labels.push_back(0);
+        return labels.size() - 1;
+    }
 
-void ReturnStat::codegen(CodeGenContext &c) {
-    ret->codegen(c);
-    c.code += "return\n";
-}
+    void place(int l) {
+        labels[l] = code.size();
+    }
 
-void EmptyStat::codegen(CodeGenContext &c) {}
+    void jump(Instruction i, int l) {
+        labelRefs.push_back({code.size() + 1, l});
+        op(i, 0);
+    }
 
-void NilExp::codegen(CodeGenContext &c) {
-    c.code += "loads 0\n";
-    c.lastType = INT;
-}
+    void function(const string &name, const FunctionDef &d) {
+        locals.clear();
+        types.clear();
+        temps.clear();
+        tempsUsed = 0;
+        for (auto &a : d.args) {
+            locals[a.sym] = slots++;
+            types[a.sym] = a.type;
+        }
+        for (auto v : scans[name].locals) if (!locals.count(v)) locals[v] = slots++;
+        // Functions calling back here
+        reentrant.clear();
+        vector<string> work = {name};
+        while (!work.empty()) {
+            auto g = work.back();
+            work.pop_back();
+            for (auto &c : callers[g]) if (reentrant.insert(c).second) work.push_back(c);
+        }
+
+        functions[name] = code.size();
+        // Arguments are on the stack, the last one on top
+        for (auto a = d.args.rbegin(); a != d.args.rend(); ++a) cell(Store, locals[a->sym]);
+        for (auto s : d.body) stat(s);
+        // Falling off the end returns nil
+        op(LoadS, 0);
+        op(Return);
+    }
 
-void BoolExp::codegen(CodeGenContext &c) {
-    stringstream ss;
-    ss << (val?1:0);
-    c.code += "loads " + ss.str() + "\n";
-    c.lastType = INT;
-}
+    const string &callee(lexpp f) {
+        if (!f->suffixes.empty() || (f->name != "printf" && !file.functions.count(f->name)))
+            throw runtime_error("Can only call functions by name: " + f->name);
+        return f->name;
+    }
 
-void IntExp::codegen(CodeGenContext &c) {
-    stringstream ss;
-    ss << val;
-    c.code += "loads " + ss.str() + "\n";
-    c.lastType = INT;
-}
+    // Pushes the result, except for printf which has none. Returns whether
+    // there is one.
+    bool call(lexpp f, const expl &args) {
+        auto &name = callee(f);
+        if (name == "printf") {
+            // Format on top, the values under it in order
+            for (size_t a=args.size();a-- > 2;) exp(args[a]);
+            if (args.size() > 1) swapped(args[0], args[1]);
+            else exp(args[0]);
+            op(Call, Printf);
+            return false;
+        }
+        vector<int> saved;
+        if (reentrant.count(name)) {
+            for (auto &l : locals) saved.push_back(l.second);
+            saved.insert(saved.end(), temps.begin(), temps.begin() + tempsUsed);
+        }
+        for (auto s : saved) cell(LoadM, s);
+        for (auto a : args) exp(a);
+        functionRefs.push_back({code.size() + 1, name});
+        op(Call, 0);
+        if (saved.empty()) return true;
+        cell(Store, 0);
+        for (auto s = saved.rbegin(); s != saved.rend(); ++s) cell(Store, *s);
+        cell(LoadM, 0);
+        return true;
+    }
 
-void FloatExp::codegen(CodeGenContext &c) {
-    stringstream ss;
-    ss << val;
-    c.code += "loads " + ss.str() + "\n";
-    c.lastType = FLOAT;
-}
+    // Pushes b then a, a on top, with a evaluated first when the order
+    // can be told apart
+    void swapped(expp a, expp b) {
+        if (stable(a) || stable(b)) {
+            exp(b);
+            exp(a);
+            return;
+        }
+        if (tempsUsed == temps.size()) temps.push_back(slots++);
+        auto t = temps[tempsUsed++];
+        exp(a);
+        cell(Store, t);
+        exp(b);
+        cell(LoadM, t);
+        tempsUsed--;
+    }
 
-void StringExp::codegen(CodeGenContext &c) {
-    
-}
+    // Moves the values on top of the stack, the last one on top, to new
+    // memory of size cells at the given offsets and pushes its address
+    void allocate(const vector<int64_t> &offsets, int64_t size) {
+        op(Alloc, size);
+        cell(Store, 0);
+        for (auto o = offsets.rbegin(); o != offsets.rend(); ++o) {
+            cell(LoadM, 0);
+            op(StoreField, *o);
+        }
+        cell(LoadM, 0);
+    }
 
-void IdExp::codegen(CodeGenContext &c) {
-    c.vars.insert(name);
-    c.code += "loadm " + name + "\n";
-}
+    void allocate(size_t n) {
+        vector<int64_t> offsets;
+        for (size_t i=0;i<n;i++) offsets.push_back(i);
+        allocate(offsets, n);
+    }
 
-void ObjExp::codegen(CodeGenContext &c) {
-    
-}
+    // A type holding itself has it as a plain field the second time
+    const Layout &layout(typep t) {
+        auto it = layouts.find(t);
+        if (it != layouts.end()) return it->second;
+        laying.insert(t);
+        Layout l;
+        auto &fs = fields(file, t);
+        for (size_t i=0;i<fs.size();i++) {
+            bool in = !inlinable.unknown && !inlinable.shared.count({t, i}) &&
+                !fields(file, fs[i]).empty() && !laying.count(fs[i]);
+            l.offsets.push_back(l.size);
+            l.inlined.push_back(in);
+            l.size += in ? layout(fs[i]).size : 1;
+        }
+        laying.erase(t);
+        return layouts[t] = l;
+    }
 
-void ListExp::codegen(CodeGenContext &c) {
-    
-}
+    // Fields of a type the checker didn't give are at their index
+    int64_t offset(typep t, int i) {
+        auto &l = layout(t);
+        return l.offsets.empty() ? i : l.offsets.at(i);
+    }
 
-void RangeExp::codegen(CodeGenContext &c) {
-    
-}
+    bool inlined(typep t, int i) {
+        auto &l = layout(t);
+        return !l.inlined.empty() && l.inlined.at(i);
+    }
 
-void TupleExp::codegen(CodeGenContext &c) {
-    
-}
+    // Pushes the fields of e and those laid out inside it, noting where
+    // each one goes
+    void build(TupleExp *e, int64_t base, vector<int64_t> &offsets) {
+        for (size_t i=0;i<e->elements.size();i++) {
+            auto o = base + offset(e->type, i);
+            if (inlined(e->type, i)) build(static_cast<TupleExp*>(e->elements[i]), o, offsets);
+            else {
+                exp(e->elements[i]);
+                offsets.push_back(o);
+            }
+        }
+    }
 
-void FuncExp::codegen(CodeGenContext &c) {
-    
-}
+    // Pushes the address e is at an offset from and returns the offset:
+    // fields laid out inline add up instead of being computed one by one
+    int64_t address(expp e) {
+        auto t = as<TupleAccessExp>(e);
+        if (t && inlined(t->left->type, t->index)) return address(t->left) + offset(t->left->type, t->index);
+        exp(e);
+        return 0;
+    }
 
-void MemberExp::codegen(CodeGenContext &c) {
-    
-}
+    void binOp(BinOpExp *e, Instruction vm) {
+        // The left operand is popped first, it has to end up on top
+        auto m = mirrored(vm);
+        if (m != Noop) {
+            exp(e->left);
+            exp(e->right);
+            op(m);
+        } else {
+            swapped(e->left, e->right);
+            op(vm);
+        }
+    }
 
-void IndexExp::codegen(CodeGenContext &c) {
-    
-}
+    // Jumps to l when e is when, falls through otherwise. The right
+    // operand of and/or is only evaluated when the left one doesn't decide.
+    void branch(expp e, bool when, int l) {
+        if (auto g = as<LogicalExp>(e)) {
+            // Value of the left operand settling the result
+            bool settles = g->op == LogicalOp::Or;
+            if (settles == when) {
+                branch(g->left, when, l);
+                branch(g->right, when, l);
+            } else {
+                auto skip = label();
+                branch(g->left, settles, skip);
+                branch(g->right, when, l);
+                place(skip);
+            }
+            return;
+        }
+        if (auto u = as<UnaryOpExp>(e)) {
+            if (u->op == UnaryOp::Not) return branch(u->e, !when, l);
+        }
+        if (auto b = as<BoolExp>(e)) {
+            if (b->val == when) jump(Jump, l);
+            return;
+        }
+        auto b = as<BinOpExp>(e);
+        if (!when && b && negated(instruction(b)) != Noop) {
+            binOp(b, negated(instruction(b)));
+            jump(IfJump, l);
+            return;
+        }
+        exp(e);
+        if (!when) op(Not);
+        jump(IfJump, l);
+    }
 
-void CallExp::codegen(CodeGenContext &c) {
-    
-}
+    // A call in tail position has nothing to come back to, the callee
+    // returns to our caller
+    void ret(expp e) {
+        if (auto t = as<TernaryExp>(e)) {
+            auto els = label();
+            branch(t->cond, false, els);
+            ret(t->then);
+            place(els);
+            ret(t->els);
+            return;
+        }
+        auto c = as<CallExp>(e);
+        if (c && callee(c->func) != "printf") {
+            for (auto a : c->args) exp(a);
+            functionRefs.push_back({code.size() + 1, c->func->name});
+            op(TailCall, 0);
+            return;
+        }
+        if (e) exp(e);
+        else op(LoadS, 0);
+        op(Return);
+    }
 
-void UnaryOpExp::codegen(CodeGenContext &c) {
-    e->codegen(c);
-    if (op == UnaryOp::Minus) {
-        if (c.lastType == INT) c.code += "usubi\n";
-        else if (c.lastType == FLOAT) c.code += "usubf\n";
-        else throw;
-    } else if (op == UnaryOp::Not) {
-        if (c.lastType == INT) c.code += "not\n";
-        else throw;
+    void exp(expp eb);
+    void stat(statp sb);
+};
+
+void Generator::exp(expp eb) {
+    switch (eb->kind) {
+        case ExpKind::Nil:
+            op(LoadS, 0);
+            break;
+        case ExpKind::Bool:
+            op(LoadS, static_cast<BoolExp*>(eb)->val);
+            break;
+        case ExpKind::Int:
+            op(LoadS, static_cast<IntExp*>(eb)->val);
+            break;
+        case ExpKind::Float:
+            op(LoadS, asint(static_cast<FloatExp*>(eb)->val));
+            break;
+        case ExpKind::String: {
+            auto &s = static_cast<StringExp*>(eb)->val;
+            auto it = stringIds.find(s);
+            if (it == stringIds.end()) {
+                it = stringIds.insert({s, (int)strings.size()}).first;
+                strings.push_back(s);
+            }
+            stringRefs.push_back({code.size() + 1, it->second});
+            op(LoadS, 0);
+            break;
+        }
+        case ExpKind::Id: {
+            auto e = static_cast<IdExp*>(eb);
+            auto l = locals.find(e->sym);
+            if (l == locals.end()) throw runtime_error("Functions aren't values in the VM: " + e->name);
+            types[e->sym] = e->type;
+            cell(LoadM, l->second);
+            break;
+        }
+        case ExpKind::List: {
+            // Header of length, capacity and the elements' address
+            auto &els = static_cast<ListExp*>(eb)->elements;
+            op(LoadS, els.size());
+            op(LoadS, els.size());
+            for (auto e : els) exp(e);
+            allocate(els.size());
+            allocate(3);
+            break;
+        }
+        case ExpKind::Tuple: {
+            auto e = static_cast<TupleExp*>(eb);
+            vector<int64_t> offsets;
+            build(e, 0, offsets);
+            allocate(offsets, layout(e->type).size);
+            break;
+        }
+        case ExpKind::Index: {
+            auto e = static_cast<IndexExp*>(eb);
+            exp(e->left);
+            exp(e->index);
+            op(LoadL);
+            break;
+        }
+        case ExpKind::TupleAccess: {
+            auto e = static_cast<TupleAccessExp*>(eb);
+            auto o = address(e->left) + offset(e->left->type, e->index);
+            if (!inlined(e->left->type, e->index)) op(LoadField, o);
+            else if (o) {
+                op(LoadS, o);
+                op(Addi);
+            }
+            break;
+        }
+        case ExpKind::Call: {
+            auto e = static_cast<CallExp*>(eb);
+            if (!call(e->func, e->args)) op(LoadS, 0);
+            break;
+        }
+        case ExpKind::Ternary: {
+            auto e = static_cast<TernaryExp*>(eb);
+            auto els = label(), after = label();
+            branch(e->cond, false, els);
+            exp(e->then);
+            jump(Jump, after);
+            place(els);
+            exp(e->els);
+            place(after);
+            break;
+        }
+        case ExpKind::Select: {
+            // Both arms can't fail or have side effects, their order
+            // doesn't matter
+            auto e = static_cast<SelectExp*>(eb);
+            exp(e->els);
+            exp(e->then);
+            exp(e->cond);
+            op(Select);
+            break;
+        }
+        case ExpKind::Logical: {
+            auto f = label(), after = label();
+            branch(eb, false, f);
+            op(LoadS, 1);
+            jump(Jump, after);
+            place(f);
+            op(LoadS, 0);
+            place(after);
+            break;
+        }
+        case ExpKind::Cast: {
+            auto e = static_cast<CastExp*>(eb);
+            exp(e->e);
+            bool from = as<TypeFloat>(e->e->type), to = as<TypeFloat>(e->type);
+            if (from != to) op(to ? Castif : Castfi);
+            break;
+        }
+        case ExpKind::BinOp: {
+            auto e = static_cast<BinOpExp*>(eb);
+            auto vm = instruction(e);
+            if (vm == Noop) throw runtime_error("No instruction for this operator");
+            binOp(e, vm);
+            break;
+        }
+        case ExpKind::UnaryOp: {
+            auto e = static_cast<UnaryOpExp*>(eb);
+            exp(e->e);
+            op(instruction(e));
+            break;
+        }
     }
 }
 
-void CodeGenContext::genCodeBinOpExp(BinOpExp e) {
-    genCode(e.left);
-    auto lefttype = lastType;
-    genCode(e.right);
-    auto righttype = lastType;
-    auto op = e.op;
-    if (op == BinOp::Pow) {
-        if (righttype != INT) throw;
-        if (lefttype == INT) code += "powi\n";
-        else if (lefttype == FLOAT) code += "powf\n";
-        else throw;
-    } else if (op == BinOp::Mul) {
-        code += "muli\n";
-    } else if (op == BinOp::Div) {
-        code += "divi\n";
-    } else if (op == BinOp::Mod) {
-        if (righttype != INT) throw;
-        code += "modi\n";
-    } else if (op == BinOp::Plus) {
-        code += "addi\n";
-    } else if (op == BinOp::Minus) {
-        code += "subi\n";
-    } else if (op == BinOp::Lteq) {
-        code += "lteqi\n";
-    } else if (op == BinOp::Lt) {
-        code += "lti\n";
-    } else if (op == BinOp::Gt) {
-        code += "gti\n";
-    } else if (op == BinOp::Gteq) {
-        code += "gteqi\n";
-    } else if (op == BinOp::Eq) {
-        code += "eqi\n";
-    } else if (op == BinOp::Neq) {
-        code += "neqi\n";
-    } else if (op == BinOp::And) {
-        if (lefttype != INT || righttype != INT) throw;
-        code += "and\n";
-    } else if (op == BinOp::Or) {
-        if (lefttype != INT || righttype != INT) throw;
-        code += "or\n";
+void Generator::stat(statp sb) {
+    switch (sb->kind) {
+        case StatKind::Assign: {
+            auto s = static_cast<AssignStat*>(sb);
+            auto l = s->left;
+            exp(s->right);
+            if (l->suffixes.empty()) {
+                if (l->type) types[l->sym] = l->type;
+                cell(Store, locals.at(l->sym));
+                break;
+            }
+            // Down to the element assigned, through the ones holding it.
+            // Offsets of fields laid out inline add up until a load.
+            cell(LoadM, locals.at(l->sym));
+            auto it = types.find(l->sym);
+            typep t = it == types.end() ? nullptr : it->second;
+            int64_t o = 0;
+            for (size_t i=0;i<l->suffixes.size();i++) {
+                bool last = i+1 == l->suffixes.size();
+                if (auto li = as<ListIndexSuffix>(l->suffixes[i])) {
+                    exp(li->i);
+                    op(last ? StoreL : LoadL);
+                    auto lt = as<TypeList>(t);
+                    t = lt ? lt->t : nullptr;
+                } else {
+                    auto f = static_cast<TupleAccessSuffix*>(l->suffixes[i])->i;
+                    o += offset(t, f);
+                    if (!inlined(t, f)) {
+                        op(last ? StoreField : LoadField, o);
+                        o = 0;
+                    }
+                    t = fields(file, t).empty() ? nullptr : fields(file, t)[f];
+                }
+            }
+            break;
+        }
+        case StatKind::FuncCall: {
+            auto s = static_cast<FuncCallStat*>(sb);
+            if (call(s->func, s->args)) cell(Store, 0);
+            break;
+        }
+        case StatKind::While: {
+            // Tested at the bottom, one jump per iteration
+            auto s = static_cast<WhileStat*>(sb);
+            auto body = label(), test = label(), exit = label();
+            jump(Jump, test);
+            place(body);
+            breaks.push_back(exit);
+            stat(s->body);
+            breaks.pop_back();
+            place(test);
+            branch(s->cond, true, body);
+            place(exit);
+            break;
+        }
+        case StatKind::If: {
+            auto s = static_cast<IfStat*>(sb);
+            auto els = label(), after = label();
+            branch(s->cond, false, els);
+            stat(s->thenbody);
+            if (s->elsebody) jump(Jump, after);
+            place(els);
+            if (s->elsebody) stat(s->elsebody);
+            place(after);
+            break;
+        }
+        case StatKind::Block:
+            for (auto s : static_cast<BlockStat*>(sb)->stats) stat(s);
+            break;
+        case StatKind::Break:
+            jump(Jump, breaks.back());
+            break;
+        case StatKind::Return:
+            ret(static_cast<ReturnStat*>(sb)->ret);
+            break;
     }
 }
 
-void TernaryExp::codegen(CodeGenContext &c) {
-    cond->codegen(c);
-    auto thenlbl = c.newlbl();
-    auto afterlbl = c.newlbl();
-    c.code += "ifjump " + thenlbl + "\n";
-    els->codegen(c);
-    c.code += "jump " + afterlbl + "\n";
-    c.code += thenlbl + ":";
-    then->codegen(c);
-    c.code += afterlbl + ":";
-}
\ No newline at end of file
+}
+
+vmcode genCode(const File &f) {
+    return Generator(f).run();
+}
+
+bool stable(expp e) {
+    Stable s;
+    s.rewrite(e);
+    return s.stable;
+}
@@ -1,5 +1,33 @@
 #pragma once
 
 #include "AST.h"
+#include "VirtualMachine.h"
 
-std::string genCode(block b);
\ No newline at end of file
+// Bytecode straight from the checked AST, for the whole language where
+// the IR only takes scalars. Lists, tuples and objects live in memory from
+// Alloc: a list is a header of its length, capacity and elements' address,
+// a tuple or object a cell per field with nested ones that are never
+// replaced laid out inside it. The image is laid out like lower()'s: a
+// call to main and End, the functions, the strings, then a cell per local.
+vmcode genCode(const File &f);
+
+// Whether e only reads locals and can't fail: computed earlier or later,
+// it has the same value and nothing can tell. Backends may reorder it.
+bool stable(expp e);
+
+// The single VM instruction of a typed operator, indexed by BinOp. Bools
+// compare as ints, Noop where the operand type has no instruction.
+inline Instruction instruction(BinOpExp *e) {
+    static const Instruction ints[] = {
+        Muli, Divi, Modi, Addi, Subi, Lteqi, Lti, Gti, Gteqi, Eqi, Neqi
+    };
+    static const Instruction floats[] = {
+        Mulf, Divf, Noop, Addf, Subf, Lteqf, Ltf, Gtf, Gteqf, Eqf, Neqf
+    };
+    return (e->left->type == TypeFloat::get() ? floats : ints)[(int)e->op];
+}
+
+inline Instruction instruction(UnaryOpExp *e) {
+    if (e->op == UnaryOp::Not) return Not;
+    return e->type == TypeFloat::get() ? Usubf : Usubi;
+}
@@ -0,0 +1,198 @@
+#include "Optimize.h"
+#include "Rewriter.h"
+
+#include <climits>
+#include <map>
+
+using namespace std;
+
+namespace {
+
+bool constant(expp e) {
+    return as<IntExp>(e) || as<FloatExp>(e) || as<BoolExp>(e);
+}
+
+// Wraps around like the int instructions, without the undefined behaviour
+long wrap(unsigned long v) {
+    return (long)v;
+}
+
+expp intOp(BinOp op, long a, long b) {
+    switch (op) {
+        case BinOp::Add: return make<IntExp>(wrap((unsigned long)a + b));
+        case BinOp::Sub: return make<IntExp>(wrap((unsigned long)a - b));
+        case BinOp::Mul: return make<IntExp>(wrap((unsigned long)a * b));
+        // Division by zero stays, it fails when the program runs
+        case BinOp::Div:
+        case BinOp::Mod:
+            if (b == 0 || (a == LONG_MIN && b == -1)) return nullptr;
+            return make<IntExp>(op == BinOp::Div ? a/b : a%b);
+        case BinOp::Lt: return make<BoolExp>(a<b);
+        case BinOp::Lteq: return make<BoolExp>(a<=b);
+        case BinOp::Gt: return make<BoolExp>(a>b);
+        case BinOp::Gteq: return make<BoolExp>(a>=b);
+        case BinOp::Eq: return make<BoolExp>(a==b);
+        case BinOp::Neq: return make<BoolExp>(a!=b);
+    }
+    return nullptr;
+}
+
+expp floatOp(BinOp op, double a, double b) {
+    switch (op) {
+        case BinOp::Add: return make<FloatExp>(a+b);
+        case BinOp::Sub: return make<FloatExp>(a-b);
+        case BinOp::Mul: return make<FloatExp>(a*b);
+        case BinOp::Div: return make<FloatExp>(a/b);
+        case BinOp::Lt: return make<BoolExp>(a<b);
+        case BinOp::Lteq: return make<BoolExp>(a<=b);
+        case BinOp::Gt: return make<BoolExp>(a>b);
+        case BinOp::Gteq: return make<BoolExp>(a>=b);
+        case BinOp::Eq: return make<BoolExp>(a==b);
+        case BinOp::Neq: return make<BoolExp>(a!=b);
+        default: return nullptr;
+    }
+}
+
+// Folded node, or null when e can't be evaluated now
+expp fold(BinOpExp *e) {
+    auto l = e->left, r = e->right;
+    if (as<IntExp>(l) && as<IntExp>(r))
+        return intOp(e->op, as<IntExp>(l)->val, as<IntExp>(r)->val);
+    if (as<FloatExp>(l) && as<FloatExp>(r))
+        return floatOp(e->op, as<FloatExp>(l)->val, as<FloatExp>(r)->val);
+    if (as<BoolExp>(l) && as<BoolExp>(r)) {
+        if (e->op == BinOp::Eq) return make<BoolExp>(as<BoolExp>(l)->val == as<BoolExp>(r)->val);
+        if (e->op == BinOp::Neq) return make<BoolExp>(as<BoolExp>(l)->val != as<BoolExp>(r)->val);
+    }
+    return nullptr;
+}
+
+expp fold(UnaryOpExp *e) {
+    if (auto i = as<IntExp>(e->e)) return make<IntExp>(wrap(-(unsigned long)i->val));
+    if (auto f = as<FloatExp>(e->e)) return make<FloatExp>(-f->val);
+    if (auto b = as<BoolExp>(e->e)) return make<BoolExp>(!b->val);
+    return nullptr;
+}
+
+expp fold(CastExp *e) {
+    if (auto i = as<IntExp>(e->e)) {
+        if (as<TypeFloat>(e->type)) return make<FloatExp>(i->val);
+    }
+    if (auto f = as<FloatExp>(e->e)) {
+        // Out of range conversions are left to the target
+        if (as<TypeInt>(e->type) && f->val > LONG_MIN && f->val < LONG_MAX)
+            return make<IntExp>((long)f->val);
+    }
+    return nullptr;
+}
+
+// and/or with a constant left operand is decided by it or is the right one,
+// a constant right operand that doesn't decide the result is dropped
+expp fold(LogicalExp *e) {
+    bool absorbing = e->op == LogicalOp::Or;
+    if (auto b = as<BoolExp>(e->left)) return b->val == absorbing ? e->left : e->right;
+    if (auto b = as<BoolExp>(e->right)) if (b->val != absorbing) return e->left;
+    return nullptr;
+}
+
+// Folds constant expressions bottom up. Locals assigned exactly once, by a
+// statement directly in the function body, from a constant are replaced
+// by it and their assignment dropped: everything reading them comes after
+// that statement, checking rejects reads of undeclared variables.
+class ConstFold : public Rewriter {
+    using Rewriter::rewrite;
+
+    map<symid, int> assigned;
+    map<symid, expp> known;
+
+    void count(statp sb) {
+        switch (sb->kind) {
+            case StatKind::Assign: assigned[static_cast<AssignStat*>(sb)->left->sym]++; break;
+            case StatKind::While: count(static_cast<WhileStat*>(sb)->body); break;
+            case StatKind::If: {
+                auto s = static_cast<IfStat*>(sb);
+                count(s->thenbody);
+                if (s->elsebody) count(s->elsebody);
+                break;
+            }
+            case StatKind::Block: for (auto s : static_cast<BlockStat*>(sb)->stats) count(s); break;
+            default: break;
+        }
+    }
+
+    // Statements run unconditionally, in order
+    void straight(const block &b, block &out) {
+        for (auto s : b) {
+            if (auto bl = as<BlockStat>(s)) {
+                straight(bl->stats, out);
+                continue;
+            }
+            auto n = rewrite(s);
+            if (!n) continue;
+            auto a = as<AssignStat>(n);
+            if (a && a->left->suffixes.empty() && assigned[a->left->sym] == 1 && constant(a->right)) {
+                known[a->left->sym] = a->right;
+                continue;
+            }
+            // A constant if leaves its body, the rest of which isn't
+            // revisited
+            if (auto bl = as<BlockStat>(n)) out.insert(out.end(), bl->stats.begin(), bl->stats.end());
+            else out.push_back(n);
+        }
+    }
+
+    block rewrite(const FunctionDef &f) override {
+        assigned.clear();
+        known.clear();
+        // Arguments are assigned by the call
+        for (auto &a : f.args) assigned[a.sym]++;
+        for (auto s : f.body) count(s);
+        block out;
+        straight(f.body, out);
+        return out;
+    }
+
+    expp rewrite(expp eb) override {
+        if (auto id = as<IdExp>(eb)) {
+            auto k = known.find(id->sym);
+            return k == known.end() ? eb : k->second;
+        }
+        auto e = children(eb);
+        expp folded = nullptr;
+        switch (e->kind) {
+            case ExpKind::BinOp: folded = fold(static_cast<BinOpExp*>(e)); break;
+            case ExpKind::UnaryOp: folded = fold(static_cast<UnaryOpExp*>(e)); break;
+            case ExpKind::Cast: folded = fold(static_cast<CastExp*>(e)); break;
+            case ExpKind::Logical: folded = fold(static_cast<LogicalExp*>(e)); break;
+            case ExpKind::Ternary: {
+                auto t = static_cast<TernaryExp*>(e);
+                if (auto c = as<BoolExp>(t->cond)) folded = c->val ? t->then : t->els;
+                break;
+            }
+            case ExpKind::Select: {
+                auto t = static_cast<SelectExp*>(e);
+                if (auto c = as<BoolExp>(t->cond)) folded = c->val ? t->then : t->els;
+                break;
+            }
+            default: break;
+        }
+        return folded ? folded : e;
+    }
+
+    statp rewrite(statp sb) override {
+        auto s = children(sb);
+        if (auto i = as<IfStat>(s)) {
+            if (auto c = as<BoolExp>(i->cond)) return c->val ? i->thenbody : i->elsebody;
+        }
+        if (auto w = as<WhileStat>(s)) {
+            if (auto c = as<BoolExp>(w->cond)) if (!c->val) return nullptr;
+        }
+        return s;
+    }
+};
+
+}
+
+void constFold(File &f) {
+    ConstFold().run(f);
+}
@@ -0,0 +1,534 @@
+#include "CppGen.h"
+#include "CodeGen.h"
+#include "Rewriter.h"
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+// Runtime of the generated program. Its functions go in the same
+// anonymous namespace, main runs f_main on a thread with a large stack:
+// the VM keeps no frames, recursion can go about as deep here.
+const char *prelude = R"cpp(#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <pthread.h>
+#include <vector>
+
+namespace {
+
+// stdout through one buffer, numbers formatted in place
+struct Out {
+    char buf[1 << 16];
+    size_t n = 0;
+
+    void flush() {
+        fwrite(buf, 1, n, stdout);
+        n = 0;
+    }
+
+    void text(const char *s, size_t len) {
+        if (n + len > sizeof buf) {
+            flush();
+            if (len > sizeof buf) {
+                fwrite(s, 1, len, stdout);
+                return;
+            }
+        }
+        memcpy(buf + n, s, len);
+        n += len;
+    }
+
+    void integer(int64_t v) {
+        char t[24], *e = t + sizeof t, *p = e;
+        uint64_t u = v < 0 ? -(uint64_t)v : v;
+        do *--p = '0' + u % 10; while (u /= 10);
+        if (v < 0) *--p = '-';
+        text(p, e - p);
+    }
+
+    // Like an ostream, 6 significant digits
+    void real(double d) {
+        char t[32];
+        text(t, snprintf(t, sizeof t, "%g", d));
+    }
+} out;
+
+void fail(const char *message) {
+    out.flush();
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+double asfloat(int64_t a) {
+    double d;
+    memcpy(&d, &a, sizeof d);
+    return d;
+}
+
+int64_t divi(int64_t a, int64_t b) {
+    if (!b) fail("Division by zero");
+    return a / b;
+}
+
+int64_t modi(int64_t a, int64_t b) {
+    if (!b) fail("Division by zero");
+    return a % b;
+}
+
+template<class T>
+T &at(std::vector<T> *l, int64_t i) {
+    if ((uint64_t)i >= l->size()) fail("List index out of range");
+    return (*l)[i];
+}
+
+// Same format handling as VirtualMachine::printf, for formats only known
+// when running
+void print(const char *f, std::initializer_list<int64_t> args) {
+    auto a = args.begin();
+    for (; *f; f++) {
+        if (*f != '%') {
+            out.text(f, 1);
+            continue;
+        }
+        char c = *++f;
+        if (!c) break;
+        if (a == args.end()) continue;
+        if (c == 'd' || c == 'i') out.integer(*a++);
+        else if (c == 'f' || c == 'g') out.real(asfloat(*a++));
+    }
+}
+)cpp";
+
+const char *epilogue = R"cpp(
+void *run(void *) {
+    f_main();
+    return nullptr;
+}
+
+}
+
+int main() {
+    pthread_attr_t a;
+    pthread_attr_init(&a);
+    pthread_attr_setstacksize(&a, size_t(1) << 30);
+    pthread_t t;
+    if (pthread_create(&t, &a, run, nullptr)) run(nullptr);
+    else pthread_join(t, nullptr);
+    out.flush();
+}
+)cpp";
+
+// Locals a body assigns, with their types
+class Locals : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    map<symid, typep> types;
+
+    statp rewrite(statp s) override {
+        auto a = as<AssignStat>(s);
+        if (a && a->left->suffixes.empty() && !types.count(a->left->sym)) types[a->left->sym] = a->left->type;
+        return children(s);
+    }
+};
+
+string ident(const string &name) {
+    string s;
+    for (char c : name) s += isalnum((unsigned char)c) || c == '_' ? c : '_';
+    return s;
+}
+
+// C++ literal of s
+string quote(const string &s) {
+    string q = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') q += string("\\") + (char)c;
+        else if (c >= ' ' && c < 127) q += c;
+        else {
+            char o[8];
+            snprintf(o, sizeof o, "\\%03o", c);
+            q += o;
+        }
+    }
+    return q + "\"";
+}
+
+string real(double d) {
+    if (d != d) return "NAN";
+    if (d - d != 0) return d < 0 ? "-INFINITY" : "INFINITY";
+    char t[32];
+    snprintf(t, sizeof t, "%.17g", d);
+    string s = t;
+    if (s.find_first_of(".e") == string::npos) s += ".0";
+    return s;
+}
+
+class CppGen {
+public:
+    CppGen(const File &file) : file(file) {}
+
+    string run() {
+        if (!file.functions.count("main")) throw runtime_error("No main function");
+        stringstream protos;
+        for (auto &d : file.functions) {
+            auto sig = signature(d.first, d.second);
+            protos << sig << ";\n";
+            body << "\n" << sig << " {\n";
+            define(d.second);
+            body << "}\n";
+        }
+        stringstream s;
+        s << prelude << "\n";
+        for (auto &t : structs) s << "struct " << t.second << ";\n";
+        for (auto &d : defs) s << d;
+        s << protos.str() << body.str() << epilogue;
+        return s.str();
+    }
+
+private:
+    const File &file;
+    stringstream body;
+    string indent;
+    int temps = 0;
+    map<typep, string> structs;
+    vector<string> defs;
+
+    void line(const string &s) {
+        body << indent << s << "\n";
+    }
+
+    string local(symid s) {
+        return ident(file.names->name(s)) + "_" + to_string(s);
+    }
+
+    string structName(typep t) {
+        auto it = structs.find(t);
+        if (it != structs.end()) return it->second;
+        string name;
+        vector<typep> fields;
+        if (auto o = as<TypeObj>(t)) {
+            name = "O_" + ident(o->name);
+            fields = file.objectDefinitions.at(o->name).type->t;
+        } else {
+            name = "T" + to_string(structs.size());
+            fields = as<TypeTuple>(t)->t;
+        }
+        structs[t] = name;
+        string def = "struct " + name + " {\n";
+        for (size_t i=0;i<fields.size();i++) def += "    " + type(fields[i]) + " f" + to_string(i) + ";\n";
+        defs.push_back(def + "};\n");
+        return name;
+    }
+
+    string type(typep t, bool element = false) {
+        if (!t) return "int64_t";
+        switch (t->kind) {
+            case TypeKind::Float: return "double";
+            // vector<bool> has no references to its elements
+            case TypeKind::Bool: return element ? "uint8_t" : "bool";
+            case TypeKind::String: return "const char*";
+            case TypeKind::Tuple: case TypeKind::Obj: return structName(t) + "*";
+            case TypeKind::List: return "std::vector<" + type(as<TypeList>(t)->t, true) + ">*";
+            case TypeKind::Function: throw runtime_error("Functions aren't values in native code");
+            default: return "int64_t";
+        }
+    }
+
+    string signature(const string &name, const FunctionDef &d) {
+        string s = type(d.ret) + " f_" + ident(name) + "(";
+        for (size_t i=0;i<d.args.size();i++) {
+            if (i) s += ", ";
+            s += type(d.args[i].type) + " " + local(d.args[i].sym);
+        }
+        return s + ")";
+    }
+
+    void define(const FunctionDef &d) {
+        indent = "    ";
+        Locals l;
+        for (auto &a : d.args) l.types[a.sym] = nullptr;
+        l.rewrite(d.body);
+        for (auto &a : d.args) l.types.erase(a.sym);
+        for (auto &v : l.types) line(type(v.second) + " " + local(v.first) + "{};");
+        for (auto s : d.body) stat(s);
+        line("return 0;");
+    }
+
+    // The interpreter evaluates operands left to right, C++ leaves their
+    // order open. When two or more of them can tell, they are computed
+    // into locals first, in statements or, in an expression, a lambda.
+    bool reorderable(const expl &es) {
+        int n = 0;
+        for (auto e : es) if (!stable(e)) n++;
+        return n < 2;
+    }
+
+    vector<string> hoisted(const expl &es) {
+        vector<string> v;
+        bool keep = reorderable(es);
+        for (auto e : es) {
+            if (keep) {
+                v.push_back(exp(e));
+                continue;
+            }
+            v.push_back("o" + to_string(temps++));
+            line("auto " + v.back() + " = " + exp(e) + ";");
+        }
+        return v;
+    }
+
+    template<class F>
+    string ordered(const expl &es, F use) {
+        vector<string> v;
+        if (reorderable(es)) {
+            for (auto e : es) v.push_back(exp(e));
+            return use(v);
+        }
+        string s = "[&] { ";
+        for (auto e : es) {
+            v.push_back("o" + to_string(temps++));
+            s += "auto " + v.back() + " = " + exp(e) + "; ";
+        }
+        return s + "return " + use(v) + "; }()";
+    }
+
+    const string &callee(lexpp f) {
+        if (!f->suffixes.empty() || (f->name != "printf" && !file.functions.count(f->name)))
+            throw runtime_error("Can only call functions by name: " + f->name);
+        return f->name;
+    }
+
+    string call(lexpp f, const expl &args) {
+        if (callee(f) == "printf") {
+            return ordered(args, [&](const vector<string> &v) {
+                string s = "(print(" + v[0] + ", {";
+                for (size_t i=1;i<v.size();i++) s += (i > 1 ? ", " : "") + v[i];
+                return s + "}), (int64_t)0)";
+            });
+        }
+        return ordered(args, [&](const vector<string> &v) {
+            string s = "f_" + ident(f->name) + "(";
+            for (size_t i=0;i<v.size();i++) s += (i ? ", " : "") + v[i];
+            return s + ")";
+        });
+    }
+
+    // printf with a literal format, split into text and numbers here
+    void print(const string &format, const expl &values) {
+        vector<string> v;
+        for (auto e : values) {
+            if (stable(e)) v.push_back(exp(e));
+            else {
+                v.push_back("o" + to_string(temps++));
+                line("auto " + v.back() + " = " + exp(e) + ";");
+            }
+        }
+        size_t next = 0;
+        string text;
+        auto flush = [&] {
+            if (!text.empty()) line("out.text(" + quote(text) + ", " + to_string(text.size()) + ");");
+            text.clear();
+        };
+        for (size_t i=0;i<format.size() && format[i];i++) {
+            if (format[i] != '%') {
+                text += format[i];
+                continue;
+            }
+            if (++i == format.size() || !format[i]) break;
+            char c = format[i];
+            if (next == v.size()) continue;
+            if (c == 'd' || c == 'i') {
+                flush();
+                line("out.integer(" + v[next++] + ");");
+            } else if (c == 'f' || c == 'g') {
+                flush();
+                line("out.real(asfloat(" + v[next++] + "));");
+            }
+        }
+        flush();
+    }
+
+    string binOp(BinOpExp *e) {
+        auto vm = instruction(e);
+        if (vm == Noop) throw runtime_error("No instruction for this operator");
+        static const char *ops[] = {"*", "/", "%", "+", "-", "<=", "<", ">", ">=", "==", "!="};
+        // Only a divisor that can be 0 needs checking
+        auto d = as<IntExp>(e->right);
+        bool check = (vm == Divi || vm == Modi) && (!d || d->val == 0);
+        return ordered({e->left, e->right}, [&](const vector<string> &v) {
+            if (check) return string(vm == Divi ? "divi(" : "modi(") + v[0] + ", " + v[1] + ")";
+            return "(" + v[0] + " " + ops[(int)e->op] + " " + v[1] + ")";
+        });
+    }
+
+    string exp(expp eb);
+    void stat(statp sb);
+};
+
+string CppGen::exp(expp eb) {
+    switch (eb->kind) {
+        case ExpKind::Nil:
+            return "(int64_t)0";
+        case ExpKind::Bool:
+            return static_cast<BoolExp*>(eb)->val ? "true" : "false";
+        case ExpKind::Int: {
+            auto v = static_cast<IntExp*>(eb)->val;
+            if (v == INT64_MIN) return "INT64_MIN";
+            return "(int64_t)" + to_string(v);
+        }
+        case ExpKind::Float:
+            return real(static_cast<FloatExp*>(eb)->val);
+        case ExpKind::String:
+            return quote(static_cast<StringExp*>(eb)->val);
+        case ExpKind::Id: {
+            auto e = static_cast<IdExp*>(eb);
+            if (as<TypeFunction>(e->type))
+                throw runtime_error("Functions aren't values in native code: " + e->name);
+            return local(e->sym);
+        }
+        case ExpKind::List: {
+            auto e = static_cast<ListExp*>(eb);
+            string s = "new std::vector<" + type(as<TypeList>(e->type)->t, true) + ">{";
+            for (size_t i=0;i<e->elements.size();i++) s += (i ? ", " : "") + exp(e->elements[i]);
+            return s + "}";
+        }
+        case ExpKind::Tuple: {
+            // Braced initializers are evaluated in order
+            auto e = static_cast<TupleExp*>(eb);
+            string s = "new " + structName(e->type) + "{";
+            for (size_t i=0;i<e->elements.size();i++) s += (i ? ", " : "") + exp(e->elements[i]);
+            return s + "}";
+        }
+        case ExpKind::Index: {
+            auto e = static_cast<IndexExp*>(eb);
+            return ordered({e->left, e->index}, [](const vector<string> &v) {
+                return "at(" + v[0] + ", " + v[1] + ")";
+            });
+        }
+        case ExpKind::TupleAccess: {
+            auto e = static_cast<TupleAccessExp*>(eb);
+            return exp(e->left) + "->f" + to_string(e->index);
+        }
+        case ExpKind::Call: {
+            auto e = static_cast<CallExp*>(eb);
+            return call(e->func, e->args);
+        }
+        case ExpKind::Ternary: {
+            auto e = static_cast<TernaryExp*>(eb);
+            return "(" + exp(e->cond) + " ? " + exp(e->then) + " : " + exp(e->els) + ")";
+        }
+        case ExpKind::Select: {
+            // Arms that can't fail or have side effects, the compiler is
+            // free to compute both and pick one without a branch
+            auto e = static_cast<SelectExp*>(eb);
+            return "(" + exp(e->cond) + " ? " + exp(e->then) + " : " + exp(e->els) + ")";
+        }
+        case ExpKind::Logical: {
+            auto e = static_cast<LogicalExp*>(eb);
+            auto op = e->op == LogicalOp::And ? " && " : " || ";
+            return "(" + exp(e->left) + op + exp(e->right) + ")";
+        }
+        case ExpKind::Cast: {
+            auto e = static_cast<CastExp*>(eb);
+            bool from = as<TypeFloat>(e->e->type), to = as<TypeFloat>(e->type);
+            if (from == to) return exp(e->e);
+            return string(to ? "(double)" : "(int64_t)") + exp(e->e);
+        }
+        case ExpKind::BinOp:
+            return binOp(static_cast<BinOpExp*>(eb));
+        case ExpKind::UnaryOp: {
+            auto e = static_cast<UnaryOpExp*>(eb);
+            return string(e->op == UnaryOp::Not ? "!" : "-") + exp(e->e);
+        }
+    }
+    throw runtime_error("Unknown expression");
+}
+
+void CppGen::stat(statp sb) {
+    switch (sb->kind) {
+        case StatKind::Assign: {
+            auto s = static_cast<AssignStat*>(sb);
+            auto l = s->left;
+            // The value first, then the indexes down to the element
+            expl es = {s->right};
+            for (auto suf : l->suffixes) {
+                if (auto li = as<ListIndexSuffix>(suf)) es.push_back(li->i);
+            }
+            auto v = hoisted(es);
+            auto target = local(l->sym);
+            size_t k = 1;
+            for (auto suf : l->suffixes) {
+                if (as<ListIndexSuffix>(suf)) target = "at(" + target + ", " + v[k++] + ")";
+                else target += "->f" + to_string(static_cast<TupleAccessSuffix*>(suf)->i);
+            }
+            line(target + " = " + v[0] + ";");
+            break;
+        }
+        case StatKind::FuncCall: {
+            auto s = static_cast<FuncCallStat*>(sb);
+            auto format = s->args.empty() ? nullptr : as<StringExp>(s->args[0]);
+            if (callee(s->func) == "printf" && format) {
+                print(format->val, expl(s->args.begin() + 1, s->args.end()));
+                break;
+            }
+            line(call(s->func, s->args) + ";");
+            break;
+        }
+        case StatKind::While: {
+            auto s = static_cast<WhileStat*>(sb);
+            line("while (" + exp(s->cond) + ") {");
+            indent += "    ";
+            stat(s->body);
+            indent.resize(indent.size() - 4);
+            line("}");
+            break;
+        }
+        case StatKind::If: {
+            auto s = static_cast<IfStat*>(sb);
+            line("if (" + exp(s->cond) + ") {");
+            indent += "    ";
+            stat(s->thenbody);
+            indent.resize(indent.size() - 4);
+            if (s->elsebody) {
+                line("} else {");
+                indent += "    ";
+                stat(s->elsebody);
+                indent.resize(indent.size() - 4);
+            }
+            line("}");
+            break;
+        }
+        case StatKind::Block:
+            for (auto s : static_cast<BlockStat*>(sb)->stats) stat(s);
+            break;
+        case StatKind::Break:
+            line("break;");
+            break;
+        case StatKind::Return: {
+            auto s = static_cast<ReturnStat*>(sb);
+            line("return " + (s->ret ? exp(s->ret) : string("0")) + ";");
+            break;
+        }
+    }
+}
+
+}
+
+string genCpp(const File &f) {
+    return CppGen(f).run();
+}
+
+void compileNative(const File &f, const string &out) {
+    auto src = out + ".cpp";
+    ofstream(src) << genCpp(f);
+    auto command = "g++ -O2 -fwrapv -w -pthread -o '" + out + "' '" + src + "'";
+    if (system(command.c_str()) != 0) throw runtime_error("Failed to compile " + src);
+}
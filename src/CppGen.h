@@ -0,0 +1,16 @@
+#pragma once
+
+#include "AST.h"
+
+#include <string>
+
+// Standalone C++ for a checked File, with a main running it. Ints, floats
+// and bools are native values, tuples and objects are structs and lists
+// are vectors, on the heap and shared between copies like in the
+// interpreter. printf goes through a buffered formatter, a literal format
+// is split up when generating.
+std::string genCpp(const File &f);
+
+// Writes genCpp(f) to out.cpp and builds the executable out from it with
+// g++ -O2. Throws if the compiler fails.
+void compileNative(const File &f, const std::string &out);
@@ -0,0 +1,549 @@
+#include "IR.h"
+#include "CodeGen.h"
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace std;
+
+Inst *Function::make(IROp op, Block *b) {
+    pool.emplace_back(new Inst());
+    auto i = pool.back().get();
+    i->op = op;
+    i->block = b;
+    i->id = pool.size() - 1;
+    return i;
+}
+
+Block *Function::newBlock() {
+    blocks.emplace_back(new Block());
+    blocks.back()->id = blocks.size() - 1;
+    return blocks.back().get();
+}
+
+void removeEdge(Block *from, Block *to) {
+    auto &p = to->preds;
+    auto i = find(p.begin(), p.end(), from) - p.begin();
+    p.erase(p.begin() + i);
+    for (auto in : to->insts) {
+        if (in->op != IROp::Phi) break;
+        in->args.erase(in->args.begin() + i);
+    }
+    auto &s = from->succs;
+    s.erase(find(s.begin(), s.end(), to));
+}
+
+void removeUnreachable(Function &f) {
+    set<Block*> seen;
+    vector<Block*> work = {f.blocks[0].get()};
+    seen.insert(work[0]);
+    while (!work.empty()) {
+        auto b = work.back();
+        work.pop_back();
+        for (auto s : b->succs) if (seen.insert(s).second) work.push_back(s);
+    }
+    for (auto &b : f.blocks) {
+        if (seen.count(b.get())) continue;
+        while (!b->succs.empty()) removeEdge(b.get(), b->succs.back());
+    }
+    f.blocks.erase(remove_if(f.blocks.begin(), f.blocks.end(),
+        [&](const unique_ptr<Block> &b) { return !seen.count(b.get()); }), f.blocks.end());
+}
+
+bool fold(Instruction vm, int64_t a, int64_t b, int64_t &r) {
+    double x = asfloat(a), y = asfloat(b);
+    switch (vm) {
+        case Not: r = !a; break;
+        case And: r = a && b; break;
+        case Or: r = a || b; break;
+        case Usubi: r = (int64_t)-(uint64_t)a; break;
+        case Usubf: r = asint(-x); break;
+        case Castif: r = asint((double)a); break;
+        case Castfi:
+            if (!(x > INT64_MIN && x < INT64_MAX)) return false;
+            r = (int64_t)x;
+            break;
+        case Muli: r = (int64_t)((uint64_t)a * b); break;
+        case Mulf: r = asint(x * y); break;
+        case Divi:
+        case Modi:
+            if (b == 0 || (a == INT64_MIN && b == -1)) return false;
+            r = vm == Divi ? a / b : a % b;
+            break;
+        case Divf: r = asint(x / y); break;
+        case Addi: r = (int64_t)((uint64_t)a + b); break;
+        case Addf: r = asint(x + y); break;
+        case Subi: r = (int64_t)((uint64_t)a - b); break;
+        case Subf: r = asint(x - y); break;
+        case Lteqi: r = a <= b; break;
+        case Lteqf: r = x <= y; break;
+        case Lti: r = a < b; break;
+        case Ltf: r = x < y; break;
+        case Gti: r = a > b; break;
+        case Gtf: r = x > y; break;
+        case Gteqi: r = a >= b; break;
+        case Gteqf: r = x >= y; break;
+        case Eqi: r = a == b; break;
+        case Eqf: r = x == y; break;
+        case Neqi: r = a != b; break;
+        case Neqf: r = x != y; break;
+        default: return false;
+    }
+    return true;
+}
+
+namespace {
+
+// SSA construction straight from the AST, as in Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form". A block is
+// sealed once all its predecessors are known, reading a variable in an
+// unsealed block leaves an incomplete phi filled in when it is.
+class IRBuilder {
+public:
+    IRBuilder(const File &file, Module &m) : file(file), m(m) {}
+
+    void function(const string &name, queue<string> &calls);
+
+private:
+    const File &file;
+    Module &m;
+    Function *f = nullptr;
+    Block *cur = nullptr;
+    unordered_map<Block*, unordered_map<symid, Inst*>> defs;
+    unordered_map<Block*, vector<pair<symid, Inst*>>> incomplete;
+    set<Block*> sealed;
+    unordered_map<symid, bool> floats;
+    // Phis found trivial, replaced by their only other operand
+    unordered_map<Inst*, Inst*> replaced;
+    vector<Block*> breaks;
+    map<string, int> strings;
+    queue<string> *calls = nullptr;
+
+    Inst *resolve(Inst *i) {
+        for (auto r = replaced.find(i); r != replaced.end(); r = replaced.find(i)) i = r->second;
+        return i;
+    }
+
+    Inst *constant(int64_t v, bool fp = false) {
+        auto i = f->make(IROp::Const, cur);
+        i->imm = v;
+        i->fp = fp;
+        cur->insts.push_back(i);
+        return i;
+    }
+
+    Inst *emit(IROp op, vector<Inst*> args, bool fp) {
+        auto i = f->make(op, cur);
+        i->args = args;
+        i->fp = fp;
+        cur->insts.push_back(i);
+        return i;
+    }
+
+    Inst *phi(Block *b, bool fp) {
+        auto p = f->make(IROp::Phi, b);
+        p->fp = fp;
+        auto at = find_if(b->insts.begin(), b->insts.end(), [](Inst *i) { return i->op != IROp::Phi; });
+        b->insts.insert(at, p);
+        return p;
+    }
+
+    void write(symid v, Block *b, Inst *i) {
+        defs[b][v] = i;
+    }
+
+    Inst *read(symid v, Block *b) {
+        auto &d = defs[b];
+        auto i = d.find(v);
+        if (i != d.end()) return resolve(i->second);
+        Inst *val;
+        if (!sealed.count(b)) {
+            val = phi(b, floats[v]);
+            incomplete[b].push_back({v, val});
+        } else if (b->preds.size() == 1) {
+            val = read(v, b->preds[0]);
+        } else if (b->preds.empty()) {
+            // Only in code no path reaches
+            auto saved = cur;
+            cur = b;
+            val = constant(0, floats[v]);
+            cur = saved;
+        } else {
+            val = phi(b, floats[v]);
+            write(v, b, val);
+            val = operands(v, val);
+        }
+        write(v, b, val);
+        return val;
+    }
+
+    Inst *operands(symid v, Inst *p) {
+        for (auto pred : p->block->preds) p->args.push_back(read(v, pred));
+        return trivial(p);
+    }
+
+    // A phi whose operands are all the same value, or itself, is that value
+    Inst *trivial(Inst *p) {
+        Inst *same = nullptr;
+        for (auto &a : p->args) {
+            a = resolve(a);
+            if (a == same || a == p) continue;
+            if (same) return p;
+            same = a;
+        }
+        if (!same) return p;
+        auto &insts = p->block->insts;
+        insts.erase(find(insts.begin(), insts.end(), p));
+        replaced[p] = same;
+        return same;
+    }
+
+    void seal(Block *b) {
+        for (auto &i : incomplete[b]) operands(i.first, i.second);
+        incomplete.erase(b);
+        sealed.insert(b);
+    }
+
+    Block *sealedBlock() {
+        auto b = f->newBlock();
+        sealed.insert(b);
+        return b;
+    }
+
+    void edge(Block *to) {
+        cur->succs.push_back(to);
+        to->preds.push_back(cur);
+    }
+
+    void jump(Block *to) {
+        cur->term = Term::Jump;
+        edge(to);
+    }
+
+    void branch(Inst *c, Block *t, Block *e) {
+        cur->term = Term::Branch;
+        cur->value = c;
+        edge(t);
+        edge(e);
+    }
+
+    // Code after a jump out of the middle of a block is unreachable
+    void unreachable() {
+        cur = sealedBlock();
+    }
+
+    // Lowers conditions of and/or to jumps, without their value
+    void condition(expp e, Block *t, Block *fb) {
+        if (auto l = as<LogicalExp>(e)) {
+            auto mid = f->newBlock();
+            if (l->op == LogicalOp::And) condition(l->left, mid, fb);
+            else condition(l->left, t, mid);
+            seal(mid);
+            cur = mid;
+            condition(l->right, t, fb);
+            return;
+        }
+        if (auto u = as<UnaryOpExp>(e)) {
+            if (u->op == UnaryOp::Not) return condition(u->e, fb, t);
+        }
+        branch(exp(e), t, fb);
+    }
+
+    // Value of c ? a : b, each side evaluated in its own block
+    template<class A, class B>
+    Inst *join(expp c, bool fp, A a, B b) {
+        auto then = f->newBlock(), els = f->newBlock(), after = f->newBlock();
+        condition(c, then, els);
+        seal(then);
+        seal(els);
+        cur = then;
+        auto tv = a();
+        auto tend = cur;
+        jump(after);
+        cur = els;
+        auto ev = b();
+        jump(after);
+        seal(after);
+        cur = after;
+        auto p = phi(after, fp);
+        for (auto pred : after->preds) p->args.push_back(pred == tend ? tv : ev);
+        return trivial(p);
+    }
+
+    Inst *call(lexpp func, const expl &args, typep ret) {
+        if (!func->suffixes.empty() || (func->name != "printf" && !file.functions.count(func->name)))
+            throw runtime_error("Can only call functions by name: " + func->name);
+        vector<Inst*> a;
+        for (auto e : args) a.push_back(exp(e));
+        auto c = emit(IROp::Call, a, as<TypeFloat>(ret) != nullptr);
+        c->callee = func->name;
+        if (func->name == "printf") return constant(0);
+        calls->push(func->name);
+        return c;
+    }
+
+    Inst *exp(expp eb);
+    void stat(statp sb);
+};
+
+Inst *IRBuilder::exp(expp eb) {
+    switch (eb->kind) {
+        case ExpKind::Nil: return constant(0);
+        case ExpKind::Bool: return constant(static_cast<BoolExp*>(eb)->val);
+        case ExpKind::Int: return constant(static_cast<IntExp*>(eb)->val);
+        case ExpKind::Float: return constant(asint(static_cast<FloatExp*>(eb)->val), true);
+        case ExpKind::String: {
+            auto &s = static_cast<StringExp*>(eb)->val;
+            auto it = strings.find(s);
+            if (it == strings.end()) {
+                it = strings.insert({s, (int)m.strings.size()}).first;
+                m.strings.push_back(s);
+            }
+            auto i = emit(IROp::String, {}, false);
+            i->imm = it->second;
+            return i;
+        }
+        case ExpKind::Id: {
+            auto e = static_cast<IdExp*>(eb);
+            if (file.functions.count(e->name)) throw runtime_error("Functions aren't values in the IR: " + e->name);
+            return read(e->sym, cur);
+        }
+        case ExpKind::Call: {
+            auto e = static_cast<CallExp*>(eb);
+            return call(e->func, e->args, e->type);
+        }
+        case ExpKind::Ternary: {
+            auto e = static_cast<TernaryExp*>(eb);
+            return join(e->cond, as<TypeFloat>(e->type) != nullptr,
+                [&]{ return exp(e->then); }, [&]{ return exp(e->els); });
+        }
+        case ExpKind::Select: {
+            auto e = static_cast<SelectExp*>(eb);
+            auto c = exp(e->cond);
+            auto t = exp(e->then);
+            return emit(IROp::Select, {c, t, exp(e->els)}, as<TypeFloat>(e->type) != nullptr);
+        }
+        case ExpKind::Logical: {
+            auto e = static_cast<LogicalExp*>(eb);
+            return join(e, false, [&]{ return constant(1); }, [&]{ return constant(0); });
+        }
+        case ExpKind::Cast: {
+            auto e = static_cast<CastExp*>(eb);
+            auto v = exp(e->e);
+            bool from = as<TypeFloat>(e->e->type), to = as<TypeFloat>(e->type);
+            if (from == to) return v;
+            auto i = emit(IROp::Op, {v}, to);
+            i->vm = to ? Castif : Castfi;
+            return i;
+        }
+        case ExpKind::BinOp: {
+            auto e = static_cast<BinOpExp*>(eb);
+            auto vm = instruction(e);
+            if (vm == Noop) throw runtime_error("No instruction for this operator");
+            auto l = exp(e->left);
+            auto i = emit(IROp::Op, {l, exp(e->right)}, as<TypeFloat>(e->type) != nullptr);
+            i->vm = vm;
+            return i;
+        }
+        case ExpKind::UnaryOp: {
+            auto e = static_cast<UnaryOpExp*>(eb);
+            auto i = emit(IROp::Op, {exp(e->e)}, as<TypeFloat>(e->type) != nullptr);
+            i->vm = instruction(e);
+            return i;
+        }
+        default:
+            throw runtime_error("Lists, tuples and objects aren't in the IR yet");
+    }
+}
+
+void IRBuilder::stat(statp sb) {
+    switch (sb->kind) {
+        case StatKind::Assign: {
+            auto s = static_cast<AssignStat*>(sb);
+            if (!s->left->suffixes.empty()) throw runtime_error("Lists, tuples and objects aren't in the IR yet");
+            floats[s->left->sym] = as<TypeFloat>(s->left->type) != nullptr;
+            write(s->left->sym, cur, exp(s->right));
+            break;
+        }
+        case StatKind::FuncCall: {
+            auto s = static_cast<FuncCallStat*>(sb);
+            call(s->func, s->args, nullptr);
+            break;
+        }
+        case StatKind::While: {
+            auto s = static_cast<WhileStat*>(sb);
+            auto header = f->newBlock(), body = f->newBlock(), exit = f->newBlock();
+            jump(header);
+            cur = header;
+            condition(s->cond, body, exit);
+            seal(body);
+            cur = body;
+            breaks.push_back(exit);
+            stat(s->body);
+            breaks.pop_back();
+            jump(header);
+            seal(header);
+            seal(exit);
+            cur = exit;
+            break;
+        }
+        case StatKind::If: {
+            auto s = static_cast<IfStat*>(sb);
+            auto then = f->newBlock(), after = f->newBlock();
+            auto els = s->elsebody ? f->newBlock() : after;
+            condition(s->cond, then, els);
+            seal(then);
+            cur = then;
+            stat(s->thenbody);
+            jump(after);
+            if (s->elsebody) {
+                seal(els);
+                cur = els;
+                stat(s->elsebody);
+                jump(after);
+            }
+            seal(after);
+            cur = after;
+            break;
+        }
+        case StatKind::Block:
+            for (auto s : static_cast<BlockStat*>(sb)->stats) stat(s);
+            break;
+        case StatKind::Break:
+            jump(breaks.back());
+            unreachable();
+            break;
+        case StatKind::Return: {
+            auto s = static_cast<ReturnStat*>(sb);
+            // The value can end in another block than it started in
+            auto v = !s->ret || as<NilExp>(s->ret) ? nullptr : exp(s->ret);
+            cur->term = Term::Return;
+            cur->value = v;
+            unreachable();
+            break;
+        }
+    }
+}
+
+void IRBuilder::function(const string &name, queue<string> &calls) {
+    auto &def = file.functions.at(name);
+    m.functions.emplace_back(new Function());
+    f = m.functions.back().get();
+    f->name = name;
+    f->params = def.args.size();
+    this->calls = &calls;
+    defs.clear();
+    incomplete.clear();
+    sealed.clear();
+    floats.clear();
+    replaced.clear();
+    cur = sealedBlock();
+    for (size_t i=0;i<def.args.size();i++) {
+        auto p = emit(IROp::Param, {}, as<TypeFloat>(def.args[i].type) != nullptr);
+        p->imm = i;
+        floats[def.args[i].sym] = p->fp;
+        write(def.args[i].sym, cur, p);
+    }
+    for (auto s : def.body) stat(s);
+    // Falling off the end returns nil
+    if (cur->term == Term::None) cur->term = Term::Return;
+
+    // Removing a trivial phi can make the phis using it trivial
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto &b : f->blocks) {
+            auto phis = b->insts;
+            for (auto i : phis) if (i->op == IROp::Phi && trivial(i) != i) changed = true;
+        }
+    }
+    for (auto &b : f->blocks) {
+        for (auto i : b->insts) for (auto &a : i->args) a = resolve(a);
+        if (b->value) b->value = resolve(b->value);
+    }
+    removeUnreachable(*f);
+}
+
+}
+
+Module buildIR(const File &file) {
+    if (!file.functions.count("main")) throw runtime_error("No main function");
+    Module m;
+    IRBuilder b(file, m);
+    set<string> done;
+    queue<string> calls;
+    calls.push("main");
+    while (!calls.empty()) {
+        auto name = calls.front();
+        calls.pop();
+        if (done.insert(name).second) b.function(name, calls);
+    }
+    return m;
+}
+
+static void print(ostream &out, Inst *i) {
+    static const char *names[] = {
+        "noop", "loads", "loadm", "store", "alloc", "free", "call", "return",
+        "ifjump", "jump", "castfi", "castif", "not", "and", "or", "usubi", "usubf",
+        "powi", "powf", "muli", "mulf", "divi", "divf", "modi", "addi", "addf",
+        "subi", "subf", "lteqi", "lteqf", "lti", "ltf", "gti", "gtf", "gteqi",
+        "gteqf", "eqi", "eqf", "neqi", "neqf", "end", "select", "tailcall",
+        "loadp", "storep", "loadl", "storel", "pushl",
+        "loadfield", "storefield"
+    };
+    out << "v" << i->id << " = ";
+    switch (i->op) {
+        case IROp::Const:
+            if (i->fp) out << asfloat(i->imm);
+            else out << i->imm;
+            break;
+        case IROp::String: out << "string " << i->imm; break;
+        case IROp::Param: out << "param " << i->imm; break;
+        case IROp::Phi: out << "phi"; break;
+        case IROp::Op: out << names[i->vm]; break;
+        case IROp::Select: out << "select"; break;
+        case IROp::Call: out << "call " << i->callee; break;
+    }
+    for (size_t a=0;a<i->args.size();a++) {
+        out << (a ? ", v" : " v") << i->args[a]->id;
+        if (i->op == IROp::Phi) out << " b" << i->block->preds[a]->id;
+    }
+    out << endl;
+}
+
+void print(ostream &out, const Module &m) {
+    for (auto &f : m.functions) {
+        out << f->name << "(" << f->params << ")" << endl;
+        for (auto &b : f->blocks) {
+            out << "b" << b->id << ":" << endl;
+            for (auto i : b->insts) {
+                out << "\t";
+                print(out, i);
+            }
+            out << "\t";
+            switch (b->term) {
+                case Term::Jump: out << "jump b" << b->succs[0]->id; break;
+                case Term::Branch:
+                    out << "branch v" << b->value->id << ", b" << b->succs[0]->id << ", b" << b->succs[1]->id;
+                    break;
+                default:
+                    out << "return";
+                    if (b->value) out << " v" << b->value->id;
+            }
+            out << endl;
+        }
+    }
+    for (size_t i=0;i<m.strings.size();i++) {
+        out << "string " << i << " = \"";
+        for (char c : m.strings[i]) {
+            if (c == '\n') out << "\\n";
+            else if (c == '\t') out << "\\t";
+            else if (c == '\\') out << "\\\\";
+            else out << c;
+        }
+        out << "\"" << endl;
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "AST.h"
+#include "VirtualMachine.h"
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// SSA form between the checked AST and vmcode. A function is a graph of
+// basic blocks, each a list of instructions ending in a terminator. Every
+// instruction defines one value, its operands are the instructions that
+// computed them. Values are single cells like in the VM: ints, bools,
+// string addresses, and floats by their bits.
+
+class Block;
+
+enum class IROp : uint8_t {
+    Const,  // imm
+    String, // address of Module::strings[imm]
+    Param,  // imm-th argument
+    Phi,    // one operand per predecessor of its block, in the same order
+    Op,     // VM instruction vm on one or two operands, args[0] is the left one
+    Select, // args[0] ? args[1] : args[2]
+    Call,   // callee(args...), printf has no value
+};
+
+class Inst {
+public:
+    IROp op;
+    Instruction vm = Noop;
+    int64_t imm = 0;
+    bool fp = false;
+    std::string callee;
+    std::vector<Inst*> args;
+    Block *block = nullptr;
+    int id = 0;
+};
+
+enum class Term : uint8_t {
+    None, Jump, Branch, Return
+};
+
+class Block {
+public:
+    int id = 0;
+    // Phis come first
+    std::vector<Inst*> insts;
+    // Branch goes to succs[0] when value is true, Return returns value or
+    // nil when it is null
+    Term term = Term::None;
+    Inst *value = nullptr;
+    std::vector<Block*> succs;
+    std::vector<Block*> preds;
+};
+
+class Function {
+public:
+    std::string name;
+    int params = 0;
+    // The first block is the entry
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::vector<std::unique_ptr<Inst>> pool;
+
+    Inst *make(IROp op, Block *b);
+    Block *newBlock();
+};
+
+class Module {
+public:
+    // Only main and the functions it calls
+    std::vector<std::unique_ptr<Function>> functions;
+    std::vector<std::string> strings;
+};
+
+// Supports what the VM can run: int, float, bool and string values,
+// calls of functions by name and printf. Throws on anything else.
+Module buildIR(const File &f);
+
+void print(std::ostream &out, const Module &m);
+
+// The IR passes, in the order they run, one bit each
+enum Pass {
+    // Sparse conditional constant propagation
+    PassSCCP = 1,
+    // Global value numbering
+    PassGVN = 2,
+    // Loop invariant code motion
+    PassLICM = 4,
+    // Induction variable strength reduction
+    PassSR = 8,
+    // Dead code elimination
+    PassDCE = 16,
+};
+
+// Level n runs the first n passes of: dead code elimination, sparse
+// conditional constant propagation, global value numbering, loop
+// invariant code motion and induction variable strength reduction
+unsigned passesAt(int level);
+
+// Runs each pass in passes, a set of Pass bits
+void optimize(Module &m, unsigned passes);
+
+// Whole program image, starting with a call to main
+vmcode lower(Module &m);
+
+// Shared by the passes
+void removeUnreachable(Function &f);
+void removeEdge(Block *from, Block *to);
+// Result of vm on constants, false when it has none, like a division by 0
+bool fold(Instruction vm, int64_t a, int64_t b, int64_t &r);
@@ -0,0 +1,429 @@
+#include "IR.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+// The VM has no frames, every value of a function lives in a memory cell
+// of its own. Constants and strings are loaded again where they are used,
+// a value used once, further down its own block, is computed right there
+// on the operand stack instead of going through memory. Calls that can
+// come back to the caller save the cells still needed after them on the
+// operand stack. A call whose value the function returns right away is a
+// TailCall: the callee returns to our caller, the address stack doesn't
+// grow.
+class Lowering {
+public:
+    Lowering(Module &m) : m(m) {}
+
+    vmcode run() {
+        components();
+        // Image: call main and stop, functions, strings, then the cells
+        functionRefs.push_back({code.size() + 1, "main"});
+        op(Call, 0);
+        op(End);
+        for (auto &f : m.functions) function(*f);
+        vector<int64_t> strings;
+        for (auto &s : m.strings) {
+            strings.push_back(code.size());
+            auto packed = packString(s);
+            code.insert(code.end(), packed.begin(), packed.end());
+        }
+        auto cells = code.size();
+        code.resize(cells + slots, 0);
+
+        for (auto &r : functionRefs) code[r.first] = functions.at(r.second);
+        for (auto &r : labelRefs) code[r.first] = labels.at(r.second);
+        for (auto &r : stringRefs) code[r.first] = strings[r.second];
+        for (auto &r : slotRefs) code[r.first] = cells + r.second;
+        return code;
+    }
+
+private:
+    Module &m;
+    vmcode code;
+    // Cell 0 takes results nothing uses
+    int slots = 1;
+    map<string, int64_t> functions;
+    unordered_map<Block*, int64_t> labels;
+    vector<pair<size_t, string>> functionRefs;
+    vector<pair<size_t, Block*>> labelRefs;
+    vector<pair<size_t, int>> stringRefs, slotRefs;
+    map<string, int> component;
+
+    // Of the function being lowered
+    Function *f = nullptr;
+    unordered_map<Inst*, int> slot;
+    set<Inst*> folded;
+    set<Inst*> tails;
+    unordered_map<Inst*, vector<Inst*>> saves;
+
+    void op(Instruction i) {
+        code.push_back(i);
+    }
+
+    void op(Instruction i, int64_t v) {
+        code.push_back(i);
+        code.push_back(v);
+    }
+
+    void cell(Instruction i, int s) {
+        slotRefs.push_back({code.size() + 1, s});
+        op(i, 0);
+    }
+
+    void jump(Instruction i, Block *to) {
+        labelRefs.push_back({code.size() + 1, to});
+        op(i, 0);
+    }
+
+    void store(Inst *i) {
+        auto s = slot.find(i);
+        cell(Store, s == slot.end() ? 0 : s->second);
+    }
+
+    void compute(Inst *i) {
+        if (i->op == IROp::Select) {
+            push(i->args[2]);
+            push(i->args[1]);
+            push(i->args[0]);
+            op(Select);
+            return;
+        }
+        // The left operand ends up on top
+        if (i->args.size() > 1) push(i->args[1]);
+        push(i->args[0]);
+        op(i->vm);
+    }
+
+    void push(Inst *i) {
+        if (i->op == IROp::Const) return op(LoadS, i->imm);
+        if (i->op == IROp::String) {
+            stringRefs.push_back({code.size() + 1, (int)i->imm});
+            return op(LoadS, 0);
+        }
+        if (folded.count(i)) return compute(i);
+        cell(LoadM, slot.at(i));
+    }
+
+    bool recursive(Inst *c) {
+        return c->callee != "printf" && component[c->callee] == component[f->name];
+    }
+
+    void call(Inst *c) {
+        if (c->callee == "printf") {
+            // Format on top, the values under it in order
+            for (size_t a=c->args.size();a-- > 1;) push(c->args[a]);
+            push(c->args[0]);
+            op(Call, Printf);
+            return;
+        }
+        auto &saved = saves[c];
+        for (auto s : saved) cell(LoadM, slot[s]);
+        for (auto a : c->args) push(a);
+        functionRefs.push_back({code.size() + 1, c->callee});
+        op(Call, 0);
+        store(c);
+        for (auto s = saved.rbegin(); s != saved.rend(); ++s) cell(Store, slot[*s]);
+    }
+
+    void terminator(Block *b, Block *next) {
+        switch (b->term) {
+            case Term::Jump: {
+                // All operands are read before any phi is written
+                auto s = b->succs[0];
+                size_t k = find(s->preds.begin(), s->preds.end(), b) - s->preds.begin();
+                vector<Inst*> phis;
+                for (auto i : s->insts) {
+                    if (i->op != IROp::Phi) break;
+                    phis.push_back(i);
+                }
+                for (auto p : phis) push(p->args[k]);
+                for (auto p = phis.rbegin(); p != phis.rend(); ++p) store(*p);
+                if (s == next) break;
+                // Jumping back to a loop header that only tests its
+                // condition, the test is done here instead
+                if (tests(s)) branch(s, next);
+                else jump(Jump, s);
+                break;
+            }
+            case Term::Branch:
+                branch(b, next);
+                break;
+            default:
+                if (tails.count(b->value)) {
+                    for (auto a : b->value->args) push(a);
+                    functionRefs.push_back({code.size() + 1, b->value->callee});
+                    op(TailCall, 0);
+                    break;
+                }
+                if (b->value) push(b->value);
+                else op(LoadS, 0);
+                op(Return);
+        }
+    }
+
+    void branch(Block *b, Block *next) {
+        auto t = b->succs[0], e = b->succs[1];
+        push(b->value);
+        if (t == next) {
+            op(Not);
+            jump(IfJump, e);
+        } else {
+            jump(IfJump, t);
+            if (e != next) jump(Jump, e);
+        }
+    }
+
+    // Block with no code of its own before its branch
+    bool tests(Block *b) {
+        if (b->term != Term::Branch) return false;
+        for (auto i : b->insts) {
+            if (i->op != IROp::Phi && i->op != IROp::Const && i->op != IROp::String && !folded.count(i)) return false;
+        }
+        return true;
+    }
+
+    // A jump to a block only returning one of its phis returns instead,
+    // so return f(x) in the arm of an if or a ternary is a tail call
+    void sinkReturns() {
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto &bp : f->blocks) {
+                auto b = bp.get();
+                if (b->term != Term::Jump) continue;
+                auto s = b->succs[0];
+                if (s->term != Term::Return) continue;
+                if (any_of(s->insts.begin(), s->insts.end(), [](Inst *i) { return i->op != IROp::Phi; })) continue;
+                auto v = s->value;
+                if (v && v->block == s) v = v->args[find(s->preds.begin(), s->preds.end(), b) - s->preds.begin()];
+                removeEdge(b, s);
+                b->term = Term::Return;
+                b->value = v;
+                changed = true;
+            }
+        }
+        removeUnreachable(*f);
+    }
+
+    // Phi copies go at the end of the predecessor, which can't be one
+    // that branches
+    void splitEdges() {
+        auto n = f->blocks.size();
+        for (size_t i=0;i<n;i++) {
+            auto b = f->blocks[i].get();
+            if (b->succs.size() < 2) continue;
+            for (auto &s : b->succs) {
+                if (s->insts.empty() || s->insts[0]->op != IROp::Phi) continue;
+                auto mid = f->newBlock();
+                mid->term = Term::Jump;
+                mid->preds.push_back(b);
+                mid->succs.push_back(s);
+                *find(s->preds.begin(), s->preds.end(), b) = mid;
+                s = mid;
+            }
+        }
+    }
+
+    // Reverse postorder, with the first successor right after its block
+    void postorder(Block *b, set<Block*> &seen, vector<Block*> &out) {
+        seen.insert(b);
+        for (auto s = b->succs.rbegin(); s != b->succs.rend(); ++s) {
+            if (!seen.count(*s)) postorder(*s, seen, out);
+        }
+        out.push_back(b);
+    }
+
+    void assign(const vector<Block*> &order) {
+        unordered_map<Inst*, int> uses;
+        unordered_map<Inst*, Inst*> user;
+        for (auto b : order) {
+            for (auto i : b->insts) for (auto a : i->args) {
+                uses[a]++;
+                user[a] = i;
+            }
+            if (b->value) {
+                uses[b->value]++;
+                user[b->value] = nullptr;
+            }
+        }
+        for (auto b : order) {
+            auto v = b->value;
+            if (b->term == Term::Return && v && v->op == IROp::Call && v->callee != "printf"
+                && b->insts.back() == v && uses[v] == 1) tails.insert(v);
+        }
+        for (auto b : order) {
+            for (auto i : b->insts) {
+                if (i->op == IROp::Const || i->op == IROp::String) continue;
+                bool pure = i->op == IROp::Op || i->op == IROp::Select;
+                // A division by 0 must still fail before what follows it
+                if ((i->vm == Divi || i->vm == Modi) && (i->args[1]->op != IROp::Const || i->args[1]->imm == 0))
+                    pure = false;
+                if (pure && uses[i] == 1) {
+                    // Operands of phis are used by the copies at the end of
+                    // the predecessor
+                    auto u = user[i];
+                    bool here = !u ? b->value == i
+                        : u->op != IROp::Phi ? u->block == b
+                        : u->block->preds[find(u->args.begin(), u->args.end(), i) - u->args.begin()] == b;
+                    if (here) {
+                        folded.insert(i);
+                        continue;
+                    }
+                }
+                if (i->op == IROp::Call && (!uses[i] || tails.count(i))) continue;
+                slot[i] = slots++;
+            }
+        }
+    }
+
+    // Adds the cells read by the value of i
+    void use(Inst *i, set<Inst*> &live) {
+        if (i->op == IROp::Const || i->op == IROp::String) return;
+        if (!folded.count(i)) {
+            live.insert(i);
+            return;
+        }
+        for (auto a : i->args) use(a, live);
+    }
+
+    set<Inst*> liveOut(Block *b, unordered_map<Block*, set<Inst*>> &in) {
+        set<Inst*> live;
+        for (auto s : b->succs) {
+            for (auto i : in[s]) live.insert(i);
+            size_t k = find(s->preds.begin(), s->preds.end(), b) - s->preds.begin();
+            for (auto i : s->insts) {
+                if (i->op != IROp::Phi) break;
+                use(i->args[k], live);
+            }
+        }
+        return live;
+    }
+
+    void walk(Block *b, set<Inst*> &live, bool record) {
+        if (b->value) use(b->value, live);
+        for (auto it = b->insts.rbegin(); it != b->insts.rend(); ++it) {
+            auto i = *it;
+            if (folded.count(i)) continue;
+            live.erase(i);
+            if (record && i->op == IROp::Call && recursive(i)) {
+                auto &s = saves[i];
+                s.assign(live.begin(), live.end());
+                sort(s.begin(), s.end(), [](Inst *a, Inst *b) { return a->id < b->id; });
+            }
+            if (i->op != IROp::Phi) for (auto a : i->args) use(a, live);
+        }
+    }
+
+    // Cells live across calls that can reenter this function
+    void liveness(const vector<Block*> &order) {
+        bool any = false;
+        for (auto b : order) for (auto i : b->insts) if (i->op == IROp::Call && recursive(i)) any = true;
+        if (!any) return;
+        unordered_map<Block*, set<Inst*>> in;
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto b = order.rbegin(); b != order.rend(); ++b) {
+                auto live = liveOut(*b, in);
+                walk(*b, live, false);
+                if (live != in[*b]) {
+                    in[*b] = live;
+                    changed = true;
+                }
+            }
+        }
+        for (auto b : order) {
+            auto live = liveOut(b, in);
+            walk(b, live, true);
+        }
+    }
+
+    void function(Function &fn) {
+        f = &fn;
+        slot.clear();
+        folded.clear();
+        tails.clear();
+        saves.clear();
+        sinkReturns();
+        splitEdges();
+        set<Block*> seen;
+        vector<Block*> order;
+        postorder(fn.blocks[0].get(), seen, order);
+        reverse(order.begin(), order.end());
+        assign(order);
+        liveness(order);
+
+        functions[fn.name] = code.size();
+        // Arguments are on the stack, the last one on top
+        vector<Inst*> params(fn.params, nullptr);
+        for (auto i : fn.blocks[0]->insts) if (i->op == IROp::Param) params[i->imm] = i;
+        for (auto p = params.rbegin(); p != params.rend(); ++p) store(*p);
+
+        for (size_t n=0;n<order.size();n++) {
+            auto b = order[n];
+            labels[b] = code.size();
+            for (auto i : b->insts) {
+                switch (i->op) {
+                    case IROp::Const: case IROp::String: case IROp::Param: case IROp::Phi:
+                        break;
+                    case IROp::Call:
+                        if (!tails.count(i)) call(i);
+                        break;
+                    default:
+                        if (folded.count(i)) break;
+                        compute(i);
+                        store(i);
+                }
+            }
+            terminator(b, n+1 < order.size() ? order[n+1] : nullptr);
+        }
+    }
+
+    // Tarjan's algorithm over the call graph
+    map<string, set<string>> graph;
+    map<string, int> index, low;
+    vector<string> stack;
+    set<string> onStack;
+
+    void connect(const string &v) {
+        int i = index.size();
+        index[v] = low[v] = i;
+        stack.push_back(v);
+        onStack.insert(v);
+        for (auto &w : graph[v]) {
+            if (!index.count(w)) {
+                connect(w);
+                low[v] = min(low[v], low[w]);
+            } else if (onStack.count(w)) low[v] = min(low[v], index[w]);
+        }
+        if (low[v] != index[v]) return;
+        string w;
+        do {
+            w = stack.back();
+            stack.pop_back();
+            onStack.erase(w);
+            component[w] = i;
+        } while (w != v);
+    }
+
+    void components() {
+        for (auto &fn : m.functions) {
+            auto &g = graph[fn->name];
+            for (auto &b : fn->blocks) for (auto i : b->insts) {
+                if (i->op == IROp::Call && i->callee != "printf") g.insert(i->callee);
+            }
+        }
+        for (auto &fn : m.functions) if (!index.count(fn->name)) connect(fn->name);
+    }
+};
+
+}
+
+vmcode lower(Module &m) {
+    return Lowering(m).run();
+}
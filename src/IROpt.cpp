@@ -0,0 +1,553 @@
+#include "IR.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+// Reverse postorder and immediate dominators, by Cooper, Harvey and
+// Kennedy's "A Simple, Fast Dominance Algorithm"
+class Dominators {
+public:
+    vector<Block*> rpo;
+    unordered_map<Block*, Block*> idom;
+    unordered_map<Block*, vector<Block*>> children;
+
+    Dominators(Function &f) {
+        set<Block*> seen;
+        postorder(f.blocks[0].get(), seen);
+        reverse(rpo.begin(), rpo.end());
+        for (size_t i=0;i<rpo.size();i++) order[rpo[i]] = i;
+        auto entry = rpo[0];
+        idom[entry] = entry;
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t i=1;i<rpo.size();i++) {
+                auto b = rpo[i];
+                Block *d = nullptr;
+                for (auto p : b->preds) {
+                    if (!idom.count(p)) continue;
+                    d = d ? intersect(p, d) : p;
+                }
+                if (idom[b] != d) {
+                    idom[b] = d;
+                    changed = true;
+                }
+            }
+        }
+        for (size_t i=1;i<rpo.size();i++) children[idom[rpo[i]]].push_back(rpo[i]);
+    }
+
+    bool dominates(Block *a, Block *b) {
+        while (b != a) {
+            auto d = idom[b];
+            if (d == b) return false;
+            b = d;
+        }
+        return true;
+    }
+
+private:
+    unordered_map<Block*, size_t> order;
+
+    void postorder(Block *b, set<Block*> &seen) {
+        seen.insert(b);
+        for (auto s : b->succs) if (!seen.count(s)) postorder(s, seen);
+        rpo.push_back(b);
+    }
+
+    Block *intersect(Block *a, Block *b) {
+        while (a != b) {
+            while (order[a] > order[b]) a = idom[a];
+            while (order[b] > order[a]) b = idom[b];
+        }
+        return a;
+    }
+};
+
+// Rewrites every use of a key to its value
+void replace(Function &f, unordered_map<Inst*, Inst*> &with) {
+    if (with.empty()) return;
+    auto get = [&](Inst *i) {
+        for (auto r = with.find(i); r != with.end(); r = with.find(i)) i = r->second;
+        return i;
+    };
+    for (auto &b : f.blocks) {
+        for (auto i : b->insts) for (auto &a : i->args) a = get(a);
+        if (b->value) b->value = get(b->value);
+    }
+    for (auto &b : f.blocks) {
+        auto &in = b->insts;
+        in.erase(remove_if(in.begin(), in.end(), [&](Inst *i) { return with.count(i); }), in.end());
+    }
+}
+
+// Int division traps on 0, everything else can run speculatively
+bool traps(Inst *i) {
+    if (i->op != IROp::Op || (i->vm != Divi && i->vm != Modi)) return false;
+    auto d = i->args[1];
+    return d->op != IROp::Const || d->imm == 0 || d->imm == -1;
+}
+
+bool pure(Inst *i) {
+    return i->op != IROp::Call;
+}
+
+// Keeps calls and what terminators and kept instructions use
+void deadCode(Function &f) {
+    set<Inst*> live;
+    vector<Inst*> work;
+    auto use = [&](Inst *i) { if (i && live.insert(i).second) work.push_back(i); };
+    for (auto &b : f.blocks) {
+        use(b->value);
+        for (auto i : b->insts) if (!pure(i)) use(i);
+    }
+    while (!work.empty()) {
+        auto i = work.back();
+        work.pop_back();
+        for (auto a : i->args) use(a);
+    }
+    for (auto &b : f.blocks) {
+        auto &in = b->insts;
+        in.erase(remove_if(in.begin(), in.end(), [&](Inst *i) { return !live.count(i); }), in.end());
+    }
+}
+
+// Sparse conditional constant propagation, Wegman and Zadeck. Values
+// start unknown and only go down to a constant, then to overdefined.
+// Blocks are only evaluated once an edge into them is known to be taken.
+class ConstProp {
+public:
+    ConstProp(Function &f) : f(f) {}
+
+    void run() {
+        for (auto &b : f.blocks) {
+            for (auto i : b->insts) for (auto a : i->args) users[a].push_back(i);
+            if (b->value) blockUsers[b->value].push_back(b.get());
+        }
+        reach(nullptr, f.blocks[0].get());
+        while (!edges.empty() || !insts.empty()) {
+            while (!edges.empty()) {
+                auto e = edges.back();
+                edges.pop_back();
+                visitEdge(e.first, e.second);
+            }
+            while (!insts.empty()) {
+                auto i = insts.back();
+                insts.pop_back();
+                if (!executable.count(i->block)) continue;
+                visit(i);
+            }
+        }
+        rewrite();
+    }
+
+private:
+    enum Level { Unknown, Constant, Over };
+    struct Value {
+        Level level = Unknown;
+        int64_t v = 0;
+    };
+
+    Function &f;
+    unordered_map<Inst*, Value> values;
+    unordered_map<Inst*, vector<Inst*>> users;
+    unordered_map<Inst*, vector<Block*>> blockUsers;
+    set<Block*> executable;
+    set<pair<Block*, Block*>> taken;
+    vector<pair<Block*, Block*>> edges;
+    vector<Inst*> insts;
+
+    void reach(Block *from, Block *to) {
+        if (taken.insert({from, to}).second) edges.push_back({from, to});
+    }
+
+    void visitEdge(Block *from, Block *to) {
+        bool first = executable.insert(to).second;
+        for (auto i : to->insts) {
+            if (i->op == IROp::Phi || first) visit(i);
+        }
+        if (first) terminator(to);
+        (void)from;
+    }
+
+    void update(Inst *i, Value v) {
+        auto &old = values[i];
+        if (old.level == v.level && old.v == v.v) return;
+        old = v;
+        for (auto u : users[i]) insts.push_back(u);
+        for (auto b : blockUsers[i]) if (executable.count(b)) terminator(b);
+    }
+
+    static Value meet(Value a, Value b) {
+        if (a.level == Unknown) return b;
+        if (b.level == Unknown) return a;
+        if (a.level == Over || b.level == Over || a.v != b.v) return {Over, 0};
+        return a;
+    }
+
+    void visit(Inst *i) {
+        auto &cur = values[i];
+        if (cur.level == Over) return;
+        switch (i->op) {
+            case IROp::Const: update(i, {Constant, i->imm}); break;
+            case IROp::String:
+            case IROp::Param:
+            case IROp::Call:
+                update(i, {Over, 0});
+                break;
+            case IROp::Phi: {
+                Value v;
+                for (size_t a=0;a<i->args.size();a++) {
+                    if (taken.count({i->block->preds[a], i->block})) v = meet(v, values[i->args[a]]);
+                }
+                update(i, v);
+                break;
+            }
+            case IROp::Select: {
+                auto c = values[i->args[0]];
+                if (c.level == Unknown) return;
+                if (c.level == Constant) update(i, values[i->args[c.v ? 1 : 2]]);
+                else update(i, meet(values[i->args[1]], values[i->args[2]]));
+                break;
+            }
+            case IROp::Op: {
+                Value a = values[i->args[0]], b;
+                if (i->args.size() > 1) b = values[i->args[1]];
+                else b.level = Constant;
+                if (a.level == Over || b.level == Over) return update(i, {Over, 0});
+                if (a.level == Unknown || b.level == Unknown) return;
+                int64_t r;
+                if (fold(i->vm, a.v, b.v, r)) update(i, {Constant, r});
+                else update(i, {Over, 0});
+                break;
+            }
+        }
+    }
+
+    void terminator(Block *b) {
+        if (b->term == Term::Jump) return reach(b, b->succs[0]);
+        if (b->term != Term::Branch) return;
+        auto c = values[b->value];
+        if (c.level == Unknown) return;
+        if (c.level == Constant) return reach(b, b->succs[c.v ? 0 : 1]);
+        reach(b, b->succs[0]);
+        reach(b, b->succs[1]);
+    }
+
+    void rewrite() {
+        for (auto &b : f.blocks) {
+            if (!executable.count(b.get())) continue;
+            for (auto i : b->insts) {
+                auto v = values[i];
+                if (v.level != Constant || i->op == IROp::Const) continue;
+                // Phis become constants at the start of their block
+                i->op = IROp::Const;
+                i->imm = v.v;
+                i->args.clear();
+            }
+            // Constants are never phis, the first ones may not be
+            stable_partition(b->insts.begin(), b->insts.end(), [](Inst *i) { return i->op == IROp::Phi; });
+            if (b->term == Term::Branch) {
+                auto c = values[b->value];
+                if (c.level == Constant) {
+                    auto dead = b->succs[c.v ? 1 : 0];
+                    if (b->succs[0] != b->succs[1]) removeEdge(b.get(), dead);
+                    else removeEdge(b.get(), b->succs[1]);
+                    b->term = Term::Jump;
+                    b->value = nullptr;
+                }
+            }
+        }
+        // Edges out of blocks never reached go with them
+        for (auto &b : f.blocks) {
+            if (executable.count(b.get())) continue;
+            while (!b->succs.empty()) removeEdge(b.get(), b->succs.back());
+        }
+        removeUnreachable(f);
+        // Phis left with a single operand
+        unordered_map<Inst*, Inst*> with;
+        for (auto &b : f.blocks) for (auto i : b->insts) {
+            if (i->op == IROp::Phi && i->args.size() == 1) with[i] = i->args[0];
+        }
+        replace(f, with);
+    }
+};
+
+// Dominator-based value numbering: an instruction computing what one in a
+// dominating block already did is replaced by it
+class ValueNumbering {
+public:
+    ValueNumbering(Function &f) : f(f), dom(f) {}
+
+    void run() {
+        walk(f.blocks[0].get());
+        replace(f, with);
+    }
+
+private:
+    using Key = tuple<IROp, Instruction, int64_t, bool, Block*, vector<Inst*>>;
+    Function &f;
+    Dominators dom;
+    map<Key, Inst*> available;
+    unordered_map<Inst*, Inst*> with;
+
+    Inst *get(Inst *i) {
+        auto r = with.find(i);
+        return r == with.end() ? i : r->second;
+    }
+
+    static bool commutes(Instruction vm) {
+        switch (vm) {
+            case Muli: case Mulf: case Addi: case Addf: case Eqi: case Eqf:
+            case Neqi: case Neqf: case And: case Or:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void walk(Block *b) {
+        vector<Key> added;
+        for (auto i : b->insts) {
+            if (!pure(i) || i->op == IROp::Param) continue;
+            for (auto &a : i->args) a = get(a);
+            auto args = i->args;
+            if (i->op == IROp::Op && commutes(i->vm)) sort(args.begin(), args.end());
+            // Phis are only the same within a block
+            Key k{i->op, i->vm, i->imm, i->fp, i->op == IROp::Phi ? b : nullptr, args};
+            auto e = available.find(k);
+            if (e != available.end()) with[i] = e->second;
+            else {
+                available[k] = i;
+                added.push_back(k);
+            }
+        }
+        for (auto c : dom.children[b]) walk(c);
+        for (auto &k : added) available.erase(k);
+    }
+};
+
+// Natural loop of a header, with all its back edges
+class Loop {
+public:
+    Block *header = nullptr;
+    set<Block*> blocks;
+    vector<Block*> latches;
+    // Only way in, null unless there is a single predecessor from outside
+    // that always goes to the header. The builder makes one for every
+    // while loop.
+    Block *preheader = nullptr;
+};
+
+// Inner loops first
+vector<Loop> loops(Dominators &dom) {
+    map<Block*, Loop> found;
+    for (auto b : dom.rpo) {
+        for (auto s : b->succs) {
+            if (!dom.dominates(s, b)) continue;
+            // Blocks reaching the back edge without going through the header
+            auto &l = found[s];
+            l.header = s;
+            l.blocks.insert(s);
+            l.latches.push_back(b);
+            vector<Block*> work;
+            if (l.blocks.insert(b).second) work.push_back(b);
+            while (!work.empty()) {
+                auto w = work.back();
+                work.pop_back();
+                for (auto p : w->preds) if (l.blocks.insert(p).second) work.push_back(p);
+            }
+        }
+    }
+    vector<Loop> out;
+    for (auto &f : found) {
+        auto &l = f.second;
+        for (auto p : l.header->preds) {
+            if (l.blocks.count(p)) continue;
+            if (l.preheader) {
+                l.preheader = nullptr;
+                break;
+            }
+            l.preheader = p;
+        }
+        if (l.preheader && l.preheader->succs.size() != 1) l.preheader = nullptr;
+        out.push_back(l);
+    }
+    stable_sort(out.begin(), out.end(), [](const Loop &a, const Loop &b) { return a.blocks.size() < b.blocks.size(); });
+    return out;
+}
+
+// Moves what doesn't change between iterations of a while loop to the
+// block before it. Inner loops go first, what they hoist can then leave
+// the outer ones too.
+class LoopInvariants {
+public:
+    LoopInvariants(Function &f) : dom(f) {}
+
+    void run() {
+        for (auto &l : loops(dom)) if (l.preheader) hoist(l);
+    }
+
+private:
+    Dominators dom;
+
+    void hoist(const Loop &l) {
+        auto pre = l.preheader;
+        for (auto b : dom.rpo) {
+            if (!l.blocks.count(b)) continue;
+            auto &in = b->insts;
+            for (size_t k=0;k<in.size();) {
+                auto i = in[k];
+                // Constants go too, so what uses them can follow
+                bool invariant = pure(i) && i->op != IROp::Phi && i->op != IROp::Param && !traps(i);
+                for (auto a : i->args) if (l.blocks.count(a->block)) invariant = false;
+                if (!invariant) {
+                    k++;
+                    continue;
+                }
+                in.erase(in.begin() + k);
+                i->block = pre;
+                pre->insts.push_back(i);
+            }
+        }
+    }
+};
+
+// Induction variable strength reduction. A phi of the header going up by
+// an invariant step on each iteration, i = phi(a, i + c), is a basic
+// induction variable; i * k in the loop, k invariant, is then a phi of
+// its own starting at a * k and going up by c * k, with an add on the
+// back edge instead of the multiply. Ints wrap, so this is exact.
+class StrengthReduction {
+public:
+    StrengthReduction(Function &f) : f(f), dom(f) {}
+
+    void run() {
+        for (auto &l : loops(dom)) {
+            if (l.preheader && l.latches.size() == 1 && l.header->preds.size() == 2) reduce(l);
+        }
+        replace(f, with);
+    }
+
+private:
+    Function &f;
+    Dominators dom;
+    unordered_map<Inst*, Inst*> with;
+
+    struct Induction {
+        Inst *start, *step;
+    };
+
+    bool invariant(const Loop &l, Inst *i) {
+        return i->op == IROp::Const || !l.blocks.count(i->block);
+    }
+
+    // Value of i usable in the preheader
+    Inst *outside(const Loop &l, Inst *i) {
+        if (!l.blocks.count(i->block)) return i;
+        auto c = f.make(IROp::Const, l.preheader);
+        c->imm = i->imm;
+        l.preheader->insts.push_back(c);
+        return c;
+    }
+
+    Inst *multiply(const Loop &l, Inst *a, Inst *b) {
+        if (a->op == IROp::Const) swap(a, b);
+        if (b->op == IROp::Const && b->imm == 1) return a;
+        int64_t r;
+        Inst *m;
+        if (b->op == IROp::Const && b->imm == 0) {
+            m = f.make(IROp::Const, l.preheader);
+        } else if (a->op == IROp::Const && fold(Muli, a->imm, b->imm, r)) {
+            m = f.make(IROp::Const, l.preheader);
+            m->imm = r;
+        } else {
+            m = f.make(IROp::Op, l.preheader);
+            m->vm = Muli;
+            m->args = {a, b};
+        }
+        l.preheader->insts.push_back(m);
+        return m;
+    }
+
+    void reduce(const Loop &l) {
+        auto h = l.header;
+        auto latch = l.latches[0];
+        size_t in = h->preds[0] == l.preheader ? 0 : 1, back = 1 - in;
+        map<Inst*, Induction> basic;
+        for (auto i : h->insts) {
+            if (i->op != IROp::Phi) break;
+            auto next = i->args[back];
+            if (i->fp || next->op != IROp::Op || next->vm != Addi) continue;
+            auto &a = next->args;
+            if (a[0] == i && invariant(l, a[1])) basic[i] = {i->args[in], a[1]};
+            else if (a[1] == i && invariant(l, a[0])) basic[i] = {i->args[in], a[0]};
+        }
+        if (basic.empty()) return;
+
+        // By variable and factor, equal constants being the same factor
+        map<tuple<Inst*, Inst*, int64_t>, Inst*> reduced;
+        for (auto b : dom.rpo) {
+            if (!l.blocks.count(b)) continue;
+            for (auto i : b->insts) {
+                if (i->op != IROp::Op || i->vm != Muli) continue;
+                Inst *v = i->args[0], *k = i->args[1];
+                if (!basic.count(v)) swap(v, k);
+                if (!basic.count(v) || !invariant(l, k)) continue;
+                if (k->op == IROp::Const && k->imm == 1) {
+                    with[i] = v;
+                    continue;
+                }
+                bool c = k->op == IROp::Const;
+                auto &q = reduced[make_tuple(v, c ? nullptr : k, c ? k->imm : 0)];
+                if (!q) q = create(l, basic[v], k, in, back, latch);
+                with[i] = q;
+            }
+        }
+    }
+
+    Inst *create(const Loop &l, Induction iv, Inst *k, size_t in, size_t back, Block *latch) {
+        auto factor = outside(l, k);
+        auto start = multiply(l, iv.start, factor);
+        auto step = multiply(l, outside(l, iv.step), factor);
+        auto q = f.make(IROp::Phi, l.header);
+        auto &hi = l.header->insts;
+        hi.insert(hi.begin(), q);
+        auto next = f.make(IROp::Op, latch);
+        next->vm = Addi;
+        next->args = {q, step};
+        latch->insts.push_back(next);
+        q->args.resize(2);
+        q->args[in] = start;
+        q->args[back] = next;
+        return q;
+    }
+};
+
+}
+
+unsigned passesAt(int level) {
+    unsigned passes = 0;
+    if (level >= 1) passes |= PassDCE;
+    if (level >= 2) passes |= PassSCCP;
+    if (level >= 3) passes |= PassGVN;
+    if (level >= 4) passes |= PassLICM;
+    if (level >= 5) passes |= PassSR;
+    return passes;
+}
+
+void optimize(Module &m, unsigned passes) {
+    for (auto &f : m.functions) {
+        if (passes & PassSCCP) ConstProp(*f).run();
+        if (passes & PassGVN) ValueNumbering(*f).run();
+        if (passes & PassLICM) LoopInvariants(*f).run();
+        if (passes & PassSR) StrengthReduction(*f).run();
+        if (passes & PassDCE) deadCode(*f);
+    }
+}
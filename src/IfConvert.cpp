@@ -0,0 +1,75 @@
+#include "Optimize.h"
+#include "Rewriter.h"
+
+using namespace std;
+
+namespace {
+
+// Cost of evaluating e unconditionally, -1 when it might have side
+// effects, fail or allocate: calls, indexing, list and tuple literals,
+// and a division whose divisor could be 0 or -1.
+int cost(expp eb) {
+    switch (eb->kind) {
+        case ExpKind::Nil:
+        case ExpKind::Bool:
+        case ExpKind::Int:
+        case ExpKind::Float:
+        case ExpKind::String:
+        case ExpKind::Id:
+            return 1;
+        case ExpKind::TupleAccess: {
+            auto c = cost(static_cast<TupleAccessExp*>(eb)->left);
+            return c < 0 ? -1 : c + 1;
+        }
+        case ExpKind::Cast: {
+            auto c = cost(static_cast<CastExp*>(eb)->e);
+            return c < 0 ? -1 : c + 1;
+        }
+        case ExpKind::UnaryOp: {
+            auto c = cost(static_cast<UnaryOpExp*>(eb)->e);
+            return c < 0 ? -1 : c + 1;
+        }
+        case ExpKind::BinOp: {
+            auto e = static_cast<BinOpExp*>(eb);
+            if ((e->op == BinOp::Div || e->op == BinOp::Mod) && as<TypeInt>(e->type)) {
+                auto d = as<IntExp>(e->right);
+                if (!d || d->val == 0 || d->val == -1) return -1;
+            }
+            auto l = cost(e->left), r = cost(e->right);
+            return l < 0 || r < 0 ? -1 : l + r + 1;
+        }
+        case ExpKind::Logical: {
+            auto e = static_cast<LogicalExp*>(eb);
+            auto l = cost(e->left), r = cost(e->right);
+            return l < 0 || r < 0 ? -1 : l + r + 1;
+        }
+        case ExpKind::Select: {
+            auto e = static_cast<SelectExp*>(eb);
+            auto c = cost(e->cond), t = cost(e->then), f = cost(e->els);
+            return c < 0 || t < 0 || f < 0 ? -1 : c + t + f + 1;
+        }
+        default:
+            return -1;
+    }
+}
+
+class IfConvert : public Rewriter {
+public:
+    IfConvert(int maxCost) : maxCost(maxCost) {}
+private:
+    int maxCost;
+    expp rewrite(expp e) override {
+        e = children(e);
+        auto t = as<TernaryExp>(e);
+        if (!t) return e;
+        auto then = cost(t->then), els = cost(t->els);
+        if (then < 0 || els < 0 || then + els > maxCost) return e;
+        return make<SelectExp>(t->cond, t->then, t->els);
+    }
+};
+
+}
+
+void ifConvert(File &f, int maxCost) {
+    IfConvert(maxCost).run(f);
+}
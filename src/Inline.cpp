@@ -0,0 +1,424 @@
+#include "Optimize.h"
+#include "Rewriter.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace std;
+
+namespace {
+
+// Node count, rewriting nothing
+class Size : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    size_t n = 0;
+    expp rewrite(expp e) override { n++; return children(e); }
+    statp rewrite(statp s) override { n++; return children(s); }
+};
+
+size_t size(const block &b) {
+    Size s;
+    s.rewrite(b);
+    return s.n;
+}
+
+// Int division by anything but a constant other than 0 and -1
+bool mayFail(BinOpExp *e) {
+    if (!e || (e->op != BinOp::Div && e->op != BinOp::Mod) || !as<TypeInt>(e->type)) return false;
+    auto d = as<IntExp>(e->right);
+    return !d || d->val == 0 || d->val == -1;
+}
+
+// Can be evaluated later or earlier than written without changing what
+// the program does. Tuples and objects are shared by reference, a field
+// read can see a write through any other name for the same one.
+bool movable(expp eb) {
+    switch (eb->kind) {
+        case ExpKind::Nil:
+        case ExpKind::Bool:
+        case ExpKind::Int:
+        case ExpKind::Float:
+        case ExpKind::String:
+        case ExpKind::Id:
+            return true;
+        case ExpKind::Cast: return movable(static_cast<CastExp*>(eb)->e);
+        case ExpKind::UnaryOp: return movable(static_cast<UnaryOpExp*>(eb)->e);
+        case ExpKind::BinOp: {
+            auto e = static_cast<BinOpExp*>(eb);
+            return !mayFail(e) && movable(e->left) && movable(e->right);
+        }
+        case ExpKind::Logical: {
+            auto e = static_cast<LogicalExp*>(eb);
+            return movable(e->left) && movable(e->right);
+        }
+        case ExpKind::Ternary: {
+            auto e = static_cast<TernaryExp*>(eb);
+            return movable(e->cond) && movable(e->then) && movable(e->els);
+        }
+        case ExpKind::Select: {
+            auto e = static_cast<SelectExp*>(eb);
+            return movable(e->cond) && movable(e->then) && movable(e->els);
+        }
+        case ExpKind::List:
+        case ExpKind::Tuple: {
+            auto &els = eb->kind == ExpKind::List ? static_cast<ListExp*>(eb)->elements
+                : static_cast<TupleExp*>(eb)->elements;
+            return all_of(els.begin(), els.end(), movable);
+        }
+        default:
+            return false;
+    }
+}
+
+// Calls made by a body, to functions of the file
+class Callees : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    Callees(const File &f) : f(f) {}
+    set<string> names;
+    expp rewrite(expp e) override {
+        if (auto c = as<CallExp>(e)) add(c->func);
+        return children(e);
+    }
+    statp rewrite(statp s) override {
+        if (auto c = as<FuncCallStat>(s)) add(c->func);
+        return children(s);
+    }
+private:
+    const File &f;
+    void add(lexpp l) {
+        if (l->suffixes.empty() && f.functions.count(l->name)) names.insert(l->name);
+    }
+};
+
+// Copy of an inlined body with its arguments and locals renamed, and its
+// returns assigning the result. Returns not at the end break out of the
+// loop the body is wrapped in.
+class Instance : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    Instance(map<symid, pair<string, symid>> &renamed, lexpp result, statp last)
+        : renamed(renamed), result(result), last(last) {}
+
+    expp rewrite(expp e) override {
+        if (auto i = as<IdExp>(e)) {
+            auto r = renamed.find(i->sym);
+            if (r == renamed.end()) return e;
+            return make<IdExp>(i->type, r->second.first, r->second.second);
+        }
+        return children(e);
+    }
+    lexpp rewrite(lexpp l) override {
+        auto n = Rewriter::rewrite(l);
+        auto r = renamed.find(l->sym);
+        if (r == renamed.end()) return n;
+        return make<Lexp>(r->second.first, r->second.second, n->suffixes, n->type);
+    }
+    statp rewrite(statp s) override {
+        auto r = as<ReturnStat>(s);
+        if (!r) return children(s);
+        auto assign = make<AssignStat>(result, rewrite(r->ret));
+        if (s == last) return assign;
+        return make<BlockStat>(block{assign, make<BreakStat>()});
+    }
+
+private:
+    map<symid, pair<string, symid>> &renamed;
+    lexpp result;
+    statp last;
+};
+
+// Locals and arguments of a body, the names an inlined copy renames
+class Locals : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    set<symid> syms;
+    int loops = 0;
+    bool returnInLoop = false;
+    statp rewrite(statp s) override {
+        if (auto a = as<AssignStat>(s)) syms.insert(a->left->sym);
+        if (as<ReturnStat>(s) && loops) returnInLoop = true;
+        if (auto w = as<WhileStat>(s)) {
+            loops++;
+            rewrite(w->body);
+            loops--;
+            return s;
+        }
+        return children(s);
+    }
+};
+
+// Every path through s ends in a return
+bool returns(statp s) {
+    if (as<ReturnStat>(s)) return true;
+    if (auto i = as<IfStat>(s)) return i->elsebody && returns(i->thenbody) && returns(i->elsebody);
+    if (auto b = as<BlockStat>(s)) return any_of(b->stats.begin(), b->stats.end(), returns);
+    return false;
+}
+
+struct Callee {
+    FunctionDef *def = nullptr;
+    size_t size = 0;
+    bool recursive = false;
+    bool returnInLoop = false;
+    // Every path ends in a return, the value of a call is always set
+    bool returns = false;
+    set<symid> locals;
+};
+
+class Inliner : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    Inliner(File &f, size_t threshold, ostream *report) : f(f), threshold(threshold), report(report) {}
+
+    size_t inlined = 0;
+
+    void run() {
+        ArenaScope scope(*f.arena);
+        for (auto &d : f.functions) {
+            Callees c(f);
+            c.rewrite(d.second.body);
+            graph[d.first] = c.names;
+        }
+        // Strongly connected components come out callees first, so each
+        // body is final before anything inlines it
+        for (auto &d : f.functions) if (!index.count(d.first)) connect(d.first);
+        for (auto name : order) {
+            auto &d = f.functions.at(name);
+            function = &name;
+            d.body = body(d.body);
+            Locals l;
+            for (auto &a : d.args) l.syms.insert(a.sym);
+            l.rewrite(d.body);
+            auto &c = callees[name];
+            c.def = &d;
+            c.size = size(d.body);
+            c.returnInLoop = l.returnInLoop;
+            c.returns = any_of(d.body.begin(), d.body.end(), returns);
+            c.locals = l.syms;
+        }
+    }
+
+private:
+    File &f;
+    size_t threshold;
+    ostream *report;
+    map<string, set<string>> graph;
+    map<string, Callee> callees;
+    vector<string> order;
+    int sites = 0;
+
+    // Tarjan's algorithm
+    map<string, int> index, low;
+    vector<string> stack;
+    set<string> onStack;
+
+    void connect(const string &v) {
+        int i = index.size();
+        index[v] = low[v] = i;
+        stack.push_back(v);
+        onStack.insert(v);
+        for (auto &w : graph[v]) {
+            if (!index.count(w)) {
+                connect(w);
+                low[v] = min(low[v], low[w]);
+            } else if (onStack.count(w)) low[v] = min(low[v], index[w]);
+        }
+        if (low[v] != index[v]) return;
+        vector<string> scc;
+        string w;
+        do {
+            w = stack.back();
+            stack.pop_back();
+            onStack.erase(w);
+            scc.push_back(w);
+        } while (w != v);
+        for (auto &n : scc) {
+            callees[n].recursive = scc.size() > 1 || graph[n].count(n);
+            order.push_back(n);
+        }
+    }
+
+    // Statements to run before the one being rewritten, and whether
+    // everything of it evaluated so far can be moved after them
+    block *pending = nullptr;
+    bool clean = true;
+
+    // Callee to inline for this call, null if it stays a call
+    Callee *pick(lexpp func, bool needsValue) {
+        if (!func->suffixes.empty()) return nullptr;
+        auto c = callees.find(func->name);
+        if (c == callees.end() || !c->second.def) return nullptr;
+        auto &callee = c->second;
+        const char *why = nullptr;
+        string detail;
+        if (callee.recursive) why = "recursive";
+        else if (callee.size > threshold) {
+            why = "too big";
+            detail = " (" + to_string(callee.size) + " nodes)";
+        } else if (callee.returnInLoop) why = "returns from inside a loop";
+        else if (needsValue && !callee.returns) why = "may end without returning a value";
+        else if (!clean) why = "evaluated after code it can't move before";
+        if (report) {
+            *report << *function << ": ";
+            if (why) *report << "kept call to " << func->name << ", " << why << detail << endl;
+            else *report << "inlined " << func->name << " (" << callee.size << " nodes)" << endl;
+        }
+        return why ? nullptr : &callee;
+    }
+
+    // Inlined body of a call, queued before the statement making it. The
+    // value returned, if used, is left in the local it returns.
+    expp expand(Callee &c, const expl &args) {
+        auto site = "$" + to_string(++sites);
+        auto name = "$r" + site;
+        auto result = make<Lexp>(name, f.names->intern(name), vector<Lexpsuffix*>(), c.def->ret);
+        map<symid, pair<string, symid>> renamed;
+        for (auto s : c.locals) {
+            auto name = f.names->name(s) + site;
+            renamed[s] = {name, f.names->intern(name)};
+        }
+        for (size_t i=0;i<args.size();i++) {
+            auto &a = c.def->args[i];
+            auto &r = renamed[a.sym];
+            pending->push_back(make<AssignStat>(make<Lexp>(r.first, r.second, vector<Lexpsuffix*>(), a.type), args[i]));
+        }
+        auto &body = c.def->body;
+        statp last = !body.empty() && as<ReturnStat>(body.back()) ? body.back() : nullptr;
+        auto copy = Instance(renamed, result, last).rewrite(body);
+        // Returns before the end leave through a break
+        if (early(body, last)) {
+            copy.push_back(make<BreakStat>());
+            pending->push_back(make<WhileStat>(make<BoolExp>(true), make<BlockStat>(copy)));
+        } else pending->insert(pending->end(), copy.begin(), copy.end());
+        inlined++;
+        return make<IdExp>(result->type, result->name, result->sym);
+    }
+
+    static bool early(const block &b, statp last) {
+        class Find : public Rewriter {
+        public:
+            using Rewriter::rewrite;
+            statp last;
+            bool found = false;
+            statp rewrite(statp s) override {
+                if (as<ReturnStat>(s) && s != last) found = true;
+                return children(s);
+            }
+        } find;
+        find.last = last;
+        find.rewrite(b);
+        return find.found;
+    }
+
+    expp rewrite(expp eb) override {
+        switch (eb->kind) {
+            case ExpKind::Call: {
+                auto e = static_cast<CallExp*>(eb);
+                auto args = rewrite(e->args);
+                auto c = pick(e->func, true);
+                if (!c) {
+                    clean = false;
+                    if (args == e->args) return e;
+                    auto n = make<CallExp>(e->func, args);
+                    n->type = e->type;
+                    return n;
+                }
+                return expand(*c, args);
+            }
+            // Only the conditions always run, calls in the rest stay
+            case ExpKind::Ternary: {
+                auto e = static_cast<TernaryExp*>(eb);
+                auto c = rewrite(e->cond);
+                if (!movable(e->then) || !movable(e->els)) clean = false;
+                if (c == e->cond) return e;
+                auto n = make<TernaryExp>(e->then, c, e->els);
+                n->type = e->type;
+                return n;
+            }
+            case ExpKind::Logical: {
+                auto e = static_cast<LogicalExp*>(eb);
+                auto l = rewrite(e->left);
+                if (!movable(e->right)) clean = false;
+                if (l == e->left) return e;
+                return make<LogicalExp>(e->op, l, e->right);
+            }
+            // Children are accounted for, only what e itself does matters
+            default: {
+                auto e = children(eb);
+                if (as<IndexExp>(e) || as<TupleAccessExp>(e) || mayFail(as<BinOpExp>(e))) clean = false;
+                return e;
+            }
+        }
+    }
+
+    statp rewrite(statp sb) override {
+        switch (sb->kind) {
+            // The value is computed before the indices of the target
+            case StatKind::Assign: {
+                auto s = static_cast<AssignStat*>(sb);
+                auto r = rewrite(s->right);
+                auto l = rewrite(s->left);
+                if (l == s->left && r == s->right) return s;
+                return make<AssignStat>(l, r);
+            }
+            case StatKind::FuncCall: {
+                auto s = static_cast<FuncCallStat*>(sb);
+                auto args = rewrite(s->args);
+                auto c = pick(s->func, false);
+                if (!c) {
+                    if (args == s->args) return s;
+                    return make<FuncCallStat>(s->func, args);
+                }
+                expand(*c, args);
+                return nullptr;
+            }
+            // Evaluated every iteration, nothing can run before it once
+            case StatKind::While: {
+                auto s = static_cast<WhileStat*>(sb);
+                return make<WhileStat>(s->cond, nested(s->body));
+            }
+            case StatKind::If: {
+                auto s = static_cast<IfStat*>(sb);
+                auto c = rewrite(s->cond);
+                auto then = nested(s->thenbody);
+                auto els = s->elsebody ? nested(s->elsebody) : nullptr;
+                return make<IfStat>(c, then, els);
+            }
+            case StatKind::Block:
+                return make<BlockStat>(body(static_cast<BlockStat*>(sb)->stats));
+            default:
+                return children(sb);
+        }
+    }
+
+    statp nested(statp s) {
+        if (auto b = as<BlockStat>(s)) return make<BlockStat>(body(b->stats));
+        return make<BlockStat>(body({s}));
+    }
+
+    block body(const block &b) {
+        block out;
+        auto saved = pending;
+        for (auto s : b) {
+            block before;
+            pending = &before;
+            clean = true;
+            auto n = rewrite(s);
+            out.insert(out.end(), before.begin(), before.end());
+            if (n) out.push_back(n);
+        }
+        pending = saved;
+        return out;
+    }
+};
+
+}
+
+size_t inlineCalls(File &f, size_t threshold, ostream *report) {
+    Inliner i(f, threshold, report);
+    i.run();
+    return i.inlined;
+}
@@ -1,11 +1,12 @@
 #include "Interpreter.h"
 
-#include <map>
+#include <unordered_map>
+#include <stdexcept>
 
 using namespace std;
 
 enum class ValueKind {
-    Nil, Bool, Int, Float, String, Obj, List, Range, Tuple, Func, NativeFunc
+    Nil, Bool, Int, Float, String, List, Tuple, Func, NativeFunc
 };
 
 class Value;
@@ -13,144 +14,125 @@ using valp = shared_ptr<Value>;
 
 class Value {
 public:
+    Value(ValueKind kind) : kind(kind) {}
     virtual ~Value() {}
-    virtual valp unaryOp(UnaryOp op) {
-        throw "Unsupported unary op";
-    }
-    virtual valp binOp(BinOp op, valp right) {
-        throw "Unsupported binary op";
-    }
+    const ValueKind kind;
 };
 
-
 class NilValue : public Value {
 public:
-    
+    NilValue() : Value(ValueKind::Nil) {}
 };
 
 class BoolValue : public Value {
 public:
-    BoolValue(bool val) : val(val) {}
+    BoolValue(bool val) : Value(ValueKind::Bool), val(val) {}
     bool val;
-    
-    virtual valp unaryOp(UnaryOp op) override {
-        if (op == UnaryOp::Not) {
-            return valp(new BoolValue(!val));
-        }
-        throw "Unsupported bool operation";
-    }
-    virtual valp binOp(BinOp op, valp right) override {
-        if (auto v0 = dynamic_pointer_cast<BoolValue>(right)) {
-            auto v1 = v0->val;
-            if (op == BinOp::Eq) return valp(new BoolValue(val == v1));
-            else if (op == BinOp::Neq) return valp(new BoolValue(val != v1));
-            else if (op == BinOp::And) return valp(new BoolValue(val && v1));
-            else if (op == BinOp::Or) return valp(new BoolValue(val || v1));
-            else throw "Unsupported bool operation";
-        } else throw "Unsupported bool operation";
-    }
 };
+
 class IntValue : public Value {
 public:
-    IntValue(long val) : val(val) {}
+    IntValue(long val) : Value(ValueKind::Int), val(val) {}
     long val;
-    
-    virtual valp unaryOp(UnaryOp op) override {
-        if (op == UnaryOp::Minus)
-            return valp(new IntValue(-val));
-        throw "Unsupported int operation";
-    }
-    virtual valp binOp(BinOp op, valp right) override;
 };
+
 class FloatValue : public Value {
 public:
-    FloatValue(double val) : val(val) {}
-    FloatValue(IntValue v) : val(v.val) {}
+    FloatValue(double val) : Value(ValueKind::Float), val(val) {}
     double val;
-    
-    virtual valp unaryOp(UnaryOp op) override {
-        if (op == UnaryOp::Minus)
-            return valp(new FloatValue(-val));
-        throw;
-    }
-    virtual valp binOp(BinOp op, valp right) override;
 };
+
 class StringValue : public Value {
 public:
-    StringValue(string val) : val(val) {}
+    StringValue(string val) : Value(ValueKind::String), val(val) {}
     string val;
-    
-    virtual valp binOp(BinOp op, valp right) override {
-        if (op == BinOp::Concat) { 
-            if (auto r0 = dynamic_pointer_cast<StringValue>(right)) {
-                auto r = r0->val;
-                return valp(new StringValue(val + r));
-            }
-        }
-        throw;
+};
+
+class ListValue : public Value {
+public:
+    ListValue() : Value(ValueKind::List) {}
+    virtual valp get(long index)=0;
+    virtual void set(long index, valp v)=0;
+    // Appends, growing the storage geometrically
+    virtual void push(valp v)=0;
+protected:
+    static size_t check(long index, size_t size) {
+        if (index < 0 || (size_t)index >= size) throw runtime_error("List index out of range");
+        return index;
     }
 };
-class ObjValue : public Value {
+
+// Ints, floats and bools stored unboxed in one buffer, bools packed to
+// bits. They're boxed again when read.
+template<class T, class V, ValueKind K>
+class TypedList : public ListValue {
 public:
-    ObjValue() {}
-    void add(string name, valp val) {
-        fields[name] = val;
+    valp get(long index) override {
+        return valp(new V(elements[check(index, elements.size())]));
     }
-    valp& get(string name) {
-        auto f = fields.find(name);
-        if (f == fields.end()) throw "test";
-        return f->second;
+    void set(long index, valp v) override {
+        elements[check(index, elements.size())] = unbox(v);
+    }
+    void push(valp v) override {
+        elements.push_back(unbox(v));
+    }
+    vector<T> elements;
+private:
+    static T unbox(const valp &v) {
+        if (v->kind != K) throw runtime_error("Wrong type for list element");
+        return static_cast<V*>(v.get())->val;
     }
-    map<string, valp> fields;
-    
 };
-class ListValue : public Value {
+
+using IntList = TypedList<long, IntValue, ValueKind::Int>;
+using FloatList = TypedList<double, FloatValue, ValueKind::Float>;
+using BoolList = TypedList<bool, BoolValue, ValueKind::Bool>;
+
+class BoxedList : public ListValue {
 public:
-    ListValue(vector<valp> e) : elements(e) {}
-    void add(valp e) {
-        if (elements.size()==0) elements.push_back(e);
-        else {
-            if (typeid(e) == typeid(elements[0]))
-                elements.push_back(e);
-            else throw;
-        }
+    valp get(long index) override {
+        return elements[check(index, elements.size())];
     }
-    ListValue() {}
-    valp& get(int index) {
-        if (index >= elements.size()) throw;
-        return elements[index];
+    void set(long index, valp v) override {
+        elements[check(index, elements.size())] = v;
+    }
+    void push(valp v) override {
+        elements.push_back(v);
     }
-    int size() { return elements.size(); }
     vector<valp> elements;
-    
-};
-class RangeValue : public Value {
-public:
-    RangeValue(IntValue beg, IntValue end) : beg(beg), end(end) {}
-    IntValue beg, end;
-    
 };
+
+// Storage picked by the element type, which the checker fixed
+static ListValue *newList(typep t) {
+    auto l = as<TypeList>(t);
+    auto el = l ? l->t : nullptr;
+    if (as<TypeInt>(el)) return new IntList();
+    if (as<TypeFloat>(el)) return new FloatList();
+    if (as<TypeBool>(el)) return new BoolList();
+    return new BoxedList();
+}
+
 class TupleValue : public Value {
 public:
-    TupleValue(vector<valp> e) : elements(e) {}
+    TupleValue(vector<valp> e) : Value(ValueKind::Tuple), elements(e) {}
     valp& get(int index) {
-        if (index >= elements.size()) throw;
+        if (index >= elements.size()) throw runtime_error("Tuple index out of range");
         return elements[index];
     }
     vector<valp> elements;
-    
 };
+
 class FuncValue : public Value {
 public:
-    FuncValue(FuncExp f) : func(f) {}
-    FuncExp func;
-    
+    FuncValue(FunctionDef *f) : Value(ValueKind::Func), func(f) {}
+    FunctionDef *func;
 };
 
 class InterpreterContext;
 
 class NativeFuncValue : public Value {
 public:
+    NativeFuncValue() : Value(ValueKind::NativeFunc) {}
     virtual valp exec(InterpreterContext &c, vector<valp> args)=0;
 };
 
@@ -159,369 +141,368 @@ public:
     virtual valp exec(InterpreterContext &c, vector<valp> args) override;
 };
 
-class StdLib : public ObjValue {
-public:
-    StdLib();
-};
+static valp binOp(BinOp op, valp l, valp r);
+static valp unaryOp(UnaryOp op, valp a);
 
+using Frame = unordered_map<symid, valp>;
 
 class InterpreterContext {
 public:
-    InterpreterContext(ostream &out) : out(out) {
-        vars.push_back(StdLib());
-    }
-    void evalBlock(block b);
-    valp eval(expp eb);
-    valp& leval(expp eb);
+    InterpreterContext(ostream &out, File &f);
+    void evalBlock(const block &b);
     void eval(statp sb);
-    valp& get(string name) {
-        for (int i=vars.size()-1;i>=0;i--) {
-            try {
-                return vars[i].get(name);
-            } catch (...) {
-                continue;
-            }
-        }
-        throw;
-    }
-    valp& getLeftValue(string name) {
-        for (int i=vars.size()-1;i>=0;i--) {
-            try {
-                return vars[i].get(name);
-            } catch (...) {
-                continue;
-            }
-        }
-        vars.back().add(name, valp(new NilValue()));
-        return vars.back().get(name);
-    }
-    void newFrame() {
-        vars.push_back(ObjValue());
-    }
-    void popFrame() {
-        vars.pop_back();
-    }
-    void add(string name, valp val) {
-        vars.back().add(name, val);
-    }
+    valp eval(expp eb);
+    valp call(valp f, vector<valp> args);
+    valp leval(lexpp l, size_t n);
+    void assign(lexpp l, valp v);
+    valp& get(symid name);
 
     ostream &out;
-    vector<ObjValue> vars;
+    Names &names;
+    Frame globals;
+    Frame locals;
     bool broke = false;
     bool returned = false;
     valp returnval = nullptr;
+    // Function returned to by the current one and its arguments, call
+    // runs it in the same frame
+    valp tailfunc = nullptr;
+    vector<valp> tailargs;
 };
 
-void InterpreterContext::evalBlock(block b) {
+InterpreterContext::InterpreterContext(ostream &out, File &f) : out(out), names(*f.names) {
+    globals[names.intern("printf")] = valp(new NativePrint());
+    for (auto &d : f.functions) {
+        globals[names.intern(d.first)] = valp(new FuncValue(&d.second));
+    }
+}
+
+valp& InterpreterContext::get(symid name) {
+    auto it = locals.find(name);
+    if (it != locals.end()) return it->second;
+    it = globals.find(name);
+    if (it != globals.end()) return it->second;
+    throw runtime_error("Unknown variable " + names.name(name));
+}
+
+void InterpreterContext::evalBlock(const block &b) {
     for (auto s : b) {
         eval(s);
         if (broke || returned) break;
     }
 }
 
+static bool truth(valp v) {
+    if (v->kind != ValueKind::Bool) throw runtime_error("Condition must be a bool");
+    return static_cast<BoolValue*>(v.get())->val;
+}
+
 void InterpreterContext::eval(statp sb) {
-    if (auto s = dynamic_pointer_cast<AssignStat>(sb)) {
-        auto r = eval(s->right);
-        if (s->left.size() > 1) {
-            if (auto tu0 = dynamic_pointer_cast<TupleValue>(r)) {
-                auto tu = tu0->elements;
-                if (s->left.size() != tu.size()) throw;
-                for (int i=0;i<s->left.size();i++) {
-                    leval(s->left[i]) = tu[i];
-                }
-            }
-        } else {
-            leval(s->left[0]) = r;
+    switch (sb->kind) {
+        case StatKind::Assign: {
+            auto s = static_cast<AssignStat*>(sb);
+            assign(s->left, eval(s->right));
+            break;
         }
-    } else if (auto s = dynamic_pointer_cast<FuncCallStat>(sb)) {
-        eval(expp(new CallExp(s->func, s->args)));
-    } else if (auto s = dynamic_pointer_cast<WhileStat>(sb)) {
-        while (true) {
-            auto v = eval(s->cond);
-            if (auto v0 = dynamic_pointer_cast<BoolValue>(v)) {
-                if (!v0->val) return;
+        case StatKind::FuncCall: {
+            auto s = static_cast<FuncCallStat*>(sb);
+            vector<valp> args;
+            for (auto a : s->args) args.push_back(eval(a));
+            call(leval(s->func, s->func->suffixes.size()), args);
+            break;
+        }
+        case StatKind::While: {
+            auto s = static_cast<WhileStat*>(sb);
+            while (truth(eval(s->cond))) {
                 eval(s->body);
-                if (broke || returned) {
+                if (returned) break;
+                if (broke) {
                     broke = false;
                     break;
                 }
-            } else throw "While condition must be a bool";
-        } 
-    } else if (auto s = dynamic_pointer_cast<IfStat>(sb)) {
-        auto v = eval(s->cond);
-        if (auto v0 = dynamic_pointer_cast<BoolValue>(v)) {
-            if (v0->val) 
-                eval(s->thenbody);
-            else
-                eval(s->elsebody);
-        } throw "If condition must be a bool";
-    } else if (auto s = dynamic_pointer_cast<ForStat>(sb)) {
-        auto l = eval(s->list);
-        if (auto l0 = dynamic_pointer_cast<ListValue>(l)) {
-            for (auto i : l0->elements) {
-                newFrame();
-                add(s->name, i);
-                eval(s->body);
-                popFrame();
-                broke = false;
             }
-        } else if (auto r = dynamic_pointer_cast<RangeValue>(l)) {
-            for (auto i=r->beg.val;i<r->end.val;i++) {
-                newFrame();
-                add(s->name, valp(new IntValue(i)));
-                eval(s->body);
-                popFrame();
-                broke = false;
+            break;
+        }
+        case StatKind::If: {
+            auto s = static_cast<IfStat*>(sb);
+            if (truth(eval(s->cond))) eval(s->thenbody);
+            else eval(s->elsebody);
+            break;
+        }
+        case StatKind::Block:
+            evalBlock(static_cast<BlockStat*>(sb)->stats);
+            break;
+        case StatKind::Break:
+            broke = true;
+            break;
+        case StatKind::Return: {
+            auto r = static_cast<ReturnStat*>(sb)->ret;
+            returned = true;
+            if (r->kind == ExpKind::Call) {
+                auto e = static_cast<CallExp*>(r);
+                vector<valp> args;
+                for (auto a : e->args) args.push_back(eval(a));
+                auto f = leval(e->func, e->func->suffixes.size());
+                if (f->kind == ValueKind::Func) {
+                    tailfunc = f;
+                    tailargs = move(args);
+                } else returnval = call(f, args);
+                break;
             }
-        } else throw;
-    } else if (auto s = dynamic_pointer_cast<BlockStat>(sb)) {
-        evalBlock(s->stats);
-    } else if (auto s = dynamic_pointer_cast<BreakStat>(sb)) {
-        broke = true;
-    } else if (auto s = dynamic_pointer_cast<ReturnStat>(sb)) {
-        returned = true;
-        returnval = eval(s->ret);
+            returnval = eval(r);
+            break;
+        }
     }
 }
 
 valp InterpreterContext::eval(expp eb) {
-    if (auto e = dynamic_pointer_cast<NilExp>(eb)) {
-        return valp(new NilValue());
-    } else if (auto e = dynamic_pointer_cast<BoolExp>(eb)) {
-        return valp(new BoolValue(e->val));
-    } else if (auto e = dynamic_pointer_cast<IntExp>(eb)) {
-        return valp(new IntValue(e->val));
-    } else if (auto e = dynamic_pointer_cast<FloatExp>(eb)) {
-        return valp(new FloatValue(e->val));
-    } else if (auto e = dynamic_pointer_cast<StringExp>(eb)) {
-        return valp(new StringValue(e->val));
-    } else if (auto e = dynamic_pointer_cast<IdExp>(eb)) {
-        return get(e->name);
-    } else if (auto e = dynamic_pointer_cast<ObjExp>(eb)) {
-        auto o = new ObjValue();
-        for (auto f : e->fields) {
-            o->add(f.name, eval(f.e));
+    switch (eb->kind) {
+        case ExpKind::Nil:
+            return valp(new NilValue());
+        case ExpKind::Bool:
+            return valp(new BoolValue(static_cast<BoolExp*>(eb)->val));
+        case ExpKind::Int:
+            return valp(new IntValue(static_cast<IntExp*>(eb)->val));
+        case ExpKind::Float:
+            return valp(new FloatValue(static_cast<FloatExp*>(eb)->val));
+        case ExpKind::String:
+            return valp(new StringValue(static_cast<StringExp*>(eb)->val));
+        case ExpKind::Id:
+            return get(static_cast<IdExp*>(eb)->sym);
+        case ExpKind::List: {
+            auto e = static_cast<ListExp*>(eb);
+            valp l(newList(e->type));
+            auto list = static_cast<ListValue*>(l.get());
+            for (auto el : e->elements) list->push(eval(el));
+            return l;
         }
-        return valp(o);
-    } else if (auto e = dynamic_pointer_cast<ListExp>(eb)) {
-        auto l = new ListValue();
-        for (auto el : e->elements) {
-            l->add(eval(el));
+        case ExpKind::Tuple: {
+            vector<valp> l;
+            for (auto el : static_cast<TupleExp*>(eb)->elements) l.push_back(eval(el));
+            return valp(new TupleValue(l));
         }
-        return valp(l);
-    } else if (auto e = dynamic_pointer_cast<RangeExp>(eb)) {
-        auto beg = eval(e->begin);
-        auto end0 = eval(e->end);
-
-        auto b1 = dynamic_pointer_cast<IntValue>(beg);
-        auto e1 = dynamic_pointer_cast<IntValue>(end0);
-
-        if (!b1 || !e1)
-            throw;
-
-        return valp(new RangeValue(*b1,*e1));
-    } else if (auto e = dynamic_pointer_cast<TupleExp>(eb)) {
-        auto l = vector<valp>();
-        for (auto el : e->elements) {
-            l.push_back(eval(el));
+        case ExpKind::Index: {
+            auto e = static_cast<IndexExp*>(eb);
+            auto l = eval(e->left);
+            auto i = eval(e->index);
+            if (l->kind != ValueKind::List || i->kind != ValueKind::Int) throw runtime_error("Bad index");
+            return static_cast<ListValue*>(l.get())->get(static_cast<IntValue*>(i.get())->val);
         }
-        return valp(new TupleValue(l));
-    } else if (auto e = dynamic_pointer_cast<FuncExp>(eb)) {
-        return valp(new FuncValue(*e));
-    } else if (auto e = dynamic_pointer_cast<MemberExp>(eb)) {
-        auto l = eval(e->left);
-
-        if (auto o = dynamic_pointer_cast<ObjValue>(l))
-            return o->get(e->name);
-        else throw;
-    } else if (auto e = dynamic_pointer_cast<IndexExp>(eb)) {
-        auto l = eval(e->left);
-        auto ind = eval(e->index);
-
-        if (auto ind1 = dynamic_pointer_cast<IntValue>(ind)) {
-            int ind0 = ind1->val;
-
-            if (auto l0 = dynamic_pointer_cast<ListValue>(l))
-                return l0->get(ind0);
-            else if (auto l0 = dynamic_pointer_cast<TupleValue>(l))
-                return l0->get(ind0);
-            else throw;
+        case ExpKind::TupleAccess: {
+            auto e = static_cast<TupleAccessExp*>(eb);
+            auto l = eval(e->left);
+            if (l->kind != ValueKind::Tuple) throw runtime_error("Not a tuple");
+            return static_cast<TupleValue*>(l.get())->get(e->index);
         }
-    } else if (auto e = dynamic_pointer_cast<CallExp>(eb)) {
-        auto f = eval(e->func);
-
-        if (auto f1 = dynamic_pointer_cast<FuncValue>(f)) {
-            auto f0 = f1->func;
-
-            newFrame();
-            
-            for (int i=0;i<e->args.size();i++) {
-                add(f0.args[i], eval(e->args[i]));
-            }
+        case ExpKind::Call: {
+            auto e = static_cast<CallExp*>(eb);
+            vector<valp> args;
+            for (auto a : e->args) args.push_back(eval(a));
+            return call(leval(e->func, e->func->suffixes.size()), args);
+        }
+        case ExpKind::Ternary: {
+            auto e = static_cast<TernaryExp*>(eb);
+            return truth(eval(e->cond)) ? eval(e->then) : eval(e->els);
+        }
+        case ExpKind::Cast: {
+            auto e = static_cast<CastExp*>(eb);
+            auto v = eval(e->e);
+            if (as<TypeFloat>(e->type) && v->kind == ValueKind::Int)
+                return valp(new FloatValue(static_cast<IntValue*>(v.get())->val));
+            if (as<TypeInt>(e->type) && v->kind == ValueKind::Float)
+                return valp(new IntValue(static_cast<FloatValue*>(v.get())->val));
+            return v;
+        }
+        case ExpKind::BinOp: {
+            auto e = static_cast<BinOpExp*>(eb);
+            auto l = eval(e->left);
+            return binOp(e->op, l, eval(e->right));
+        }
+        case ExpKind::UnaryOp: {
+            auto e = static_cast<UnaryOpExp*>(eb);
+            return unaryOp(e->op, eval(e->e));
+        }
+        case ExpKind::Logical: {
+            auto e = static_cast<LogicalExp*>(eb);
+            auto l = eval(e->left);
+            if (truth(l) == (e->op == LogicalOp::Or)) return l;
+            return eval(e->right);
+        }
+        case ExpKind::Select: {
+            auto e = static_cast<SelectExp*>(eb);
+            auto c = eval(e->cond);
+            auto then = eval(e->then);
+            auto els = eval(e->els);
+            return truth(c) ? then : els;
+        }
+    }
+    throw runtime_error("Unknown expression");
+}
 
-            evalBlock(f0.body.stats);
-            if (returned) {
-                returned = false;
-                return returnval;
+valp InterpreterContext::call(valp f, vector<valp> args) {
+    if (f->kind == ValueKind::NativeFunc) {
+        return static_cast<NativeFuncValue*>(f.get())->exec(*this, args);
+    } else if (f->kind == ValueKind::Func) {
+        Frame saved;
+        swap(saved, locals);
+        // Tail calls replace the frame instead of nesting, deep tail
+        // recursion doesn't grow the native stack
+        for (;;) {
+            auto def = static_cast<FuncValue*>(f.get())->func;
+            locals.clear();
+            for (int i=0;i<def->args.size();i++) {
+                locals[def->args[i].sym] = args[i];
             }
+            evalBlock(def->body);
+            if (!tailfunc) break;
+            f = move(tailfunc);
+            args = move(tailargs);
+            tailfunc = nullptr;
+            returned = false;
+        }
+        valp ret = returned ? returnval : valp(new NilValue());
+        returned = false;
+        returnval = nullptr;
+        swap(saved, locals);
+        return ret;
+    } else throw runtime_error("Unsupported type for calling");
+}
 
-            auto ret = eval(f0.body.ret);
-            popFrame();
-            return ret;
-        } else if (auto f0 = dynamic_pointer_cast<NativeFuncValue>(f)) {
-            vector<valp> argsv;
-            for (int i=0;i<e->args.size();i++) {
-                argsv.push_back(eval(e->args[i]));
-            }
-            return f0->exec(*this, argsv);
-        } else throw "Unsupported type for calling";
-    } else if (auto e = dynamic_pointer_cast<UnaryOpExp>(eb)) {
-        auto a = eval(e->e);
-        return a->unaryOp(e->op);
-    } else if (auto e = dynamic_pointer_cast<BinOpExp>(eb)) {
-        auto l = eval(e->left);
-        auto r = eval(e->right);
-        return l->binOp(e->op, r);
-    } else if (auto e = dynamic_pointer_cast<TernaryExp>(eb)) {
-        auto co = eval(e->cond);
-        if (auto c1 = dynamic_pointer_cast<BoolValue>(co)) {
-            if (c1->val) return eval(e->then);
-            else return eval(e->els);
-        } else throw;
+// The value l stands for, through its first n suffixes
+valp InterpreterContext::leval(lexpp l, size_t n) {
+    valp v = get(l->sym);
+    for (size_t j=0;j<n;j++) {
+        auto s = l->suffixes[j];
+        if (s->kind == SuffixKind::ListIndex) {
+            auto i = eval(static_cast<ListIndexSuffix*>(s)->i);
+            if (v->kind != ValueKind::List || i->kind != ValueKind::Int) throw runtime_error("Bad index");
+            v = static_cast<ListValue*>(v.get())->get(static_cast<IntValue*>(i.get())->val);
+        } else {
+            if (v->kind != ValueKind::Tuple) throw runtime_error("Not a tuple");
+            v = static_cast<TupleValue*>(v.get())->get(static_cast<TupleAccessSuffix*>(s)->i);
+        }
     }
-    throw;
+    return v;
 }
 
-valp& InterpreterContext::leval(expp eb) {
-    if (auto e = dynamic_pointer_cast<IdExp>(eb)) {
-        return getLeftValue(e->name);
-    } else if (auto e = dynamic_pointer_cast<TernaryExp>(eb)) {
-        auto co = eval(e->cond);
-        if (auto c1 = dynamic_pointer_cast<BoolValue>(co)) {
-            if (c1->val) return leval(e->then);
-            else return leval(e->els);
-        } else throw;
-    } else throw;
+// Declared variables must exist, a lexp with a type is a new local
+void InterpreterContext::assign(lexpp l, valp r) {
+    if (l->suffixes.empty()) {
+        if (l->type && !locals.count(l->sym) && !globals.count(l->sym)) locals[l->sym] = r;
+        else get(l->sym) = r;
+        return;
+    }
+    auto v = leval(l, l->suffixes.size() - 1);
+    auto s = l->suffixes.back();
+    if (s->kind == SuffixKind::ListIndex) {
+        auto i = eval(static_cast<ListIndexSuffix*>(s)->i);
+        if (v->kind != ValueKind::List || i->kind != ValueKind::Int) throw runtime_error("Bad index");
+        static_cast<ListValue*>(v.get())->set(static_cast<IntValue*>(i.get())->val, r);
+    } else {
+        if (v->kind != ValueKind::Tuple) throw runtime_error("Not a tuple");
+        static_cast<TupleValue*>(v.get())->get(static_cast<TupleAccessSuffix*>(s)->i) = r;
+    }
 }
 
+static valp intOp(BinOp op, long a, long b) {
+    switch (op) {
+        case BinOp::Add: return valp(new IntValue(a+b));
+        case BinOp::Sub: return valp(new IntValue(a-b));
+        case BinOp::Mul: return valp(new IntValue(a*b));
+        case BinOp::Div:
+            if (b == 0) throw runtime_error("Division by zero");
+            return valp(new IntValue(a/b));
+        case BinOp::Mod:
+            if (b == 0) throw runtime_error("Division by zero");
+            return valp(new IntValue(a%b));
+        case BinOp::Lt: return valp(new BoolValue(a<b));
+        case BinOp::Lteq: return valp(new BoolValue(a<=b));
+        case BinOp::Gt: return valp(new BoolValue(a>b));
+        case BinOp::Gteq: return valp(new BoolValue(a>=b));
+        case BinOp::Eq: return valp(new BoolValue(a==b));
+        case BinOp::Neq: return valp(new BoolValue(a!=b));
+        default: throw runtime_error("Unsupported int operation");
+    }
+}
 
-valp IntValue::binOp(BinOp op, valp right) {
-    if (auto v0 = dynamic_pointer_cast<IntValue>(right)) {
-        auto v1 = v0->val; 
-        if (op == BinOp::Pow) {
-            long l = 1;
-            for (int i=0;i<v1;i++) l *= val;
-            return valp(new IntValue(l));
-        } else if (op == BinOp::Mul) {
-            return valp(new IntValue(val*v1));
-        } else if (op == BinOp::Div) {
-            return valp(new IntValue(val/v1));
-        } else if (op == BinOp::Mod) {
-            return valp(new IntValue(val%v1));
-        } else if (op == BinOp::Plus) {
-            return valp(new IntValue(val+v1));
-        } else if (op == BinOp::Minus) {
-            return valp(new IntValue(val-v1));
-        } else if (op == BinOp::Lteq) {
-            return valp(new BoolValue(val<=v1));
-        } else if (op == BinOp::Lt) {
-            return valp(new BoolValue(val<v1));
-        } else if (op == BinOp::Gt) {
-            return valp(new BoolValue(val>v1));
-        } else if (op == BinOp::Gteq) {
-            return valp(new BoolValue(val>=v1));
-        } else if (op == BinOp::Eq) {
-            return valp(new BoolValue(val==v1));
-        } else if (op == BinOp::Neq) {
-            return valp(new BoolValue(val!=v1));
-        } else throw "Unsupported int operation";
-    } else if (auto v0 = dynamic_pointer_cast<FloatValue>(right)) {
-        return FloatValue(*this).binOp(op, v0);
-    } else throw "Unsupported int operation";
+static valp floatOp(BinOp op, double a, double b) {
+    switch (op) {
+        case BinOp::Add: return valp(new FloatValue(a+b));
+        case BinOp::Sub: return valp(new FloatValue(a-b));
+        case BinOp::Mul: return valp(new FloatValue(a*b));
+        case BinOp::Div: return valp(new FloatValue(a/b));
+        case BinOp::Lt: return valp(new BoolValue(a<b));
+        case BinOp::Lteq: return valp(new BoolValue(a<=b));
+        case BinOp::Gt: return valp(new BoolValue(a>b));
+        case BinOp::Gteq: return valp(new BoolValue(a>=b));
+        case BinOp::Eq: return valp(new BoolValue(a==b));
+        case BinOp::Neq: return valp(new BoolValue(a!=b));
+        default: throw runtime_error("Unsupported float operation");
+    }
 }
 
-valp FloatValue::binOp(BinOp op, valp right) {
-    if (auto v0 = dynamic_pointer_cast<FloatValue>(right)) {
-        auto v1 = v0->val; 
-        if (op == BinOp::Pow) {
-            double l = 1.0;
-            for (int i=0;i<(long)v1;i++) l *= val;
-            return valp(new FloatValue(l));
-        } else if (op == BinOp::Mul) {
-            return valp(new FloatValue(val*v1));
-        } else if (op == BinOp::Div) {
-            return valp(new FloatValue(val/v1));
-        } else if (op == BinOp::Plus) {
-            return valp(new FloatValue(val+v1));
-        } else if (op == BinOp::Minus) {
-            return valp(new FloatValue(val-v1));
-        } else if (op == BinOp::Lteq) {
-            return valp(new BoolValue(val<=v1));
-        } else if (op == BinOp::Lt) {
-            return valp(new BoolValue(val<v1));
-        } else if (op == BinOp::Gt) {
-            return valp(new BoolValue(val>v1));
-        } else if (op == BinOp::Gteq) {
-            return valp(new BoolValue(val>=v1));
-        } else if (op == BinOp::Eq) {
-            return valp(new BoolValue(val==v1));
-        } else if (op == BinOp::Neq) {
-            return valp(new BoolValue(val!=v1));
-        } else throw "Unsupported float operation";
-    } else if (auto v0 = dynamic_pointer_cast<IntValue>(right)) {
-        return binOp(op, valp(new FloatValue(*v0)));
-    } else throw "Unsupported float operation";
+static valp boolOp(BinOp op, bool a, bool b) {
+    switch (op) {
+        case BinOp::Eq: return valp(new BoolValue(a == b));
+        case BinOp::Neq: return valp(new BoolValue(a != b));
+        default: throw runtime_error("Unsupported bool operation");
+    }
 }
 
-void printval(ostream &out, valp arg) {
-    if (auto a = dynamic_pointer_cast<IntValue>(arg)) {
-        out << a->val;
-    } else if (auto a = dynamic_pointer_cast<FloatValue>(arg)) {
-        out << a->val;
-    } else if (auto a = dynamic_pointer_cast<BoolValue>(arg)) {
-        out << ((a->val)?"true":"false");
-    } else {
-        throw "Unsupported type for printing";
+static valp binOp(BinOp op, valp l, valp r) {
+    if (l->kind != r->kind) throw runtime_error("Operands of different types");
+    switch (l->kind) {
+        case ValueKind::Int:
+            return intOp(op, static_cast<IntValue*>(l.get())->val, static_cast<IntValue*>(r.get())->val);
+        case ValueKind::Float:
+            return floatOp(op, static_cast<FloatValue*>(l.get())->val, static_cast<FloatValue*>(r.get())->val);
+        case ValueKind::Bool:
+            return boolOp(op, static_cast<BoolValue*>(l.get())->val, static_cast<BoolValue*>(r.get())->val);
+        default:
+            throw runtime_error("Unsupported binary operation");
     }
 }
 
+static valp unaryOp(UnaryOp op, valp a) {
+    if (op == UnaryOp::Neg && a->kind == ValueKind::Int)
+        return valp(new IntValue(-static_cast<IntValue*>(a.get())->val));
+    if (op == UnaryOp::Neg && a->kind == ValueKind::Float)
+        return valp(new FloatValue(-static_cast<FloatValue*>(a.get())->val));
+    if (op == UnaryOp::Not && a->kind == ValueKind::Bool)
+        return valp(new BoolValue(!static_cast<BoolValue*>(a.get())->val));
+    throw runtime_error("Unsupported unary operation");
+}
+
+// Same format handling as VirtualMachine::printf
 valp NativePrint::exec(InterpreterContext &co, vector<valp> args) {
-    if (args.size() < 1) throw;
-    auto arg = args[0];
-    if (auto a = dynamic_pointer_cast<StringValue>(arg)) {
-        auto str = a->val;
-        int argi = 1;
-
-        for (int i=0;i<str.size();i++) {
-            char c = str[i];
-            if (c == '\\') {
-                i++;
-                char c1 = str[i];
-                if (c1 == '0') break;
-                else if (c1 == 'n') co.out << endl;
-            }
-            else if (c == '%') {
-                i++;
-                char c1 = str[i];
-                if (c1 == 'd' || c1 == 'i') {
-                    printval(co.out, args[argi]);
-                } else if (c1 == 'f' || c1 == 'g') {
-                    printval(co.out, args[argi]);
-                }
-                argi++;
-            } else {
-                co.out << c;
+    if (args.size() < 1 || args[0]->kind != ValueKind::String) throw runtime_error("printf needs a format");
+    auto &str = static_cast<StringValue*>(args[0].get())->val;
+    int argi = 1;
+
+    for (int i=0;i<str.size();i++) {
+        char c = str[i];
+        if (c == '\0') break;
+        if (c == '%') {
+            i++;
+            char c1 = i < str.size() ? str[i] : '\0';
+            if (c1 == 'd' || c1 == 'i' || c1 == 'f' || c1 == 'g') {
+                if (argi >= args.size()) throw runtime_error("Not enough printf arguments");
+                auto a = args[argi++];
+                if (a->kind == ValueKind::Int) co.out << static_cast<IntValue*>(a.get())->val;
+                else if (a->kind == ValueKind::Float) co.out << static_cast<FloatValue*>(a.get())->val;
+                else if (a->kind == ValueKind::Bool) co.out << static_cast<BoolValue*>(a.get())->val;
+                else throw runtime_error("Unsupported type for printing");
             }
+        } else {
+            co.out << c;
         }
-    } 
+    }
     return valp(new NilValue());
 }
 
-StdLib::StdLib() {
-    add("printf", valp(new NativePrint()));
+void interpret(ostream &out, File f) {
+    InterpreterContext ic(out, f);
+    auto main = ic.globals.find(ic.names.intern("main"));
+    if (main == ic.globals.end()) throw runtime_error("No main function");
+    ic.call(main->second, {});
 }
-
-void interpret(ostream &out, block b) {
-    InterpreterContext ic(out);
-    ic.evalBlock(b);
-}
\ No newline at end of file
@@ -2,4 +2,7 @@
 
 #include "AST.h"
 
-void interpret(std::ostream &out, block b);
\ No newline at end of file
+#include <ostream>
+
+// Tree-walking evaluation of a checked program, starting at main
+void interpret(std::ostream &out, File f);
@@ -0,0 +1,288 @@
+#include "Lexer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Character class scans, a vector at a time while a full one fits in the
+// buffer, then byte by byte. Bytes above 0x7f compare as negative so they
+// never fall in an ASCII range.
+#if defined(__AVX2__)
+using vec = __m256i;
+static const size_t W = 32;
+static inline vec load(const char *p) { return _mm256_loadu_si256((const vec*)p); }
+static inline vec set1(char c) { return _mm256_set1_epi8(c); }
+static inline vec eq(vec a, vec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline vec gt(vec a, vec b) { return _mm256_cmpgt_epi8(a, b); }
+static inline vec vor(vec a, vec b) { return _mm256_or_si256(a, b); }
+static inline vec vand(vec a, vec b) { return _mm256_and_si256(a, b); }
+static inline uint32_t movemask(vec a) { return (uint32_t)_mm256_movemask_epi8(a); }
+static const uint32_t allset = 0xffffffff;
+#elif defined(__SSE2__)
+using vec = __m128i;
+static const size_t W = 16;
+static inline vec load(const char *p) { return _mm_loadu_si128((const vec*)p); }
+static inline vec set1(char c) { return _mm_set1_epi8(c); }
+static inline vec eq(vec a, vec b) { return _mm_cmpeq_epi8(a, b); }
+static inline vec gt(vec a, vec b) { return _mm_cmpgt_epi8(a, b); }
+static inline vec vor(vec a, vec b) { return _mm_or_si128(a, b); }
+static inline vec vand(vec a, vec b) { return _mm_and_si128(a, b); }
+static inline uint32_t movemask(vec a) { return (uint32_t)_mm_movemask_epi8(a); }
+static const uint32_t allset = 0xffff;
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+static inline vec inRange(vec v, char lo, char hi) {
+    return vand(gt(v, set1(lo-1)), gt(set1(hi+1), v));
+}
+#endif
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool isIdStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool isIdChar(char c) {
+    return isIdStart(c) || isDigit(c);
+}
+
+static inline bool isHexDigit(char c) {
+    return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static size_t skipSpace(const char *s, size_t i, size_t n) {
+    // Most tokens are separated by a single space or none at all
+    if (i < n && !isSpace(s[i])) return i;
+    if (i+1 < n && !isSpace(s[i+1])) return i+1;
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; i + W <= n; i += W) {
+        vec v = load(s + i);
+        vec m = vor(vor(eq(v, set1(' ')), eq(v, set1('\t'))),
+                    vor(eq(v, set1('\r')), eq(v, set1('\n'))));
+        uint32_t mask = movemask(m);
+        if (mask != allset) return i + __builtin_ctz(~mask);
+    }
+#endif
+    while (i < n && isSpace(s[i])) i++;
+    return i;
+}
+
+static size_t skipIdChars(const char *s, size_t i, size_t n) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; i + W <= n; i += W) {
+        vec v = load(s + i);
+        vec m = vor(vor(inRange(vor(v, set1(0x20)), 'a', 'z'), inRange(v, '0', '9')),
+                    eq(v, set1('_')));
+        uint32_t mask = movemask(m);
+        if (mask != allset) return i + __builtin_ctz(~mask);
+    }
+#endif
+    while (i < n && isIdChar(s[i])) i++;
+    return i;
+}
+
+static size_t findChar(const char *s, size_t i, size_t n, char c) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; i + W <= n; i += W) {
+        uint32_t mask = movemask(eq(load(s + i), set1(c)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < n && s[i] != c) i++;
+    return i;
+}
+
+static size_t findLineEnd(const char *s, size_t i, size_t n) {
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; i + W <= n; i += W) {
+        vec v = load(s + i);
+        uint32_t mask = movemask(vor(eq(v, set1('\n')), eq(v, set1('\r'))));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < n && s[i] != '\n' && s[i] != '\r') i++;
+    return i;
+}
+
+// Keywords are at most 8 characters, so they compare as one integer. The
+// multiplier gives every keyword its own slot in a 32 entry table.
+static const uint64_t keywordHash = 0xf170e9de9463f74b;
+
+static inline unsigned keywordSlot(uint64_t k) {
+    return (k * keywordHash) >> 59;
+}
+
+static uint64_t pack(const char *p, size_t len) {
+    uint64_t k = 0;
+    for (size_t j=0;j<len;j++) k |= (uint64_t)(unsigned char)p[j] << (8*j);
+    return k;
+}
+
+struct KeywordTable {
+    uint64_t keys[32] = {};
+    TokenKind kinds[32];
+
+    KeywordTable() {
+        const pair<const char*, TokenKind> keywords[] = {
+            {"function", TokenKind::Function},
+            {"type", TokenKind::TypeKw},
+            {"while", TokenKind::While},
+            {"if", TokenKind::If},
+            {"elseif", TokenKind::Elseif},
+            {"else", TokenKind::Else},
+            {"for", TokenKind::For},
+            {"in", TokenKind::In},
+            {"break", TokenKind::Break},
+            {"return", TokenKind::Return},
+            {"int", TokenKind::IntKw},
+            {"float", TokenKind::FloatKw},
+            {"bool", TokenKind::BoolKw},
+            {"string", TokenKind::StringKw},
+            {"nil", TokenKind::Nil},
+            {"true", TokenKind::True},
+            {"false", TokenKind::False},
+            {"not", TokenKind::Not},
+            {"and", TokenKind::And},
+            {"or", TokenKind::Or},
+            {"as", TokenKind::As},
+        };
+        fill(kinds, kinds+32, TokenKind::Id);
+        for (auto &kw : keywords) {
+            auto k = pack(kw.first, strlen(kw.first));
+            keys[keywordSlot(k)] = k;
+            kinds[keywordSlot(k)] = kw.second;
+        }
+    }
+};
+
+static const KeywordTable keywordTable;
+
+static inline TokenKind keyword(const char *p, size_t len, size_t avail) {
+    if (len < 2 || len > 8) return TokenKind::Id;
+    uint64_t k;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (avail >= 8) {
+        memcpy(&k, p, 8);
+        if (len < 8) k &= ((uint64_t)1 << (8*len)) - 1;
+    } else
+#endif
+    k = pack(p, len);
+    auto slot = keywordSlot(k);
+    return keywordTable.keys[slot] == k ? keywordTable.kinds[slot] : TokenKind::Id;
+}
+
+// Follows the longest match rule of the ANTLR lexer. Identifiers are left
+// with no symbol, their indices in tokens go to ids for the interning pass.
+static vector<Token> scan(const string &source, vector<uint32_t> &ids) {
+    const char *s = source.data();
+    size_t n = source.size();
+    if (n > UINT32_MAX) throw runtime_error("Source file too large");
+
+    vector<Token> tokens;
+    // Dense code has a token every 2-3 bytes, unused capacity is never touched
+    tokens.reserve(n/2 + 1);
+
+    auto at = [&](size_t j) { return j < n ? s[j] : '\0'; };
+    size_t i = 0;
+    auto push = [&](TokenKind k, size_t len, symid sym = 0) {
+        if (len >= (1 << 24)) throw runtime_error("Token too long");
+        tokens.push_back({(uint32_t)i, (uint32_t)len, k, sym});
+        i += len;
+    };
+
+    while (true) {
+        i = skipSpace(s, i, n);
+        if (i >= n) break;
+
+        char c = s[i];
+        if (isIdStart(c)) {
+            size_t j = skipIdChars(s, i+1, n);
+            if (j-i == 4 && memcmp(s+i, "list", 4) == 0 && at(j) == ' ') push(TokenKind::List, 5);
+            else {
+                auto k = keyword(s+i, j-i, n-i);
+                if (k == TokenKind::Id) ids.push_back(tokens.size());
+                push(k, j-i);
+            }
+        } else if (c == '0' && (at(i+1) == 'x' || at(i+1) == 'X') && isHexDigit(at(i+2))) {
+            size_t j = i+2;
+            while (isHexDigit(at(j))) j++;
+            push(TokenKind::Hex, j-i);
+        } else if (isDigit(c)) {
+            size_t j = i;
+            while (isDigit(at(j))) j++;
+            if (at(j) == '.' && isDigit(at(j+1))) {
+                j++;
+                while (isDigit(at(j))) j++;
+                push(TokenKind::Float, j-i);
+            } else push(TokenKind::Int, j-i);
+        } else if (c == '.' && isDigit(at(i+1))) {
+            size_t j = i+1;
+            while (isDigit(at(j))) j++;
+            push(TokenKind::Float, j-i);
+        } else if (c == '"' || c == '\'') {
+            size_t j = findChar(s, i+1, n, c);
+            if (j < n) push(TokenKind::String, j-i+1);
+            else push(TokenKind::Other, 1);
+        } else if (c == '/' && at(i+1) == '/') {
+            i = findLineEnd(s, i+2, n);
+        } else {
+            char c1 = at(i+1);
+            switch (c) {
+                case '=': if (c1 == '=') push(TokenKind::Eq, 2); else push(TokenKind::Assign, 1); break;
+                case '+': if (c1 == '=') push(TokenKind::PlusAssign, 2); else push(TokenKind::Plus, 1); break;
+                case '*': if (c1 == '=') push(TokenKind::MulAssign, 2); else push(TokenKind::Mul, 1); break;
+                case '/': if (c1 == '=') push(TokenKind::DivAssign, 2); else push(TokenKind::Div, 1); break;
+                case '-':
+                    if (c1 == '=') push(TokenKind::MinusAssign, 2);
+                    else if (c1 == '>') push(TokenKind::Arrow, 2);
+                    else push(TokenKind::Minus, 1);
+                    break;
+                case '<': if (c1 == '=') push(TokenKind::Lteq, 2); else push(TokenKind::Lt, 1); break;
+                case '>': if (c1 == '=') push(TokenKind::Gteq, 2); else push(TokenKind::Gt, 1); break;
+                case '!': if (c1 == '=') push(TokenKind::Neq, 2); else push(TokenKind::Other, 1); break;
+                case '.': if (c1 == '.') push(TokenKind::DotDot, 2); else push(TokenKind::Dot, 1); break;
+                case '%': push(TokenKind::Mod, 1); break;
+                case '(': push(TokenKind::LParen, 1); break;
+                case ')': push(TokenKind::RParen, 1); break;
+                case '{': push(TokenKind::LBrace, 1); break;
+                case '}': push(TokenKind::RBrace, 1); break;
+                case '[': push(TokenKind::LBracket, 1); break;
+                case ']': push(TokenKind::RBracket, 1); break;
+                case ',': push(TokenKind::Comma, 1); break;
+                case ':': push(TokenKind::Colon, 1); break;
+                default: push(TokenKind::Other, 1); break;
+            }
+        }
+    }
+    tokens.push_back({(uint32_t)n, 0, TokenKind::End, 0});
+    return tokens;
+}
+
+// Interning after the scan keeps the hash table out of its loop, and walks
+// the identifiers in one pass over a compact list
+vector<Token> lex(const string &source, Names &names) {
+    vector<uint32_t> ids;
+    auto tokens = scan(source, ids);
+    const char *s = source.data();
+    for (auto t : ids) tokens[t].sym = names.intern(s + tokens[t].offset, tokens[t].length);
+    return tokens;
+}
+
+int lineOf(const string &source, uint32_t offset) {
+    return 1 + count(source.begin(), source.begin() + min<size_t>(offset, source.size()), '\n');
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Names.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Token set of Philippe.g4, keywords and operators get their own kind
+enum class TokenKind : uint8_t {
+    End, Other,
+    Id, Int, Hex, Float, String,
+
+    Function, TypeKw, While, If, Elseif, Else, For, In, Break, Return,
+    IntKw, FloatKw, BoolKw, StringKw, Nil, List, True, False,
+    Not, And, Or, As,
+
+    Assign, PlusAssign, MinusAssign, MulAssign, DivAssign,
+    LParen, RParen, LBrace, RBrace, LBracket, RBracket,
+    Comma, Colon, Arrow, Dot, DotDot,
+    Mul, Div, Mod, Plus, Minus,
+    Lteq, Lt, Gt, Gteq, Eq, Neq,
+};
+
+// Slice of the source buffer, the text is never copied. A single token
+// can't be longer than 16MB. Identifiers are interned once the whole
+// source is scanned.
+struct Token {
+    uint32_t offset;
+    uint32_t length : 24;
+    TokenKind kind : 8;
+    symid sym;
+
+    std::string text(const std::string &source) const {
+        return source.substr(offset, length);
+    }
+};
+
+std::vector<Token> lex(const std::string &source, Names &names);
+int lineOf(const std::string &source, uint32_t offset);
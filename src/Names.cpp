@@ -0,0 +1,67 @@
+#include "Names.h"
+
+#include <cstring>
+
+using namespace std;
+
+// Eight bytes at a time, identifiers are mostly a single word
+static uint32_t hashName(const char *s, size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15;
+    size_t i = 0;
+    for (; i+8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s+i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccd;
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        for (size_t j=i;j<len;j++) w |= (uint64_t)(unsigned char)s[j] << (8*(j-i));
+        h = (h ^ w) * 0xff51afd7ed558ccd;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+Names::Names() : slots(256, 0) {}
+
+// Index of the slot holding s, or of the empty slot where it would go
+uint64_t Names::probe(const char *s, size_t len, uint32_t h) const {
+    auto mask = slots.size() - 1;
+    for (auto i = h & mask;; i = (i+1) & mask) {
+        auto slot = slots[i];
+        if (!slot) return i;
+        if ((slot >> 32) == h) {
+            auto &n = names[(uint32_t)slot - 1];
+            if (n.size() == len && memcmp(n.data(), s, len) == 0) return i;
+        }
+    }
+}
+
+symid Names::intern(const char *s, size_t len) {
+    uint64_t h = hashName(s, len);
+    auto i = probe(s, len, h);
+    if (slots[i]) return (uint32_t)slots[i] - 1;
+    symid id = names.size();
+    names.emplace_back(s, len);
+    slots[i] = h << 32 | (id + 1);
+    if (names.size() * 2 > slots.size()) grow();
+    return id;
+}
+
+bool Names::find(const string &s, symid &id) const {
+    auto slot = slots[probe(s.data(), s.size(), hashName(s.data(), s.size()))];
+    if (!slot) return false;
+    id = (uint32_t)slot - 1;
+    return true;
+}
+
+void Names::grow() {
+    vector<uint64_t> old(slots.size() * 2, 0);
+    swap(old, slots);
+    auto mask = slots.size() - 1;
+    for (auto slot : old) {
+        if (!slot) continue;
+        auto i = (slot >> 32) & mask;
+        while (slots[i]) i = (i+1) & mask;
+        slots[i] = slot;
+    }
+}
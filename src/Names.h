@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+using symid = uint32_t;
+
+// Identifier interner of one compilation, distinct names get dense ids
+// from 0. Open addressing with linear probing, kept at most half full.
+class Names {
+public:
+    Names();
+    symid intern(const char *s, size_t len);
+    symid intern(const std::string &s) { return intern(s.data(), s.size()); }
+    // Lookup without inserting, safe to call from several threads at once
+    // as long as nobody interns
+    bool find(const std::string &s, symid &id) const;
+    const std::string &name(symid id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+private:
+    std::vector<std::string> names;
+    std::vector<uint64_t> slots; // hash << 32 | id+1, 0 when empty
+    void grow();
+    uint64_t probe(const char *s, size_t len, uint32_t h) const;
+};
+
+// Scoped bindings for every symbol in a single flat table. Ids are dense,
+// so the table is indexed directly. Shadowed values go to an undo log and
+// come back when their scope is popped.
+template<class T>
+class ScopedTable {
+public:
+    T get(symid s) const {
+        return s < values.size() ? values[s] : T();
+    }
+    void set(symid s, T v) {
+        if (s >= values.size()) values.resize(s+1);
+        undo.push_back({s, values[s]});
+        values[s] = v;
+    }
+    void push() {
+        marks.push_back(undo.size());
+    }
+    void pop() {
+        auto mark = marks.back();
+        marks.pop_back();
+        while (undo.size() > mark) {
+            values[undo.back().first] = undo.back().second;
+            undo.pop_back();
+        }
+    }
+
+private:
+    std::vector<T> values;
+    std::vector<std::pair<symid, T>> undo;
+    std::vector<size_t> marks;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "AST.h"
+
+#include <ostream>
+
+// Passes over a checked File, run between parsing and the backends
+
+// Replaces calls to functions that aren't recursive and have at most
+// threshold nodes by a copy of their body, with arguments and locals
+// renamed. Each call considered gets a line in report. Returns how many
+// calls were inlined.
+size_t inlineCalls(File &f, size_t threshold = 40, std::ostream *report = nullptr);
+
+// Splits tuples and objects that never leave the local holding them into
+// a local per field, so they are never built. Returns how many locals were
+// split.
+size_t scalarReplace(File &f);
+
+// Evaluates operators on constants, replaces locals assigned once from a
+// constant by it, and drops the branches and loops a constant condition
+// never takes
+void constFold(File &f);
+
+// Ternaries with arms that can't fail or have side effects become a
+// SelectExp, computing both arms instead of branching on the condition.
+// maxCost bounds the nodes of both arms together: the VM pays a dispatch
+// per node, about what a mispredicted branch costs, so the default only
+// takes arms like (n+1 if c else n). Native code can afford more.
+void ifConvert(File &f, int maxCost = 4);
@@ -0,0 +1,665 @@
+#include "Parser.h"
+#include "Cache.h"
+#include "TimeReport.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+// Binding powers, following the order of the exp alternatives in Philippe.g4
+enum Prec {
+    PrecNone = 0,
+    PrecAs,
+    PrecTernary,
+    PrecOr,
+    PrecAnd,
+    PrecEquality,
+    PrecRelation,
+    PrecAdditive,
+    PrecMultiplicative,
+    PrecUnary,
+    PrecPostfix,
+};
+
+static int binaryPrec(TokenKind k) {
+    switch (k) {
+        case TokenKind::Dot:
+        case TokenKind::LBracket: return PrecPostfix;
+        case TokenKind::Mul:
+        case TokenKind::Div:
+        case TokenKind::Mod: return PrecMultiplicative;
+        case TokenKind::Plus:
+        case TokenKind::Minus: return PrecAdditive;
+        case TokenKind::Lteq:
+        case TokenKind::Lt:
+        case TokenKind::Gt:
+        case TokenKind::Gteq: return PrecRelation;
+        case TokenKind::Eq:
+        case TokenKind::Neq: return PrecEquality;
+        case TokenKind::And: return PrecAnd;
+        case TokenKind::Or: return PrecOr;
+        case TokenKind::If: return PrecTernary;
+        case TokenKind::As: return PrecAs;
+        default: return PrecNone;
+    }
+}
+
+File Parser::parse(const string &source, unsigned jobs, BodyCache *cache) {
+    src = &source;
+    TimeReport none;
+    auto &r = report ? *report : none;
+    r.phase("lex");
+    begin(cache ? cache->names : nullptr);
+    tokens = make_shared<vector<Token>>(lex(source, *ast.names));
+    r.count("tokens", tokens->size());
+    r.phase("signatures");
+    pos = 0;
+    typesHash = 0xcbf29ce484222325;
+    vector<Body> bodies;
+    int tmps = 0;
+    while (peek().kind != TokenKind::End) {
+        parseDef(bodies, tmps);
+    }
+    reserveTmps(tmps);
+    r.phase("bodies");
+    if (!cache) {
+        buildBodies(bodies, jobs);
+        r.end();
+        return end();
+    }
+
+    auto prints = fingerprints(bodies);
+    vector<Body> changed;
+    vector<uint64_t> changedPrints;
+    for (size_t i=0;i<bodies.size();i++) {
+        if (cache->reuse(ast.names->name(bodies[i].name), prints[i], ast)) continue;
+        changed.push_back(bodies[i]);
+        changedPrints.push_back(prints[i]);
+    }
+    buildBodies(changed, jobs);
+    for (size_t i=0;i<changed.size();i++) {
+        cache->store(ast.names->name(changed[i].name), changedPrints[i], ast);
+    }
+    cache->commit(ast);
+    r.end();
+    return end();
+}
+
+// FNV-1a over the kind and text of each token, so layout and comments
+// don't matter
+uint64_t Parser::hashTokens(uint64_t h, size_t from, size_t to) {
+    auto &t = *tokens;
+    for (size_t i=from;i<to;i++) {
+        h = (h ^ (uint8_t)t[i].kind) * 0x100000001b3;
+        auto s = src->data() + t[i].offset;
+        for (uint32_t j=0;j<t[i].length;j++) h = (h ^ (unsigned char)s[j]) * 0x100000001b3;
+    }
+    return h;
+}
+
+// A body only sees object types and function signatures besides its own
+// tokens. Any name in it that is a function pulls in that function's
+// signature, and a name that becomes or stops being one changes the hash.
+vector<uint64_t> Parser::fingerprints(const vector<Body> &bodies) {
+    vector<uint64_t> sigs(ast.names->size(), 0);
+    for (auto &b : bodies) sigs[b.name] = b.sig;
+
+    vector<uint64_t> prints;
+    auto &t = *tokens;
+    for (auto &b : bodies) {
+        uint64_t h = (typesHash ^ b.sig) * 0x100000001b3;
+        h = hashTokens(h, b.begin, b.end);
+        for (size_t i=b.begin;i<b.end;i++) {
+            if (t[i].kind == TokenKind::Id) h = (h ^ sigs[t[i].sym]) * 0x100000001b3;
+        }
+        prints.push_back(h);
+    }
+    return prints;
+}
+
+// Bodies are handed out in source order to a pool of workers, each with its
+// own arena and copy of the global scope. Once one fails no later body is
+// started, but every earlier one still finishes, so the error reported is
+// always the first in the source.
+void Parser::buildBodies(const vector<Body> &bodies, unsigned jobs) {
+    if (bodies.empty()) return;
+    if (!jobs) jobs = max(1u, thread::hardware_concurrency());
+    jobs = min<size_t>(jobs, bodies.size());
+
+    vector<unique_ptr<Parser>> workers;
+    for (unsigned i=0;i<jobs;i++) {
+        workers.emplace_back(new Parser());
+        workers.back()->src = src;
+        workers.back()->tokens = tokens;
+        workers.back()->fork(*this);
+    }
+
+    vector<exception_ptr> errors(bodies.size());
+    atomic<size_t> nextBody(0), firstError(bodies.size());
+    auto work = [&](Parser *w) {
+        ArenaScope s(*w->ast.arena);
+        for (;;) {
+            size_t i = nextBody++;
+            if (i >= bodies.size() || i > firstError) return;
+            try {
+                w->parseBody(bodies[i]);
+            } catch (...) {
+                errors[i] = current_exception();
+                size_t e = firstError;
+                while (i < e && !firstError.compare_exchange_weak(e, i));
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (unsigned i=1;i<jobs;i++) threads.emplace_back(work, workers[i].get());
+    work(workers[0].get());
+    for (auto &t : threads) t.join();
+
+    for (auto &e : errors) {
+        if (e) rethrow_exception(e);
+    }
+    for (auto &w : workers) join(*w);
+}
+
+void Parser::parseBody(const Body &b) {
+    pos = b.begin;
+    beginFunction(b.args, b.ret);
+    endFunction(b.name, b.args, b.ret, flatten(parseStats()));
+}
+
+// Up to the matching '}'. Every multiple assignment has a comma, so there
+// are never more temporaries in a body than commas.
+void Parser::skipBody(int &tmps) {
+    for (int depth = 1; depth;) {
+        switch (peek().kind) {
+            case TokenKind::End: error("'}'");
+            case TokenKind::LBrace: depth++; break;
+            case TokenKind::RBrace: depth--; break;
+            // Multiple assignments take a temporary, for loops three
+            case TokenKind::Comma:
+                tmps++;
+                break;
+            case TokenKind::For:
+                tmps += 3;
+                break;
+            default: break;
+        }
+        next();
+    }
+}
+
+const Token &Parser::peek(int n) {
+    auto i = pos + n;
+    auto &t = *tokens;
+    if (i >= t.size()) return t.back();
+    return t[i];
+}
+
+Token Parser::next() {
+    auto t = peek();
+    if (pos < tokens->size()-1) pos++;
+    return t;
+}
+
+bool Parser::accept(TokenKind k) {
+    if (peek().kind != k) return false;
+    next();
+    return true;
+}
+
+Token Parser::expect(TokenKind k, const char *what) {
+    if (peek().kind != k) error(what);
+    return next();
+}
+
+string Parser::text(const Token &t) {
+    return t.text(*src);
+}
+
+void Parser::error(const char *what) {
+    if (peek().kind == TokenKind::End)
+        throw runtime_error(string("expected ") + what + " before end of file");
+    throw runtime_error("line " + to_string(lineOf(*src, peek().offset)) + " : expected " + what
+        + " before '" + text(peek()) + "'");
+}
+
+void Parser::parseDef(vector<Body> &bodies, int &tmps) {
+    auto start = pos;
+    if (accept(TokenKind::TypeKw)) {
+        auto name = text(expect(TokenKind::Id, "type name"));
+        expect(TokenKind::Assign, "'='");
+        expect(TokenKind::LBrace, "'{'");
+        vector<Arg> args;
+        do {
+            args.push_back(parseArg());
+        } while (peek().kind != TokenKind::RBrace);
+        next();
+        objDef(name, args);
+        typesHash = hashTokens(typesHash, start, pos);
+        return;
+    }
+
+    auto name = expect(TokenKind::Id, "definition").sym;
+    expect(TokenKind::Assign, "'='");
+    expect(TokenKind::Function, "'function'");
+    vector<Arg> args;
+    if (accept(TokenKind::LParen)) args = parseArgs();
+    typep ret;
+    if (accept(TokenKind::Arrow)) ret = parseType();
+    else ret = primitiveType("nil");
+
+    declareFunction(name, args, ret);
+    expect(TokenKind::LBrace, "'{'");
+    auto body = pos;
+    int needed = 0;
+    skipBody(needed);
+    tmps = max(tmps, needed);
+    bodies.push_back({name, args, ret, body, pos, hashTokens(0xcbf29ce484222325, start, body)});
+}
+
+vector<Arg> Parser::parseArgs() {
+    vector<Arg> args;
+    if (accept(TokenKind::RParen)) return args;
+    do {
+        args.push_back(parseArg());
+    } while (accept(TokenKind::Comma));
+    expect(TokenKind::RParen, "')'");
+    return args;
+}
+
+Arg Parser::parseArg() {
+    auto name = expect(TokenKind::Id, "argument name");
+    expect(TokenKind::Colon, "':'");
+    return Arg{text(name), parseType(), name.sym};
+}
+
+// Statements until the closing brace, which is consumed
+vector<statp> Parser::parseStats() {
+    vector<statp> stats;
+    while (!accept(TokenKind::RBrace)) {
+        stats.push_back(parseStat());
+    }
+    return stats;
+}
+
+statp Parser::parseStat() {
+    switch (peek().kind) {
+        case TokenKind::While: {
+            next();
+            expp cond = parseExp();
+            return whileStat(cond, parseStat());
+        }
+        case TokenKind::If: return parseIf();
+        case TokenKind::For: {
+            next();
+            auto name = expect(TokenKind::Id, "loop variable").sym;
+            expect(TokenKind::In, "'in'");
+            expl range;
+            if (accept(TokenKind::LBracket)) {
+                expp first = parseExp();
+                if (accept(TokenKind::DotDot)) {
+                    range = {first, parseExp()};
+                } else {
+                    expl elements = {first};
+                    while (accept(TokenKind::Comma)) elements.push_back(parseExp());
+                    range = {listExp(elements)};
+                }
+                expect(TokenKind::RBracket, "']'");
+            } else range = {parseExp()};
+            forVariable(name, range);
+            return forStat(name, range, parseStat());
+        }
+        case TokenKind::LBrace: {
+            next();
+            return blockStat(parseStats());
+        }
+        case TokenKind::Break: {
+            next();
+            return breakStat();
+        }
+        case TokenKind::Return: {
+            next();
+            expp ret = nullptr;
+            if (startsExp(peek().kind)) ret = parseExp();
+            return returnStat(ret);
+        }
+        case TokenKind::Id: {
+            lexpp l = parseLexp();
+            if (accept(TokenKind::LParen)) {
+                return funcCall(l, parseExpList(TokenKind::RParen));
+            }
+            typep t = nullptr;
+            if (accept(TokenKind::Colon)) t = parseType();
+            l = lexpOptType(l, t);
+
+            auto k = peek().kind;
+            if (k == TokenKind::PlusAssign || k == TokenKind::MinusAssign
+                || k == TokenKind::MulAssign || k == TokenKind::DivAssign) {
+                auto op = text(next());
+                return compoundAssign(op, l, parseExp());
+            }
+
+            vector<lexpp> lefts = {l};
+            while (accept(TokenKind::Comma)) {
+                lefts.push_back(parseLexpOptType());
+            }
+            expect(TokenKind::Assign, "'='");
+            return stdAssign(lefts, parseExp());
+        }
+        default: error("statement");
+    }
+}
+
+statp Parser::parseIf() {
+    expect(TokenKind::If, "'if'");
+    expl conds;
+    vector<statp> bodies;
+    do {
+        conds.push_back(parseExp());
+        bodies.push_back(parseStat());
+    } while (accept(TokenKind::Elseif));
+    statp els = nullptr;
+    if (accept(TokenKind::Else)) els = parseStat();
+    return ifStat(conds, bodies, els);
+}
+
+expp Parser::parseExp(int prec) {
+    expp left = parsePrimary();
+
+    while (true) {
+        auto k = peek().kind;
+        int p = binaryPrec(k);
+        if (p == PrecNone || p < prec) break;
+        if (k == TokenKind::If && !isTernary()) break;
+
+        auto op = next();
+        switch (k) {
+            case TokenKind::Dot:
+                left = memberExp(left, text(expect(TokenKind::Id, "member name")));
+                break;
+            case TokenKind::LBracket: {
+                expp index = parseExp();
+                expect(TokenKind::RBracket, "']'");
+                left = indexExp(left, index);
+                break;
+            }
+            case TokenKind::If: {
+                expp cond = parseExp();
+                expect(TokenKind::Else, "'else'");
+                expp els = parseExp(p+1);
+                left = ternaryExp(left, cond, els);
+                break;
+            }
+            case TokenKind::As:
+                left = castExp(left, parseType());
+                break;
+            default:
+                left = binOp(text(op), left, parseExp(p+1));
+                break;
+        }
+    }
+    return left;
+}
+
+expp Parser::parsePrimary() {
+    auto t = peek();
+    switch (t.kind) {
+        case TokenKind::Nil: next(); return nilExp();
+        case TokenKind::True: next(); return boolExp(true);
+        case TokenKind::False: next(); return boolExp(false);
+        case TokenKind::Int:
+        case TokenKind::Hex: next(); return intExp(text(t));
+        case TokenKind::Float: next(); return floatExp(text(t));
+        case TokenKind::String: next(); return stringExp(text(t));
+        case TokenKind::Minus:
+        case TokenKind::Not: {
+            next();
+            return unaryOp(text(t), parseExp(PrecUnary));
+        }
+        case TokenKind::LBracket: {
+            next();
+            return listExp(parseExpList(TokenKind::RBracket));
+        }
+        case TokenKind::LParen: {
+            next();
+            expp e = parseExp();
+            if (accept(TokenKind::RParen)) return e;
+            expl elements = {e};
+            while (accept(TokenKind::Comma)) elements.push_back(parseExp());
+            expect(TokenKind::RParen, "')'");
+            return tupleExp(elements);
+        }
+        case TokenKind::Id: {
+            if (isObjExp()) {
+                next();
+                next();
+                vector<FieldDef> fields;
+                do {
+                    auto name = text(expect(TokenKind::Id, "field name"));
+                    expect(TokenKind::Assign, "'='");
+                    fields.push_back(FieldDef(name, parseExp()));
+                } while (peek().kind != TokenKind::RBrace);
+                next();
+                return objExp(text(t), fields);
+            }
+            if (isCall()) {
+                lexpp f = parseLexp();
+                expect(TokenKind::LParen, "'('");
+                return callExp(f, parseExpList(TokenKind::RParen));
+            }
+            next();
+            return idExp(t.sym);
+        }
+        default: error("expression");
+    }
+}
+
+// Expressions separated by commas until close, which is consumed
+expl Parser::parseExpList(TokenKind close) {
+    expl l;
+    if (accept(close)) return l;
+    do {
+        l.push_back(parseExp());
+    } while (accept(TokenKind::Comma));
+    expect(close, "closing bracket");
+    return l;
+}
+
+bool Parser::startsExp(TokenKind k) {
+    switch (k) {
+        case TokenKind::Nil:
+        case TokenKind::True:
+        case TokenKind::False:
+        case TokenKind::Int:
+        case TokenKind::Hex:
+        case TokenKind::Float:
+        case TokenKind::String:
+        case TokenKind::Id:
+        case TokenKind::LBracket:
+        case TokenKind::LParen:
+        case TokenKind::Minus:
+        case TokenKind::Not: return true;
+        default: return false;
+    }
+}
+
+// An identifier followed by lexp suffixes and '(' is a call, otherwise the
+// suffixes are member and index expressions
+bool Parser::isCall() {
+    auto &tokens = *this->tokens;
+    size_t i = pos+1;
+    while (i < tokens.size()) {
+        auto k = tokens[i].kind;
+        if (k == TokenKind::Dot && tokens[i+1].kind == TokenKind::Id) i += 2;
+        else if (k == TokenKind::LBracket) {
+            int depth = 0;
+            for (; i < tokens.size(); i++) {
+                if (tokens[i].kind == TokenKind::LBracket) depth++;
+                else if (tokens[i].kind == TokenKind::RBracket && --depth == 0) break;
+            }
+            i++;
+        } else return k == TokenKind::LParen;
+    }
+    return false;
+}
+
+// 'ID {' is ambiguous between an object literal and a block following an
+// expression, declared object types decide
+bool Parser::isObjExp() {
+    return peek(1).kind == TokenKind::LBrace && ast.objectDefinitions.count(text(peek()));
+}
+
+static bool endsExp(TokenKind k) {
+    switch (k) {
+        case TokenKind::Id:
+        case TokenKind::Int:
+        case TokenKind::Hex:
+        case TokenKind::Float:
+        case TokenKind::String:
+        case TokenKind::Nil:
+        case TokenKind::True:
+        case TokenKind::False:
+        case TokenKind::RParen:
+        case TokenKind::RBracket:
+        case TokenKind::RBrace: return true;
+        default: return false;
+    }
+}
+
+// An 'if' after an expression is a ternary only if a matching 'else' comes
+// before the statement it would otherwise start. Statements aren't
+// separated: one starts at an 'if' or at an identifier right after the end
+// of an expression, neither can continue the condition.
+bool Parser::isTernary() {
+    auto &tokens = *this->tokens;
+    int depth = 0;
+    for (size_t i = pos+1; i < tokens.size(); i++) {
+        auto &t = tokens[i];
+        switch (t.kind) {
+            case TokenKind::LParen:
+            case TokenKind::LBracket: depth++; break;
+            case TokenKind::LBrace:
+                if (depth == 0 && !(tokens[i-1].kind == TokenKind::Id
+                    && ast.objectDefinitions.count(text(tokens[i-1])))) return false;
+                depth++;
+                break;
+            case TokenKind::RParen:
+            case TokenKind::RBracket:
+            case TokenKind::RBrace:
+                if (depth == 0) return false;
+                depth--;
+                break;
+            case TokenKind::Else:
+                if (depth == 0) return true;
+                break;
+            case TokenKind::Id:
+                if (depth == 0 && endsExp(tokens[i-1].kind)) return false;
+                break;
+            case TokenKind::If:
+            case TokenKind::End:
+            case TokenKind::Elseif:
+            case TokenKind::While:
+            case TokenKind::For:
+            case TokenKind::Break:
+            case TokenKind::Return:
+                if (depth == 0) return false;
+                break;
+            default: break;
+        }
+    }
+    return false;
+}
+
+lexpp Parser::parseLexp() {
+    auto name = expect(TokenKind::Id, "identifier").sym;
+    vector<SuffixArg> suffixes;
+    while (true) {
+        if (accept(TokenKind::Dot)) {
+            suffixes.push_back({nullptr, text(expect(TokenKind::Id, "member name"))});
+        } else if (accept(TokenKind::LBracket)) {
+            expp index = parseExp();
+            expect(TokenKind::RBracket, "']'");
+            suffixes.push_back({index, ""});
+        } else break;
+    }
+    return lexp(name, suffixes);
+}
+
+lexpp Parser::parseLexpOptType() {
+    lexpp l = parseLexp();
+    typep t = nullptr;
+    if (accept(TokenKind::Colon)) t = parseType();
+    return lexpOptType(l, t);
+}
+
+typep Parser::parseType() {
+    auto k = peek().kind;
+    if (k == TokenKind::Function || k == TokenKind::List) return parseCompositeType();
+    return parseBasicType();
+}
+
+typep Parser::parseBasicType() {
+    auto t = next();
+    switch (t.kind) {
+        case TokenKind::IntKw:
+        case TokenKind::FloatKw:
+        case TokenKind::BoolKw:
+        case TokenKind::StringKw:
+        case TokenKind::Nil: return primitiveType(text(t));
+        case TokenKind::Id: return objType(text(t));
+        case TokenKind::LParen: {
+            vector<typep> types = {parseTypeAux()};
+            do {
+                expect(TokenKind::Comma, "','");
+                types.push_back(parseTypeAux());
+            } while (peek().kind != TokenKind::RParen);
+            next();
+            return tupleType(types);
+        }
+        default:
+            pos--;
+            error("type");
+    }
+}
+
+typep Parser::parseCompositeType() {
+    if (accept(TokenKind::List)) return listType(parseTypeAux());
+
+    expect(TokenKind::Function, "'function'");
+    vector<typep> args;
+    while (startsTypeAux(peek().kind)) {
+        args.push_back(parseTypeAux());
+    }
+    typep ret = nullptr;
+    if (accept(TokenKind::Arrow)) ret = parseTypeAux();
+    return funcType(args, ret);
+}
+
+typep Parser::parseTypeAux() {
+    auto k = peek(1).kind;
+    if (peek().kind == TokenKind::LParen && (k == TokenKind::Function || k == TokenKind::List)) {
+        next();
+        typep t = parseCompositeType();
+        expect(TokenKind::RParen, "')'");
+        return t;
+    }
+    return parseBasicType();
+}
+
+bool Parser::startsTypeAux(TokenKind k) {
+    switch (k) {
+        case TokenKind::IntKw:
+        case TokenKind::FloatKw:
+        case TokenKind::BoolKw:
+        case TokenKind::StringKw:
+        case TokenKind::Nil:
+        case TokenKind::Id:
+        case TokenKind::LParen: return true;
+        default: return false;
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "ASTBuilder.h"
+#include "Lexer.h"
+
+#include <memory>
+
+class BodyCache;
+class TimeReport;
+
+// Hand-written recursive descent parser for Philippe.g4, with Pratt parsing
+// for expressions. Nodes are built directly through ASTBuilder, there is no
+// intermediate parse tree.
+// A first pass reads type definitions and function signatures and skips
+// over bodies, which are then parsed and checked on up to jobs threads
+// (0 for one per core). The result is the same for any number of jobs.
+// Given a cache, bodies whose fingerprint didn't change are taken from it
+// instead.
+class Parser : public ASTBuilder {
+public:
+    File parse(const std::string &source, unsigned jobs = 0, BodyCache *cache = nullptr);
+
+    // Gets the lexing, signature and body phases when set
+    TimeReport *report = nullptr;
+
+private:
+    const std::string *src = nullptr;
+    std::shared_ptr<const std::vector<Token>> tokens;
+    size_t pos = 0;
+
+    // A function whose body is the tokens from begin, after its '{', to
+    // end, after its '}'. sig hashes the tokens of its signature.
+    struct Body {
+        symid name;
+        std::vector<Arg> args;
+        typep ret;
+        size_t begin, end;
+        uint64_t sig;
+    };
+    uint64_t typesHash;
+
+    uint64_t hashTokens(uint64_t h, size_t from, size_t to);
+    std::vector<uint64_t> fingerprints(const std::vector<Body> &bodies);
+
+    std::string text(const Token &t);
+    const Token &peek(int n = 0);
+    Token next();
+    bool accept(TokenKind k);
+    Token expect(TokenKind k, const char *what);
+    [[noreturn]] void error(const char *what);
+
+    void parseDef(std::vector<Body> &bodies, int &tmps);
+    void skipBody(int &tmps);
+    void buildBodies(const std::vector<Body> &bodies, unsigned jobs);
+    void parseBody(const Body &b);
+    std::vector<Arg> parseArgs();
+    Arg parseArg();
+
+    statp parseStat();
+    std::vector<statp> parseStats();
+    statp parseIf();
+
+    expp parseExp(int prec = 0);
+    expp parsePrimary();
+    expl parseExpList(TokenKind close);
+    bool startsExp(TokenKind k);
+    bool isCall();
+    bool isTernary();
+    bool isObjExp();
+
+    lexpp parseLexp();
+    lexpp parseLexpOptType();
+
+    typep parseType();
+    typep parseBasicType();
+    typep parseCompositeType();
+    typep parseTypeAux();
+    bool startsTypeAux(TokenKind k);
+};
@@ -17,21 +17,23 @@ void printexpl(ostream &out, expl l, const char* sep) {
     }
 }
 
+static const char *binOps[] = {
+    "*", "/", "%", "+", "-", "<=", "<", ">", ">=", "==", "!="
+};
+
 void ind(ostream &out, int indent) {
     for (int i=0;i<indent;i++) out << "\t";
 }
 
-expp toRvalue(lexpp l) {
-    expp b = expp(new IdExp(l->name));
+// A called lexp, printed the way the matching rvalue would be
+void printRvalue(ostream &out, lexpp l) {
+    out << l->name;
     for (auto s : l->suffixes) {
-        if (auto ind = dynamic_pointer_cast<ListIndexSuffix>(s)) {
-            b = expp(new IndexExp(b, ind->i));
-        } else if (auto mem = dynamic_pointer_cast<TupleAccessSuffix>(s)) {
-            b = expp(new TupleAccessExp(b, mem->i));
-        } else throw;
+        out << "[";
+        if (s->kind == SuffixKind::ListIndex) print(out, static_cast<ListIndexSuffix*>(s)->i);
+        else out << static_cast<TupleAccessSuffix*>(s)->i;
+        out << "]";
     }
-    return b;
-
 }
 
 void print(ostream &out, File f) {
@@ -59,130 +61,213 @@ void print(ostream &out, File f) {
 }
 
 void print(ostream &out, int indent, statp sb) {
-    if (auto s = dynamic_pointer_cast<BlockStat>(sb)) {
+    if (sb->kind == StatKind::Block) {
         out << "{" << endl;
-        for (auto s0 : s->stats) {
+        for (auto s0 : static_cast<BlockStat*>(sb)->stats) {
             print(out, indent+1, s0);
             out << endl;
         }
         ind(out, indent);
         out << "}";
-    } else {
-        ind(out, indent);
-        if (auto s = dynamic_pointer_cast<FuncCallStat>(sb)) {
-            print(out, toRvalue(s->func));
+        return;
+    }
+    ind(out, indent);
+    switch (sb->kind) {
+        case StatKind::FuncCall: {
+            auto s = static_cast<FuncCallStat*>(sb);
+            printRvalue(out, s->func);
             out << "(";
             printexpl(out, s->args, ", ");
             out << ")";
-        } else if (auto s = dynamic_pointer_cast<WhileStat>(sb)) {
+            break;
+        }
+        case StatKind::While: {
+            auto s = static_cast<WhileStat*>(sb);
             out << "while ";
             print(out, s->cond);
             print(out, indent, s->body);
-        } else if (auto s = dynamic_pointer_cast<IfStat>(sb)) {
+            break;
+        }
+        case StatKind::If: {
+            auto s = static_cast<IfStat*>(sb);
             out << "if ";
             print(out, s->cond);
             print(out, indent, s->thenbody);
             out << "else ";
             print(out, indent, s->elsebody);
-        } else if (auto s = dynamic_pointer_cast<AssignStat>(sb)) {
+            break;
+        }
+        case StatKind::Assign: {
+            auto s = static_cast<AssignStat*>(sb);
             print(out, s->left);
             out << " = ";
             print(out, s->right);
-        } else if (auto s = dynamic_pointer_cast<BreakStat>(sb)) {
+            break;
+        }
+        case StatKind::Break:
             out << "break";
-        } else if (auto s = dynamic_pointer_cast<ReturnStat>(sb)) {
+            break;
+        case StatKind::Return:
             out << "return ";
-            print(out, s->ret);
-        }
+            print(out, static_cast<ReturnStat*>(sb)->ret);
+            break;
+        case StatKind::Block:
+            break;
     }
 }
 
 void print(ostream &out, expp eb) {
-    if (auto e = dynamic_pointer_cast<NilExp>(eb)) {
-        out << "nil";
-
-    } else if (auto e = dynamic_pointer_cast<BoolExp>(eb)) {
-        out << (e->val?"true":"false");
-
-    } else if (auto e = dynamic_pointer_cast<IntExp>(eb)) {
-       out << e->val;
-        
-    } else if (auto e = dynamic_pointer_cast<FloatExp>(eb)) {
-        out << e->val;
-        
-    } else if (auto e = dynamic_pointer_cast<StringExp>(eb)) {
-        out << "\"" << e->val << "\"";
-        
-    } else if (auto e = dynamic_pointer_cast<IdExp>(eb)) {
-        out << e->name;
-        
-    } else if (auto e = dynamic_pointer_cast<ListExp>(eb)) {
-        out << "[";
-        printexpl(out, e->elements, ", ");
-        out << "]";
-        
-    } else if (auto e = dynamic_pointer_cast<TupleExp>(eb)) {
-        out << "(";
-        printexpl(out, e->elements, ", ");
-        out << ")";
-        
-    } else if (auto e = dynamic_pointer_cast<IndexExp>(eb)) {
-        print(out, e->left);
-        out << "[";
-        print(out, e->index);
-        out << "]";
-    } else if (auto e = dynamic_pointer_cast<TupleAccessExp>(eb)) {
-        print(out, e->left);
-        out << "[" << e->index << "]";
-    } else if (auto e = dynamic_pointer_cast<CallExp>(eb)) {
-        print(out, toRvalue(e->func));
-        out << "(";
-        printexpl(out, e->args, ", ");
-        out << ")";  
-    } else if (auto e = dynamic_pointer_cast<TernaryExp>(eb)) {
-        out << "(";
-        print(out, e->then);
-        out << " if ";
-        print(out, e->cond);
-        out << " else ";
-        print(out, e->els);
-        out << ")";
-        
-    } else if (auto e = dynamic_pointer_cast<CastExp>(eb)) {
-        out << "(";
-        print(out, e->e);
-        out << " as ";
-        print(out, e->type);
-        out << ")";
+    switch (eb->kind) {
+        case ExpKind::Nil:
+            out << "nil";
+            break;
+        case ExpKind::Bool:
+            out << (static_cast<BoolExp*>(eb)->val?"true":"false");
+            break;
+        case ExpKind::Int:
+            out << static_cast<IntExp*>(eb)->val;
+            break;
+        case ExpKind::Float:
+            out << static_cast<FloatExp*>(eb)->val;
+            break;
+        case ExpKind::String:
+            out << "\"";
+            for (char c : static_cast<StringExp*>(eb)->val) {
+                if (c == '\n') out << "\\n";
+                else if (c == '\t') out << "\\t";
+                else if (c == '\\') out << "\\\\";
+                else out << c;
+            }
+            out << "\"";
+            break;
+        case ExpKind::Id:
+            out << static_cast<IdExp*>(eb)->name;
+            break;
+        case ExpKind::List:
+            out << "[";
+            printexpl(out, static_cast<ListExp*>(eb)->elements, ", ");
+            out << "]";
+            break;
+        case ExpKind::Tuple:
+            out << "(";
+            printexpl(out, static_cast<TupleExp*>(eb)->elements, ", ");
+            out << ")";
+            break;
+        case ExpKind::Index: {
+            auto e = static_cast<IndexExp*>(eb);
+            print(out, e->left);
+            out << "[";
+            print(out, e->index);
+            out << "]";
+            break;
+        }
+        case ExpKind::TupleAccess: {
+            auto e = static_cast<TupleAccessExp*>(eb);
+            print(out, e->left);
+            out << "[" << e->index << "]";
+            break;
+        }
+        case ExpKind::Call: {
+            auto e = static_cast<CallExp*>(eb);
+            printRvalue(out, e->func);
+            out << "(";
+            printexpl(out, e->args, ", ");
+            out << ")";
+            break;
+        }
+        case ExpKind::Ternary: {
+            auto e = static_cast<TernaryExp*>(eb);
+            out << "(";
+            print(out, e->then);
+            out << " if ";
+            print(out, e->cond);
+            out << " else ";
+            print(out, e->els);
+            out << ")";
+            break;
+        }
+        case ExpKind::Cast: {
+            auto e = static_cast<CastExp*>(eb);
+            out << "(";
+            print(out, e->e);
+            out << " as ";
+            print(out, e->type);
+            out << ")";
+            break;
+        }
+        case ExpKind::BinOp: {
+            auto e = static_cast<BinOpExp*>(eb);
+            out << "(";
+            print(out, e->left);
+            out << " " << binOps[(int)e->op] << " ";
+            print(out, e->right);
+            out << ")";
+            break;
+        }
+        case ExpKind::Logical: {
+            auto e = static_cast<LogicalExp*>(eb);
+            out << "(";
+            print(out, e->left);
+            out << (e->op == LogicalOp::And ? " and " : " or ");
+            print(out, e->right);
+            out << ")";
+            break;
+        }
+        case ExpKind::UnaryOp: {
+            auto e = static_cast<UnaryOpExp*>(eb);
+            out << (e->op == UnaryOp::Neg ? "(-" : "(not ");
+            print(out, e->e);
+            out << ")";
+            break;
+        }
+        case ExpKind::Select: {
+            auto e = static_cast<SelectExp*>(eb);
+            out << "select(";
+            print(out, e->cond);
+            out << ", ";
+            print(out, e->then);
+            out << ", ";
+            print(out, e->els);
+            out << ")";
+            break;
+        }
     }
 }
 
 void print(ostream &out, typep tb) {
-    if (dynamic_pointer_cast<TypeInt>(tb)) out << "int";
-    else if (dynamic_pointer_cast<TypeFloat>(tb)) out << "float";
-    else if (dynamic_pointer_cast<TypeBool>(tb)) out << "bool";
-    else if (dynamic_pointer_cast<TypeString>(tb)) out << "string";
-    else if (dynamic_pointer_cast<TypeNil>(tb)) out << "nil";
-    else if (auto t = dynamic_pointer_cast<TypeTuple>(tb)) {
-        out << "(";
-        for (auto t0 : t->t) {
-            print(out, t0);
-            out << ",";
-        }
-        out << ")";
-    } else if (auto t = dynamic_pointer_cast<TypeObj>(tb)) {
-        out << t->name;
-    } else if (auto t = dynamic_pointer_cast<TypeFunction>(tb)) {
-        out << "function(";
-        for (auto t0 : t->args) {
-            print(out, t0);
-            out << " ";
+    switch (tb->kind) {
+        case TypeKind::Int: out << "int"; break;
+        case TypeKind::Float: out << "float"; break;
+        case TypeKind::Bool: out << "bool"; break;
+        case TypeKind::String: out << "string"; break;
+        case TypeKind::Nil: out << "nil"; break;
+        case TypeKind::Variable: break;
+        case TypeKind::Tuple:
+            out << "(";
+            for (auto t0 : static_cast<TypeTuple*>(tb)->t) {
+                print(out, t0);
+                out << ",";
+            }
+            out << ")";
+            break;
+        case TypeKind::Obj:
+            out << static_cast<TypeObj*>(tb)->name;
+            break;
+        case TypeKind::Function: {
+            auto t = static_cast<TypeFunction*>(tb);
+            out << "function(";
+            for (auto t0 : t->args) {
+                print(out, t0);
+                out << " ";
+            }
+            out << ") -> ";
+            print(out, t->ret);
+            break;
         }
-        out << ") -> ";
-        print(out, t->ret);
-    } else if (auto t = dynamic_pointer_cast<TypeList>(tb)) {
-        out << "list ";
-        print(out, t->t);
+        case TypeKind::List:
+            out << "list ";
+            print(out, static_cast<TypeList*>(tb)->t);
+            break;
     }
 }
 
@@ -190,12 +275,9 @@ void print(ostream &out, lexpp lp) {
     out << lp->name;
     for (auto suf : lp->suffixes) {
         out << "[";
-        if (auto ind = dynamic_pointer_cast<ListIndexSuffix>(suf)) {
-            print(out, ind->i);
-        } else if (auto mem = dynamic_pointer_cast<TupleAccessSuffix>(suf)) {
-            out << mem->i;
-        }
-         out << "]";
+        if (suf->kind == SuffixKind::ListIndex) print(out, static_cast<ListIndexSuffix*>(suf)->i);
+        else out << static_cast<TupleAccessSuffix*>(suf)->i;
+        out << "]";
     }
     if (lp->type) {
         out << " : ";
@@ -0,0 +1,187 @@
+#include "Rewriter.h"
+
+using namespace std;
+
+void Rewriter::run(File &f) {
+    ArenaScope scope(*f.arena);
+    for (auto &d : f.functions) {
+        function = &d.first;
+        d.second.body = rewrite(d.second);
+    }
+    function = nullptr;
+}
+
+block Rewriter::rewrite(const block &b) {
+    block r;
+    for (auto s : b) if (auto n = rewrite(s)) r.push_back(n);
+    return r;
+}
+
+expl Rewriter::rewrite(const expl &l) {
+    expl r;
+    for (auto e : l) r.push_back(rewrite(e));
+    return r;
+}
+
+lexpp Rewriter::rewrite(lexpp l) {
+    vector<Lexpsuffix*> suffixes;
+    bool changed = false;
+    for (auto s : l->suffixes) {
+        if (auto li = as<ListIndexSuffix>(s)) {
+            auto i = rewrite(li->i);
+            if (i != li->i) {
+                s = make<ListIndexSuffix>(i);
+                changed = true;
+            }
+        }
+        suffixes.push_back(s);
+    }
+    if (!changed) return l;
+    return make<Lexp>(l->name, l->sym, suffixes, l->type);
+}
+
+// Rewritten bodies of if and while are never null, they become empty
+static statp orEmpty(statp s) {
+    return s ? s : make<BlockStat>(block());
+}
+
+statp Rewriter::children(statp sb) {
+    switch (sb->kind) {
+        case StatKind::Assign: {
+            auto s = static_cast<AssignStat*>(sb);
+            auto l = rewrite(s->left);
+            auto r = rewrite(s->right);
+            if (l == s->left && r == s->right) return s;
+            return make<AssignStat>(l, r);
+        }
+        case StatKind::FuncCall: {
+            auto s = static_cast<FuncCallStat*>(sb);
+            auto f = rewrite(s->func);
+            auto args = rewrite(s->args);
+            if (f == s->func && args == s->args) return s;
+            return make<FuncCallStat>(f, args);
+        }
+        case StatKind::While: {
+            auto s = static_cast<WhileStat*>(sb);
+            auto c = rewrite(s->cond);
+            auto body = orEmpty(rewrite(s->body));
+            if (c == s->cond && body == s->body) return s;
+            return make<WhileStat>(c, body);
+        }
+        case StatKind::If: {
+            auto s = static_cast<IfStat*>(sb);
+            auto c = rewrite(s->cond);
+            auto then = orEmpty(rewrite(s->thenbody));
+            auto els = s->elsebody ? rewrite(s->elsebody) : nullptr;
+            if (c == s->cond && then == s->thenbody && els == s->elsebody) return s;
+            return make<IfStat>(c, then, els);
+        }
+        case StatKind::Block: {
+            auto s = static_cast<BlockStat*>(sb);
+            auto stats = rewrite(s->stats);
+            if (stats == s->stats) return s;
+            return make<BlockStat>(stats);
+        }
+        case StatKind::Break: return sb;
+        case StatKind::Return: {
+            auto s = static_cast<ReturnStat*>(sb);
+            if (!s->ret) return s;
+            auto r = rewrite(s->ret);
+            if (r == s->ret) return s;
+            return make<ReturnStat>(r);
+        }
+    }
+    throw runtime_error("Unknown statement");
+}
+
+expp Rewriter::children(expp eb) {
+    expp n = eb;
+    switch (eb->kind) {
+        case ExpKind::Nil:
+        case ExpKind::Bool:
+        case ExpKind::Int:
+        case ExpKind::Float:
+        case ExpKind::String:
+        case ExpKind::Id:
+            return eb;
+        case ExpKind::List: {
+            auto e = static_cast<ListExp*>(eb);
+            auto els = rewrite(e->elements);
+            if (els != e->elements) n = make<ListExp>(els);
+            break;
+        }
+        case ExpKind::Tuple: {
+            auto e = static_cast<TupleExp*>(eb);
+            auto els = rewrite(e->elements);
+            if (els != e->elements) n = make<TupleExp>(els);
+            break;
+        }
+        case ExpKind::Index: {
+            auto e = static_cast<IndexExp*>(eb);
+            auto l = rewrite(e->left);
+            auto i = rewrite(e->index);
+            if (l != e->left || i != e->index) n = make<IndexExp>(l, i);
+            break;
+        }
+        case ExpKind::TupleAccess: {
+            auto e = static_cast<TupleAccessExp*>(eb);
+            auto l = rewrite(e->left);
+            if (l != e->left) n = make<TupleAccessExp>(l, e->index, e->type);
+            break;
+        }
+        case ExpKind::Call: {
+            auto e = static_cast<CallExp*>(eb);
+            auto f = rewrite(e->func);
+            auto args = rewrite(e->args);
+            if (f != e->func || args != e->args) n = make<CallExp>(f, args);
+            break;
+        }
+        case ExpKind::Ternary: {
+            auto e = static_cast<TernaryExp*>(eb);
+            auto then = rewrite(e->then);
+            auto c = rewrite(e->cond);
+            auto els = rewrite(e->els);
+            if (then != e->then || c != e->cond || els != e->els)
+                n = make<TernaryExp>(then, c, els);
+            break;
+        }
+        case ExpKind::Cast: {
+            auto e = static_cast<CastExp*>(eb);
+            auto x = rewrite(e->e);
+            if (x != e->e) n = make<CastExp>(x, e->type);
+            break;
+        }
+        case ExpKind::BinOp: {
+            auto e = static_cast<BinOpExp*>(eb);
+            auto l = rewrite(e->left);
+            auto r = rewrite(e->right);
+            if (l != e->left || r != e->right) n = make<BinOpExp>(e->op, l, r, e->type);
+            break;
+        }
+        case ExpKind::UnaryOp: {
+            auto e = static_cast<UnaryOpExp*>(eb);
+            auto x = rewrite(e->e);
+            if (x != e->e) n = make<UnaryOpExp>(e->op, x);
+            break;
+        }
+        case ExpKind::Logical: {
+            auto e = static_cast<LogicalExp*>(eb);
+            auto l = rewrite(e->left);
+            auto r = rewrite(e->right);
+            if (l != e->left || r != e->right) n = make<LogicalExp>(e->op, l, r);
+            break;
+        }
+        case ExpKind::Select: {
+            auto e = static_cast<SelectExp*>(eb);
+            auto c = rewrite(e->cond);
+            auto then = rewrite(e->then);
+            auto els = rewrite(e->els);
+            if (c != e->cond || then != e->then || els != e->els)
+                n = make<SelectExp>(c, then, els);
+            break;
+        }
+    }
+    // Constructors infer some types from the children, keep the checked one
+    n->type = eb->type;
+    return n;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "AST.h"
+
+// Base of the passes transforming a checked File. Every rewrite returns
+// its node unchanged or a new one, nodes are never modified in place:
+// bodies reused from the BodyCache are shared with other compilations.
+// The defaults only rebuild a node when one of its children changed, a
+// pass overrides what it transforms and calls children() for the rest.
+// A statement rewritten to null is removed.
+class Rewriter {
+public:
+    virtual ~Rewriter() {}
+    // New nodes go to the arena of f
+    void run(File &f);
+
+    // Whole body of the function being rewritten
+    virtual block rewrite(const FunctionDef &f) { return rewrite(f.body); }
+    virtual expp rewrite(expp e) { return children(e); }
+    virtual statp rewrite(statp s) { return children(s); }
+    virtual lexpp rewrite(lexpp l);
+    block rewrite(const block &b);
+    expl rewrite(const expl &l);
+
+protected:
+    expp children(expp e);
+    statp children(statp s);
+    // Function whose body is being rewritten
+    const std::string *function = nullptr;
+};
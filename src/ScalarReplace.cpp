@@ -0,0 +1,197 @@
+#include "Optimize.h"
+#include "Rewriter.h"
+
+#include <map>
+#include <set>
+
+using namespace std;
+
+namespace {
+
+bool aggregate(typep t) {
+    return as<TypeTuple>(t) || as<TypeObj>(t);
+}
+
+// Locals holding tuples or objects, and the ways their value can leave
+// them. Reading a field, p[i], and assigning one, p[i] = e, keep it in
+// place; anything else using p as a whole lets it escape.
+class Uses : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    map<symid, typep> locals;
+    set<symid> escaping, mutated;
+    // p = q, both holding the same value afterwards
+    vector<pair<symid, symid>> copies;
+
+    expp rewrite(expp e) override {
+        if (auto t = as<TupleAccessExp>(e)) {
+            if (as<IdExp>(t->left)) return e;
+        }
+        if (auto id = as<IdExp>(e)) {
+            if (aggregate(id->type)) escaping.insert(id->sym);
+            return e;
+        }
+        return children(e);
+    }
+
+    statp rewrite(statp s) override {
+        auto a = as<AssignStat>(s);
+        if (!a) return children(s);
+        auto l = a->left;
+        rewrite(l);
+        if (!l->suffixes.empty()) {
+            if (as<TupleAccessSuffix>(l->suffixes[0])) mutated.insert(l->sym);
+            rewrite(a->right);
+            return s;
+        }
+        if (!aggregate(l->type)) {
+            rewrite(a->right);
+            return s;
+        }
+        locals[l->sym] = l->type;
+        if (auto q = as<IdExp>(a->right)) copies.push_back({l->sym, q->sym});
+        else if (auto t = as<TupleExp>(a->right)) rewrite(t->elements);
+        else {
+            escaping.insert(l->sym);
+            rewrite(a->right);
+        }
+        return s;
+    }
+};
+
+// Every name read by e
+class Reads : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    set<symid> syms;
+    expp rewrite(expp e) override {
+        if (auto id = as<IdExp>(e)) syms.insert(id->sym);
+        return children(e);
+    }
+};
+
+// Tuples and objects that never escape their function are split into a
+// local per field: p = (a, b) becomes p.0 = a; p.1 = b and p[1] reads
+// p.1, a field of an object o is o.name. Fields holding tuples are split
+// in turn on the next round. Copies between such locals are split too,
+// unless one of them has a field assigned: the interpreter shares tuples
+// between copies, a change through one shows through the other.
+class ScalarReplace : public Rewriter {
+public:
+    using Rewriter::rewrite;
+    ScalarReplace(File &f) : f(f) {}
+    size_t replaced = 0;
+
+private:
+    File &f;
+    map<symid, typep> split;
+    map<pair<symid, int>, pair<string, symid>> fields;
+
+    vector<typep> types(typep t) {
+        if (auto tu = as<TypeTuple>(t)) return tu->t;
+        return f.objectDefinitions.at(as<TypeObj>(t)->name).type->t;
+    }
+
+    const pair<string, symid> &field(symid p, int i) {
+        auto &n = fields[{p, i}];
+        if (n.first.empty()) {
+            string suffix = to_string(i);
+            if (auto o = as<TypeObj>(split[p])) {
+                for (auto &fd : f.objectDefinitions.at(o->name).fields) {
+                    if (fd.second == i) suffix = fd.first;
+                }
+            }
+            n.first = f.names->name(p) + "." + suffix;
+            n.second = f.names->intern(n.first);
+        }
+        return n;
+    }
+
+    lexpp fieldLexp(symid p, int i, vector<Lexpsuffix*> suffixes, typep t) {
+        auto &n = field(p, i);
+        return make<Lexp>(n.first, n.second, suffixes, t);
+    }
+
+    expp fieldExp(symid p, int i, typep t) {
+        auto &n = field(p, i);
+        return make<IdExp>(t, n.first, n.second);
+    }
+
+    block rewrite(const FunctionDef &d) override {
+        Uses u;
+        for (auto &a : d.args) u.escaping.insert(a.sym);
+        u.rewrite(d.body);
+        split.clear();
+        for (auto &l : u.locals) if (!u.escaping.count(l.first)) split.insert(l);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto &c : u.copies) {
+                if (split.count(c.first) && split.count(c.second)
+                    && !u.mutated.count(c.first) && !u.mutated.count(c.second)) continue;
+                if (split.erase(c.first) + split.erase(c.second)) changed = true;
+            }
+        }
+        if (split.empty()) return d.body;
+        replaced += split.size();
+        return rewrite(d.body);
+    }
+
+    expp rewrite(expp eb) override {
+        auto e = children(eb);
+        if (auto t = as<TupleAccessExp>(e)) {
+            auto id = as<IdExp>(t->left);
+            if (id && split.count(id->sym)) return fieldExp(id->sym, t->index, t->type);
+        }
+        return e;
+    }
+
+    statp rewrite(statp sb) override {
+        auto a = as<AssignStat>(sb);
+        if (!a || !split.count(a->left->sym)) return children(sb);
+        auto p = a->left->sym;
+        auto l = rewrite(a->left);
+        auto r = rewrite(a->right);
+        if (!l->suffixes.empty()) {
+            auto i = static_cast<TupleAccessSuffix*>(l->suffixes[0])->i;
+            vector<Lexpsuffix*> rest(l->suffixes.begin() + 1, l->suffixes.end());
+            return make<AssignStat>(fieldLexp(p, i, rest, l->type), r);
+        }
+        auto t = types(split[p]);
+        block out;
+        if (auto q = as<IdExp>(r)) {
+            if (q->sym == p) return nullptr;
+            for (size_t i=0;i<t.size();i++)
+                out.push_back(make<AssignStat>(fieldLexp(p, i, {}, t[i]), fieldExp(q->sym, i, t[i])));
+            return make<BlockStat>(out);
+        }
+        // p = (p[1], p[0]) reads all of p before writing any of it
+        auto &els = static_cast<TupleExp*>(r)->elements;
+        Reads reads;
+        reads.rewrite(els);
+        bool self = false;
+        for (size_t i=0;i<t.size();i++) if (reads.syms.count(field(p, i).second)) self = true;
+        for (size_t i=0;i<t.size();i++) {
+            if (!self) {
+                out.push_back(make<AssignStat>(fieldLexp(p, i, {}, t[i]), els[i]));
+                continue;
+            }
+            auto name = "$" + field(p, i).first;
+            auto sym = f.names->intern(name);
+            out.insert(out.begin() + i, make<AssignStat>(make<Lexp>(name, sym, vector<Lexpsuffix*>(), t[i]), els[i]));
+            out.push_back(make<AssignStat>(fieldLexp(p, i, {}, t[i]), make<IdExp>(t[i], name, sym)));
+        }
+        return make<BlockStat>(out);
+    }
+};
+
+}
+
+size_t scalarReplace(File &f) {
+    size_t total = 0;
+    for (;;) {
+        ScalarReplace s(f);
+        s.run(f);
+        if (!s.replaced) return total;
+        total += s.replaced;
+    }
+}
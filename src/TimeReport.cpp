@@ -0,0 +1,96 @@
+#include "TimeReport.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+
+#include <sys/resource.h>
+#include <time.h>
+
+using namespace std;
+
+static double wallNow() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Every thread of the process
+static double cpuNow() {
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Linux keeps one high-water mark of the resident set, clearing it at the
+// start of a phase makes it the peak of that phase. Elsewhere the peak is
+// the one of the whole run so far.
+static void resetPeakRss() {
+    ofstream("/proc/self/clear_refs") << "5";
+}
+
+static uint64_t peakRss() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) return stoull(line.substr(6)) * 1024;
+    }
+    rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    return (uint64_t)r.ru_maxrss * 1024;
+}
+
+void TimeReport::phase(const char *name) {
+    if (!enabled) return;
+    end();
+    resetPeakRss();
+    current = name;
+    wallStart = wallNow();
+    cpuStart = cpuNow();
+}
+
+void TimeReport::end() {
+    if (!enabled || !current) return;
+    double wall = wallNow() - wallStart;
+    double cpu = cpuNow() - cpuStart;
+    phases.push_back({current, wall, cpu, peakRss()});
+    current = nullptr;
+}
+
+void TimeReport::count(const char *what, uint64_t n) {
+    if (!enabled) return;
+    counts.push_back({what, n});
+}
+
+void TimeReport::print(ostream &out) const {
+    auto flags = out.flags();
+    double wall = 0, cpu = 0;
+    out << left << setw(16) << "phase" << right << setw(12) << "wall ms" << setw(12) << "cpu ms"
+        << setw(14) << "peak rss KB" << endl;
+    out << fixed << setprecision(3);
+    for (auto &p : phases) {
+        out << left << setw(16) << p.name << right << setw(12) << p.wall*1e3 << setw(12) << p.cpu*1e3
+            << setw(14) << p.peakRss/1024 << endl;
+        wall += p.wall;
+        cpu += p.cpu;
+    }
+    out << left << setw(16) << "total" << right << setw(12) << wall*1e3 << setw(12) << cpu*1e3 << endl;
+    for (auto &c : counts) {
+        out << left << setw(16) << c.first << right << setw(12) << c.second << endl;
+    }
+    out.flags(flags);
+}
+
+void TimeReport::printJson(ostream &out) const {
+    out << "{\"phases\":[";
+    for (size_t i=0;i<phases.size();i++) {
+        auto &p = phases[i];
+        if (i) out << ",";
+        out << "{\"name\":\"" << p.name << "\",\"wall\":" << p.wall << ",\"cpu\":" << p.cpu
+            << ",\"peak_rss\":" << p.peakRss << "}";
+    }
+    out << "],\"counts\":{";
+    for (size_t i=0;i<counts.size();i++) {
+        if (i) out << ",";
+        out << "\"" << counts[i].first << "\":" << counts[i].second;
+    }
+    out << "}}" << endl;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Wall and CPU time and peak RSS of each phase of a run, along with counts
+// of what the phases produced. Phases follow each other, starting one ends
+// the previous. Nothing is measured unless enabled, and even then only a
+// few clock reads happen per phase, so it stays compiled in.
+class TimeReport {
+public:
+    bool enabled = false;
+
+    void phase(const char *name);
+    void end();
+    void count(const char *what, uint64_t n);
+
+    void print(std::ostream &out) const;
+    void printJson(std::ostream &out) const;
+
+private:
+    struct Phase {
+        const char *name;
+        double wall, cpu;
+        uint64_t peakRss;
+    };
+    std::vector<Phase> phases;
+    std::vector<std::pair<const char*, uint64_t>> counts;
+
+    const char *current = nullptr;
+    double wallStart, cpuStart;
+};
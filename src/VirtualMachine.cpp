@@ -1,5 +1,9 @@
 #include "VirtualMachine.h"
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
 double asfloat(int64_t a) {
     return *(double*)(&a);
 }
@@ -31,9 +35,9 @@ void VirtualMachine::step() {
             PC += 2; break;
         }
         case Alloc: {
-            auto p = RAM;
-            RAM += instr1;
             operandStack.push(RAM);
+            RAM += instr1;
+            if (RAM > memory.size()) memory.resize(RAM);
             PC += 2;
             break;
         }
@@ -44,11 +48,22 @@ void VirtualMachine::step() {
                 (this->*func)();
                 PC += 2;
             } else {
-                addressStack.push(PC);
+                addressStack.push(PC + 2);
                 PC = instr1;
             }
             break;
         }
+        // Nothing to come back to, the callee's Return goes where the
+        // current function would have
+        case TailCall: {
+            if (instr1 >= RESERVED_FUNCS) {
+                auto func = stdlib[instr1];
+                (this->*func)();
+                PC = addressStack.top();
+                addressStack.pop();
+            } else PC = instr1;
+            break;
+        }
         case Return: {
             PC = addressStack.top();
             addressStack.pop();
@@ -152,6 +167,7 @@ void VirtualMachine::step() {
             operandStack.pop();
             int64_t b=operandStack.top();
             operandStack.pop();
+            if (b == 0) throw std::runtime_error("Division by zero");
             operandStack.push(a/b); 
             PC++; break;
         }
@@ -168,6 +184,7 @@ void VirtualMachine::step() {
             operandStack.pop();
             int64_t b=operandStack.top();
             operandStack.pop();
+            if (b == 0) throw std::runtime_error("Division by zero");
             operandStack.push(a%b); 
             PC++; break;
         }
@@ -216,7 +233,7 @@ void VirtualMachine::step() {
             operandStack.pop();
             double b=asfloat(operandStack.top());
             operandStack.pop();
-            operandStack.push(asint(a <= b)); 
+            operandStack.push(a <= b); 
             PC++; break;
         }
         case Lti: {
@@ -232,7 +249,7 @@ void VirtualMachine::step() {
             operandStack.pop();
             double b=asfloat(operandStack.top());
             operandStack.pop();
-            operandStack.push(asint(a < b)); 
+            operandStack.push(a < b); 
             PC++; break;
         }
         case Gti: {
@@ -248,7 +265,7 @@ void VirtualMachine::step() {
             operandStack.pop();
             double b=asfloat(operandStack.top());
             operandStack.pop();
-            operandStack.push(asint(a > b)); 
+            operandStack.push(a > b); 
             PC++; break;
         }
         case Gteqi: {
@@ -264,7 +281,7 @@ void VirtualMachine::step() {
             operandStack.pop();
             double b=asfloat(operandStack.top());
             operandStack.pop();
-            operandStack.push(asint(a >= b)); 
+            operandStack.push(a >= b); 
             PC++; break;
         }
         case Eqi: {
@@ -280,7 +297,7 @@ void VirtualMachine::step() {
             operandStack.pop();
             double b=asfloat(operandStack.top());
             operandStack.pop();
-            operandStack.push(asint(a == b)); 
+            operandStack.push(a == b); 
             PC++; break;
         }
         case Neqi: {
@@ -296,13 +313,102 @@ void VirtualMachine::step() {
             operandStack.pop();
             double b=asfloat(operandStack.top());
             operandStack.pop();
-            operandStack.push(asint(a != b)); 
+            operandStack.push(a != b); 
+            PC++; break;
+        }
+        case LoadP: {
+            auto a = operandStack.top();
+            operandStack.pop();
+            if ((uint64_t)a >= memory.size()) throw std::runtime_error("Bad address");
+            operandStack.push(memory[a]);
+            PC++; break;
+        }
+        case StoreP: {
+            auto a = operandStack.top();
+            operandStack.pop();
+            if ((uint64_t)a >= memory.size()) throw std::runtime_error("Bad address");
+            memory[a] = operandStack.top();
+            operandStack.pop();
+            PC++; break;
+        }
+        case LoadField: {
+            uint64_t a = operandStack.top() + instr1;
+            operandStack.pop();
+            if (a >= memory.size()) throw std::runtime_error("Bad address");
+            operandStack.push(memory[a]);
+            PC += 2; break;
+        }
+        case StoreField: {
+            uint64_t a = operandStack.top() + instr1;
+            operandStack.pop();
+            if (a >= memory.size()) throw std::runtime_error("Bad address");
+            memory[a] = operandStack.top();
+            operandStack.pop();
+            PC += 2; break;
+        }
+        case LoadL: {
+            auto i = operandStack.top();
+            operandStack.pop();
+            auto a = operandStack.top();
+            operandStack.pop();
+            operandStack.push(memory[element(a, i)]);
+            PC++; break;
+        }
+        case StoreL: {
+            auto i = operandStack.top();
+            operandStack.pop();
+            auto a = operandStack.top();
+            operandStack.pop();
+            memory[element(a, i)] = operandStack.top();
+            operandStack.pop();
+            PC++; break;
+        }
+        case PushL: {
+            auto v = operandStack.top();
+            operandStack.pop();
+            auto a = operandStack.top();
+            operandStack.pop();
+            if (a < 0 || (uint64_t)a + 2 >= memory.size()) throw std::runtime_error("Bad address");
+            auto len = memory[a], cap = memory[a + 1];
+            // Doubled when full, the old buffer is left behind like any
+            // other memory from Alloc
+            if (len == cap) {
+                auto grown = cap ? cap * 2 : 4;
+                auto data = RAM;
+                RAM += grown;
+                if (RAM > memory.size()) memory.resize(RAM);
+                std::copy(memory.begin() + memory[a + 2], memory.begin() + memory[a + 2] + len, memory.begin() + data);
+                memory[a + 1] = grown;
+                memory[a + 2] = data;
+            }
+            memory[memory[a + 2] + len] = v;
+            memory[a] = len + 1;
+            PC++; break;
+        }
+        case Select: {
+            // cond, then value, else value from the top. Picked with a mask
+            // so the host has no data-dependent branch either.
+            int64_t c = operandStack.top();
+            operandStack.pop();
+            int64_t a = operandStack.top();
+            operandStack.pop();
+            int64_t b = operandStack.top();
+            operandStack.pop();
+            int64_t mask = -(int64_t)(c != 0);
+            operandStack.push(b ^ ((a ^ b) & mask));
             PC++; break;
         }
         default: break;
     }
 }
 
+// Address of the element at i of the list at a, checked against its length
+uint64_t VirtualMachine::element(int64_t a, int64_t i) {
+    if (a < 0 || (uint64_t)a + 2 >= memory.size()) throw std::runtime_error("Bad address");
+    if ((uint64_t)i >= (uint64_t)memory[a]) throw std::runtime_error("List index out of range");
+    return memory[a + 2] + i;
+}
+
 void VirtualMachine::run() {
     if (PC >= memory.size()) return;
 
@@ -313,28 +419,93 @@ void VirtualMachine::run() {
     }
 }
 
-void VirtualMachine::printf() {
-    auto straddress = operandStack.top();
+int64_t VirtualMachine::pop() {
+    auto v = operandStack.top();
     operandStack.pop();
+    return v;
+}
 
-    while (true) {
-        char c = (char)memory[straddress];
+// Bytes of the string at a, checked to be in memory
+const char *VirtualMachine::bytes(int64_t a, int64_t &length) {
+    if (a < 0 || (uint64_t)a >= memory.size()) throw std::runtime_error("Bad address");
+    length = memory[a];
+    if (length < 0 || (uint64_t)length > (memory.size() - a - 1) * sizeof(int64_t))
+        throw std::runtime_error("Bad string");
+    return (const char*)&memory[a + 1];
+}
+
+// Allocated like Alloc, its address pushed
+char *VirtualMachine::newString(int64_t length) {
+    auto a = RAM;
+    RAM += 1 + (length + sizeof(int64_t) - 1) / sizeof(int64_t);
+    if (RAM > memory.size()) memory.resize(RAM);
+    memory[a] = length;
+    operandStack.push(a);
+    return (char*)&memory[a + 1];
+}
+
+void VirtualMachine::printf() {
+    int64_t length;
+    auto format = bytes(pop(), length);
+
+    for (int64_t i=0;i<length;i++) {
+        char c = format[i];
         if (c == '\0') break;
         if (c == '%') {
-            straddress++;
-            char c1 = (char)memory[straddress];
+            i++;
+            char c1 = i < length ? format[i] : '\0';
             if (c1 == 'd' || c1 == 'i') {
-                auto v = operandStack.top();
-                operandStack.pop();
-                out << v;
+                out << pop();
             } else if (c1 == 'f' || c1 == 'g') {
-                auto v = asfloat(operandStack.top());
-                operandStack.pop();
-                out << v;
+                out << asfloat(pop());
             }
         } else {
             out << c;
         }
-        straddress++;
     }
-}
\ No newline at end of file
+}
+
+void VirtualMachine::strlen() {
+    int64_t length;
+    bytes(pop(), length);
+    operandStack.push(length);
+}
+
+// Both strings are read again once the result is allocated, memory may
+// have moved
+void VirtualMachine::strcat() {
+    auto b = pop(), a = pop();
+    int64_t la, lb;
+    bytes(a, la);
+    bytes(b, lb);
+    auto r = newString(la + lb);
+    memcpy(r, bytes(a, la), la);
+    memcpy(r + la, bytes(b, lb), lb);
+}
+
+void VirtualMachine::strcmp() {
+    auto b = pop(), a = pop();
+    int64_t la, lb;
+    auto pa = bytes(a, la);
+    auto pb = bytes(b, lb);
+    int c = memcmp(pa, pb, std::min(la, lb));
+    if (!c) c = (la > lb) - (la < lb);
+    operandStack.push((c > 0) - (c < 0));
+}
+
+void VirtualMachine::substr() {
+    auto n = pop(), start = pop(), s = pop();
+    int64_t length;
+    bytes(s, length);
+    if (start < 0 || n < 0 || start > length || n > length - start)
+        throw std::runtime_error("Substring out of range");
+    auto r = newString(n);
+    memcpy(r, bytes(s, length) + start, n);
+}
+
+vmcode packString(const std::string &s) {
+    vmcode cells(1 + (s.size() + sizeof(int64_t) - 1) / sizeof(int64_t), 0);
+    cells[0] = s.size();
+    memcpy(cells.data() + 1, s.data(), s.size());
+    return cells;
+}
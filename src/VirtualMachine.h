@@ -1,9 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <stack>
 #include <map>
 #include <vector>
 #include <iostream>
+#include <string>
 
 enum Instruction {
     Noop = 0,
@@ -32,16 +34,43 @@ enum Instruction {
     Gteqi, Gteqf,
     Eqi, Eqf,
     Neqi, Neqf,
-    End
+    End,
+    // Appended, so earlier encodings keep their values
+    Select,
+    // Call returning straight to the caller of the current function
+    TailCall,
+    // Through an address on the operand stack, for memory from Alloc
+    LoadP, StoreP,
+    // Element of a list, a header of its length, capacity and the address
+    // of its elements. Index on top, then the list, the stored value under
+    // them.
+    LoadL, StoreL,
+    // Appends the value on top to the list under it, reallocating the
+    // elements to twice the capacity when full
+    PushL,
+    // Cell at a fixed offset from the address on top, the stored value
+    // under it
+    LoadField, StoreField,
 };
 
 enum ReservedFuncs {
     RESERVED_FUNCS = 0x0ff0000000000000,
     Printf,
+    // On strings, arguments pushed in order and the result pushed back.
+    // strcmp gives -1, 0 or 1, substr(s, start, n) throws out of s.
+    Strlen, Strcat, Strcmp, Substr,
 };
 
 using vmcode = std::vector<int64_t>;
 
+// Cells hold floats by their bits
+double asfloat(int64_t a);
+int64_t asint(double a);
+
+// A string is its length in bytes, then the bytes packed eight to a cell
+// in host order
+vmcode packString(const std::string &s);
+
 class VirtualMachine {
 public:
     VirtualMachine(std::ostream &o) : out(o) {}
@@ -69,10 +98,23 @@ private:
     std::stack<uint64_t> addressStack;
     std::map<int64_t, void (VirtualMachine::*)()> stdlib = {
         { Printf, &VirtualMachine::printf},
+        { Strlen, &VirtualMachine::strlen},
+        { Strcat, &VirtualMachine::strcat},
+        { Strcmp, &VirtualMachine::strcmp},
+        { Substr, &VirtualMachine::substr},
     };
 
     std::ostream &out;
 
+    uint64_t element(int64_t a, int64_t i);
+    const char *bytes(int64_t a, int64_t &length);
+    char *newString(int64_t length);
+    int64_t pop();
+
     void printf();
+    void strlen();
+    void strcat();
+    void strcmp();
+    void substr();
 
 };
\ No newline at end of file
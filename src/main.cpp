@@ -1,38 +1,337 @@
+#include <fstream>
 #include <iostream>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <antlr4-runtime/antlr4-runtime.h>
 #include "parser/PhilippeParser.h"
 #include "parser/PhilippeLexer.h"
 #include "ASTGen.h"
+#include "Parser.h"
 
+#include "Optimize.h"
+#include "IR.h"
+#include "CodeGen.h"
+#include "CppGen.h"
 #include "Printer.h"
-/*
 #include "Interpreter.h"
-*/
 #include "VirtualMachine.h"
 #include "Assembler.h"
+#include "Cache.h"
+#include "TimeReport.h"
 
 using namespace std;
 using namespace antlr4;
 
-int main() {
+static size_t countNodes(tree::ParseTree *t) {
+    size_t n = 1;
+    for (auto c : t->children) n += countNodes(c);
+    return n;
+}
 
-    ifstream stream("test.phil");
-    ANTLRInputStream input(stream);
+File parseAntlr(const string &source, TimeReport &report) {
+    report.phase("antlr lex");
+    ANTLRInputStream input(source);
     PhilippeLexer lexer(&input);
     CommonTokenStream tokens(&lexer);
+    tokens.fill();
+    report.count("tokens", tokens.size());
+
+    report.phase("antlr parse");
     PhilippeParser parser(&tokens);    
     PhilippeParser::FileContext* tree = parser.file();
+    report.end();
+    if (report.enabled) report.count("parse tree nodes", countNodes(tree));
 
+    report.phase("ast");
     ASTGen gen;
     auto ast = gen.gen(tree);
+    report.end();
+    return ast;
+}
 
-    print(cout, ast);
+File parseAntlr(const string &source) {
+    TimeReport none;
+    return parseAntlr(source, none);
+}
 
-    /*
-    cout << "Interpreter output : " << endl;
-    interpret(cout, ast);
-    */
+int main(int argc, char **argv) {
+
+    string filename = "test.phil";
+    string cachedir = ".phil-cache";
+    bool usecache = true;
+    bool antlr = false;
+    bool checkparsers = false;
+    bool interpreter = false;
+    unsigned jobs = 0;
+    bool watch = false;
+    bool reportJson = false;
+    size_t inlineThreshold = 40;
+    bool inlineReport = false;
+    // 0 runs no pass, 1 the AST passes and dead code elimination, each
+    // level above adds one IR pass, see passesAt. Strength
+    // reduction at 5 is left out by default: on the VM a multiply costs no
+    // more than the add replacing it, and the new variable adds a copy.
+    int level = 4;
+    // -f<pass> and -fno-<pass> add or remove one IR pass from the level's
+    unsigned passesOn = 0, passesOff = 0;
+    map<string, unsigned> passNames = {
+        {"dce", PassDCE}, {"sccp", PassSCCP}, {"gvn", PassGVN}, {"licm", PassLICM}, {"sr", PassSR},
+    };
+    bool vm = false;
+    bool emitIR = false;
+    bool codegen = false;
+    string native;
+    bool emitCpp = false;
+    vector<string> assembly;
+    TimeReport report;
+    for (int i=1;i<argc;i++) {
+        string arg = argv[i];
+        if (arg == "--no-cache") usecache = false;
+        else if (arg == "--antlr") antlr = true;
+        else if (arg == "--check-parsers") checkparsers = true;
+        else if (arg == "--interpret") interpreter = true;
+        else if (arg == "--watch") watch = true;
+        else if (arg == "--time-report") report.enabled = true;
+        else if (arg == "--time-report=json") report.enabled = reportJson = true;
+        else if (arg == "--cache-dir" && i+1 < argc) cachedir = argv[++i];
+        else if (arg == "--jobs" && i+1 < argc) jobs = stoi(argv[++i]);
+        else if (arg == "--inline-threshold" && i+1 < argc) inlineThreshold = stoul(argv[++i]);
+        else if (arg == "--inline-report") inlineReport = true;
+        else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 && arg[2] >= '0' && arg[2] <= '5') level = arg[2] - '0';
+        else if (arg.compare(0, 5, "-fno-") == 0 && passNames.count(arg.substr(5))) passesOff |= passNames[arg.substr(5)];
+        else if (arg.compare(0, 2, "-f") == 0 && passNames.count(arg.substr(2))) passesOn |= passNames[arg.substr(2)];
+        else if (arg == "--vm") vm = true;
+        else if (arg == "--emit-ir") emitIR = true;
+        else if (arg == "--codegen") codegen = true;
+        else if (arg == "--native" && i+1 < argc) native = argv[++i];
+        else if (arg == "--emit-cpp") emitCpp = true;
+        else if (arg.size() > 4 && arg.compare(arg.size()-4, 4, ".asm") == 0) assembly.push_back(arg);
+        else filename = arg;
+    }
+    unsigned passes = (passesAt(level) | passesOn) & ~passesOff;
+
+    // Goes to stderr, stdout only has what was compiled
+    auto finish = [&](const File *ast, const CacheEntry *entry) {
+        report.end();
+        if (!report.enabled) return;
+        if (ast) report.count("ast nodes", ast->arena->nodes());
+        if (entry) report.count("bytecode cells", entry->code.size());
+        if (reportJson) report.printJson(cerr);
+        else report.print(cerr);
+    };
+
+    // Assembly files are assembled to objects next to them, reused while
+    // newer than their source, then linked and run
+    if (!assembly.empty()) {
+        try {
+            report.phase("assemble");
+            vector<ObjectFile> objects;
+            size_t reused = 0;
+            for (auto &f : assembly) {
+                if (usecache) {
+                    bool r;
+                    objects.push_back(assembleFile(f, f.substr(0, f.size()-4) + ".pho", &r));
+                    reused += r;
+                } else {
+                    ifstream in(f);
+                    if (!in) throw runtime_error("Can't open " + f);
+                    stringstream src;
+                    src << in.rdbuf();
+                    objects.push_back(assembleObject(src.str()));
+                }
+            }
+            report.count("objects reused", reused);
+            report.phase("link");
+            auto code = link(objects);
+            report.count("bytecode cells", code.size());
+            report.phase("vm");
+            VirtualMachine machine(cout);
+            machine.load(code);
+            machine.run();
+        } catch (runtime_error &e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        finish(nullptr, nullptr);
+        return 0;
+    }
+
+    report.phase("read");
+    ifstream stream(filename);
+    if (!stream) {
+        cerr << "Can't open " << filename << endl;
+        return 1;
+    }
+    stringstream source;
+    source << stream.rdbuf();
+
+    auto parse = [&](BodyCache *bodies) {
+        if (antlr) return parseAntlr(source.str(), report);
+        Parser p;
+        p.report = &report;
+        return p.parse(source.str(), jobs, bodies);
+    };
+
+    // Native code picks between cheap arms with a conditional move, larger
+    // ones are worth selecting than on the VM
+    auto optimize = [&](File &ast, int selectCost = 4) {
+        if (level < 1) return;
+        report.phase("optimize");
+        report.count("calls inlined", inlineCalls(ast, inlineThreshold, inlineReport ? &cerr : nullptr));
+        report.count("tuples split", scalarReplace(ast));
+        constFold(ast);
+        ifConvert(ast, selectCost);
+    };
+
+    // The ANTLR grammar is the reference, both front-ends must agree on it
+    if (checkparsers) {
+        stringstream reference, handwritten;
+        print(reference, parseAntlr(source.str()));
+        print(handwritten, Parser().parse(source.str(), jobs));
+        if (reference.str() != handwritten.str()) {
+            cerr << "Parsers disagree on " << filename << endl;
+            cerr << reference.str() << "----" << endl << handwritten.str();
+            return 1;
+        }
+        cout << "Parsers agree on " << filename << endl;
+        return 0;
+    }
+
+    if (interpreter) {
+        File ast = parse(nullptr);
+        optimize(ast);
+        report.phase("interpret");
+        interpret(cout, ast);
+        finish(&ast, nullptr);
+        return 0;
+    }
+
+    // Ahead of time through C++, to an executable or printed
+    if (!native.empty() || emitCpp) {
+        File ast = parse(nullptr);
+        optimize(ast, 16);
+        if (emitCpp) {
+            report.phase("c++");
+            cout << genCpp(ast);
+        } else {
+            report.phase("g++");
+            compileNative(ast, native);
+        }
+        finish(&ast, nullptr);
+        return 0;
+    }
+
+    // Through the IR to bytecode, run right away. Programs the IR doesn't
+    // take, or all of them with --codegen, are compiled straight from the
+    // AST instead.
+    if (vm || emitIR) {
+        File ast = parse(nullptr);
+        optimize(ast);
+        Module m;
+        bool ir = !codegen;
+        if (ir) {
+            report.phase("ir");
+            try {
+                m = buildIR(ast);
+            } catch (runtime_error &) {
+                if (emitIR) throw;
+                ir = false;
+            }
+        }
+        vmcode code;
+        if (ir) {
+            report.phase("ir passes");
+            ::optimize(m, passes);
+            if (emitIR) {
+                print(cout, m);
+                finish(&ast, nullptr);
+                return 0;
+            }
+            report.phase("lower");
+            code = lower(m);
+        } else {
+            report.phase("codegen");
+            code = genCode(ast);
+        }
+        report.count("bytecode cells", code.size());
+        report.phase("vm");
+        VirtualMachine machine(cout);
+        machine.load(code);
+        machine.run();
+        finish(&ast, nullptr);
+        return 0;
+    }
+
+    CompileCache cache(cachedir, 64 << 20);
+
+    // Recompile whenever the file changes, reusing bodies from the previous
+    // round in memory
+    if (watch) {
+        BodyCache bodies(usecache ? &cache : nullptr, filename);
+        timespec seen = {0, 0};
+        for (;;) {
+            struct stat st;
+            if (stat(filename.c_str(), &st) == 0
+                && (st.st_mtim.tv_sec != seen.tv_sec || st.st_mtim.tv_nsec != seen.tv_nsec)) {
+                seen = st.st_mtim;
+                ifstream in(filename);
+                stringstream src;
+                src << in.rdbuf();
+                bodies.reused = bodies.rebuilt = 0;
+                try {
+                    File ast = Parser().parse(src.str(), jobs, &bodies);
+                    optimize(ast);
+                    print(cout, ast);
+                    cerr << "Rebuilt " << bodies.rebuilt << " functions, reused " << bodies.reused << endl;
+                } catch (exception &e) {
+                    cerr << e.what() << endl;
+                }
+            }
+            usleep(200000);
+        }
+    }
+
+    report.phase("cache lookup");
+    // The printed AST and the image depend on these besides the source
+    stringstream options;
+    options << "-O" << level << " --passes " << passes << " --inline-threshold " << inlineThreshold << (antlr ? " --antlr" : "");
+    auto key = cache.key(source.str(), options.str());
+    CacheEntry entry;
+    bool hit = usecache && cache.lookup(key, entry);
+    report.count("cache hits", hit);
+    if (hit) {
+        cout << entry.ast;
+        finish(nullptr, &entry);
+        return 0;
+    }
+
+    // Functions that didn't change since this file was last compiled are
+    // still in the cache
+    File ast;
+    if (usecache) {
+        report.phase("body cache load");
+        BodyCache bodies(&cache, filename);
+        ast = parse(&bodies);
+        report.count("bodies reused", bodies.reused);
+        report.count("bodies rebuilt", bodies.rebuilt);
+    } else ast = parse(nullptr);
+    optimize(ast);
+
+    report.phase("print");
+    stringstream printed;
+    print(printed, ast);
+    entry.ast = printed.str();
+    cout << entry.ast;
+
+    report.phase("codegen");
+    entry.code = genCode(ast);
+
+    report.phase("cache store");
+    if (usecache) cache.store(key, entry);
+    finish(&ast, &entry);
 
     /*
     VirtualMachine m(cout);
@@ -83,7 +382,7 @@ int main() {
         Jump, 8,
 
         End, Noop, // 74
-        '%', 'd', '\n', '\0' // printf string, 76
+        3, '%' | 'd' << 8 | '\n' << 16 // printf string, 76
     });
 
     m.load(assemble(R"(
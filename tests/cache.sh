@@ -0,0 +1,142 @@
+#!/bin/sh
+# Compiles and assembles the same programs twice in a scratch directory,
+# checking through the counts of --time-report=json what the compile cache,
+# the body cache and object files reuse. Takes the compiler to run.
+
+main=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+fail() {
+    echo "cachetest: $*"
+    exit 1
+}
+
+# count <name> <report>: value of a count in a json report
+count() {
+    sed -n "s/.*\"$1\":\([0-9]*\).*/\1/p" "$2"
+}
+
+# expect <name> <value> <report> <what>
+expect() {
+    n=$(count "$1" "$3")
+    [ "$n" = "$2" ] || fail "$4: $1 is ${n:-missing}, expected $2"
+}
+
+# compile <output> <report> <options...>: compile p.phil with the cache
+compile() {
+    out=$1
+    rep=$2
+    shift 2
+    "$main" --cache-dir cache --time-report=json "$@" p.phil > "$out" 2> "$rep" || fail "compiling p.phil $*"
+}
+
+cat > p.phil <<'EOF'
+f = function(a : int) -> int {
+    return a * 2
+}
+
+g = function(a : int) -> int {
+    return a + 1
+}
+
+main = function {
+    printf("%d\n", f(g(3)))
+}
+EOF
+
+compile ast1 r1
+expect "cache hits" 0 r1 "first compile"
+expect "bodies reused" 0 r1 "first compile"
+
+compile ast2 r2
+expect "cache hits" 1 r2 "second compile"
+cmp -s ast1 ast2 || fail "a cache hit printed another AST"
+
+# Options the output depends on are part of the key
+compile ast3 r3 -O0
+expect "cache hits" 0 r3 "compile at -O0"
+compile ast3 r3 -O0
+expect "cache hits" 1 r3 "second compile at -O0"
+compile ast3 r3 -fno-gvn
+expect "cache hits" 0 r3 "compile with -fno-gvn"
+compile ast3 r3 --inline-threshold 0
+expect "cache hits" 0 r3 "compile with --inline-threshold 0"
+
+# Only the edited function is checked again, its callers keep its signature
+sed 's/a + 1/a + 2/' p.phil > p.new && mv p.new p.phil
+compile ast4 r4
+expect "cache hits" 0 r4 "compile after editing g"
+expect "bodies reused" 2 r4 "compile after editing g"
+expect "bodies rebuilt" 1 r4 "compile after editing g"
+cmp -s ast1 ast4 && fail "editing g didn't change the AST"
+
+# Objects are written next to their source and read back while newer
+cat > a.asm <<'EOF'
+    extern twice
+    extern count
+    global number
+    loads 21
+    call twice
+    loadm count
+    loads number
+    call printf
+    end
+number: "%d\n"
+EOF
+
+cat > b.asm <<'EOF'
+    global twice
+    global count
+    extern number
+twice:
+    store arg
+    loadm arg
+    loadm arg
+    addi
+    loads number
+    call printf
+    loadm count
+    loads 1
+    addi
+    store count
+    return
+arg: 0
+count: 0
+EOF
+
+# asm <output> <report> <files...>: assemble, link and run
+asm() {
+    out=$1
+    rep=$2
+    shift 2
+    "$main" --time-report=json "$@" > "$out" 2> "$rep"
+}
+
+printf '42\n1\n' > expected
+asm run1 r5 a.asm b.asm || fail "linking a.asm and b.asm"
+cmp -s run1 expected || fail "a.asm and b.asm linked wrong"
+expect "objects reused" 0 r5 "first assembly"
+[ -f a.pho ] && [ -f b.pho ] || fail "no object files written"
+
+asm run2 r6 a.asm b.asm || fail "linking a.pho and b.pho"
+cmp -s run2 expected || fail "objects read back linked wrong"
+expect "objects reused" 2 r6 "second assembly"
+
+# Only the edited module is assembled again
+sed 's/loads 21/loads 5/' a.asm > a.new && mv a.new a.asm
+printf '10\n1\n' > expected
+asm run4 r8 a.asm b.asm || fail "linking after editing a.asm"
+cmp -s run4 expected || fail "edited a.asm linked wrong"
+expect "objects reused" 1 r8 "assembly after editing a.asm"
+
+cat > c.asm <<'EOF'
+    global twice
+twice:
+    return
+EOF
+asm run5 r9 a.asm b.asm c.asm && fail "twice exported twice linked"
+grep -q "exported twice : twice" r9 || fail "no error on twice exported twice"
+
+exit 0
@@ -0,0 +1,62 @@
+    loads hello
+    loads rest
+    call strcat
+    store s
+    loadm s
+    call printf
+
+    loadm s
+    call strlen
+    loads number
+    call printf
+
+    loadm s
+    loads 7
+    loads 5
+    call substr
+    store w
+    loadm w
+    loads newline
+    call strcat
+    call printf
+
+    loadm w
+    loads again
+    call strcmp
+    loads number
+    call printf
+
+    loads hello
+    loads help
+    call strcmp
+    loads number
+    call printf
+
+    loads hello
+    loads hell
+    call strcmp
+    loads number
+    call printf
+
+    loads world
+    call strlen
+    loads number
+    call printf
+
+    loads empty
+    call strlen
+    loads number
+    call printf
+    end
+
+hello: "hello"
+rest: ", world\n"
+world: "world"
+help: "help"
+hell: "hell"
+number: "%d\n"
+again: "world"
+newline: "\n"
+empty: ""
+s: 0
+w: 0
@@ -0,0 +1,39 @@
+    loads 3
+    call count
+    loads 7
+    call twice
+    loads done
+    call printf
+    end
+
+count:
+    store n
+    loads 0
+    loadm n
+    eqi
+    ifjump counted
+    loadm n
+    loads number
+    call printf
+    loads 1
+    loadm n
+    subi
+    tailcall count
+counted:
+    return
+
+twice:
+    store m
+    loadm m
+    loadm m
+    addi
+    tailcall show
+show:
+    loads number
+    call printf
+    return
+
+number: "%d\n"
+done: "done\n"
+n: 0
+m: 0